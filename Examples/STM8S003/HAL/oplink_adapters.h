@@ -90,6 +90,7 @@ extern "C" {
 #define MODE_ADDR    0x4000
 #define SEED_ADDR    0x4001 // 4 bytes reserved for the seed
 #define UID_ADDR     0x4005 // 12 bytes reserved for the UID
+#define KEY_ADDR     0x4011 // 8 bytes reserved for the network key
 
 /* Get the operation mode: 0 = NC, 1 = No UID, 2 = Has UID */
 #define OPL_LOAD_MODE() eeprom_read_uint8(MODE_ADDR)
@@ -97,10 +98,42 @@ extern "C" {
 /* Get a uint32 seed for the srand func, try to keep it random */
 #define OPL_LOAD_SEED() eeprom_read_uint32(SEED_ADDR)
 
+/* Store the seed of the next boot, the nonces must not repeat across resets */
+#define OPL_SAVE_SEED(_seed) eeprom_write_uint32(SEED_ADDR, _seed)
+
 /* Get the unique ID */
 #define OPL_LOAD_UID(_uid_ptr) eeprom_read_string(UID_ADDR, _uid_ptr, UID_SIZE)
 
+/* Get the network key of the authenticated frames, only with OPL_AUTH */
+#define OPL_LOAD_KEY(_key_ptr) eeprom_read_string(KEY_ADDR, _key_ptr, KEY_SIZE)
+
 #endif /* SLAVE */
+
+#ifdef MASTER
+
+#include "eeprom.h"
+
+/* EEPROM addresses */
+#define SLAVES_ADDR  0x4000 // 18 bytes per slave (22 with OPL_AUTH), 5 slaves
+#define COUNTER_ADDR 0x4070 // 4 bytes, broadcast counter with OPL_AUTH
+#define KEY_ADDR     0x4078 // 8 bytes reserved for the network key
+
+/* Persistent slave table, the slaves are resumed after a reset */
+#define OPL_SAVE_SLAVE(_index, _ptr) \
+    eeprom_write_string(SLAVES_ADDR + (_index) * SLAVE_RECORD_SIZE, _ptr, \
+                        SLAVE_RECORD_SIZE)
+#define OPL_LOAD_SLAVE(_index, _ptr) \
+    eeprom_read_string(SLAVES_ADDR + (_index) * SLAVE_RECORD_SIZE, _ptr, \
+                       SLAVE_RECORD_SIZE)
+
+/* Persistent broadcast counter of the authenticated frames */
+#define OPL_SAVE_COUNTER(_counter) eeprom_write_uint32(COUNTER_ADDR, _counter)
+#define OPL_LOAD_COUNTER() eeprom_read_uint32(COUNTER_ADDR)
+
+/* Get the network key of the authenticated frames, only with OPL_AUTH */
+#define OPL_LOAD_KEY(_key_ptr) eeprom_read_string(KEY_ADDR, _key_ptr, KEY_SIZE)
+
+#endif /* MASTER */
 /******************************************************************************/
 
 #ifdef __cplusplus
@@ -0,0 +1,80 @@
+/*
+ * Filename:    frame_mac.c
+ * Project:     OpenPAYGO Link
+ * Author:      Daniel Nedosseikine
+ * Company:     Solaris Offgrid
+ * Created on:  19/10/2026
+ * Description: CBC-MAC of the frames with Speck32/64, updated byte by byte.
+ */
+
+#include "speck.h"
+#include "frame_mac.h"
+
+#if MAC_ROUNDS_PER_BYTE * 4 < SPECK_ROUNDS
+#error "A block must be encrypted before the next one is complete"
+#endif
+
+void frame_mac_init(frame_mac_t *mac, const uint16_t *round_keys) {
+    mac->round_keys = round_keys;
+    mac->x = 0;
+    mac->y = 0;
+    mac->next_x = 0;
+    mac->next_y = 0;
+    mac->fill = 0;
+    mac->round = SPECK_ROUNDS; // Nothing to encrypt
+}
+
+/* Run up to count rounds of the encryption in progress */
+static void mac_rounds(frame_mac_t *mac, uint8_t count) {
+    uint8_t last = mac->round + count;
+
+    if(mac->round >= SPECK_ROUNDS) return;
+    if(last > SPECK_ROUNDS) last = SPECK_ROUNDS;
+    speck_rounds(mac->round_keys, &mac->x, &mac->y, mac->round, last);
+    mac->round = last;
+}
+
+/* Chain the next block and start encrypting it */
+static void mac_chain(frame_mac_t *mac) {
+    mac_rounds(mac, SPECK_ROUNDS); // Only left with a partial block
+    mac->x ^= mac->next_x;
+    mac->y ^= mac->next_y;
+    mac->next_x = 0;
+    mac->next_y = 0;
+    mac->fill = 0;
+    mac->round = 0;
+}
+
+void frame_mac_update(frame_mac_t *mac, uint8_t byte) {
+    switch(mac->fill++) {
+        case 0:
+            mac->next_x ^= (uint16_t)byte << 8;
+            break;
+        case 1:
+            mac->next_x ^= byte;
+            break;
+        case 2:
+            mac->next_y ^= (uint16_t)byte << 8;
+            break;
+        default:
+            mac->next_y ^= byte;
+            break;
+    }
+
+    mac_rounds(mac, MAC_ROUNDS_PER_BYTE);
+    if(mac->fill == 4) mac_chain(mac);
+}
+
+void frame_mac_final(frame_mac_t *mac, uint32_t counter, uint8_t *tag) {
+    if(mac->fill != 0) mac_chain(mac); // Zero padding, the length is known
+
+    mac->next_x = (uint16_t)(counter >> 16);
+    mac->next_y = (uint16_t)counter;
+    mac_chain(mac);
+    mac_rounds(mac, SPECK_ROUNDS);
+
+    tag[0] = (uint8_t)(mac->x >> 8);
+    tag[1] = (uint8_t)mac->x;
+    tag[2] = (uint8_t)(mac->y >> 8);
+    tag[3] = (uint8_t)mac->y;
+}
@@ -0,0 +1,51 @@
+/*
+ * Filename:    frame_mac.h
+ * Project:     OpenPAYGO Link
+ * Author:      Daniel Nedosseikine
+ * Company:     Solaris Offgrid
+ * Created on:  19/10/2026
+ * Description: CBC-MAC of the frames with Speck32/64, updated byte by byte.
+ */
+
+#ifndef FRAME_MAC_H
+#define FRAME_MAC_H 1
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdint.h>
+
+#define MAC_TAG_LEN 4
+#define MAC_ROUNDS_PER_BYTE 6 // A block is encrypted while the next 4 arrive
+
+/* The MAC covers the header, whose meta byte holds the length, so no frame is
+ * the prefix of another. The frame counter is chained after the payload, so a
+ * tag is only valid once, and the key is the one of the session.
+ * Each update runs at most MAC_ROUNDS_PER_BYTE rounds of the previous block,
+ * short enough for the UART ISR of a slow MCU. */
+typedef struct {
+    const uint16_t *round_keys; // See speck_expand_key()
+    uint16_t x; // Chaining value, being encrypted
+    uint16_t y;
+    uint16_t next_x; // Next block, being received
+    uint16_t next_y;
+    uint8_t fill; // Bytes of the next block
+    uint8_t round; // Next round of the encryption in progress
+} frame_mac_t;
+
+/* The round keys can be NULL while the sender is not known, they must be set
+ * before the 4th byte */
+void frame_mac_init(frame_mac_t *mac, const uint16_t *round_keys);
+
+/* Add a byte */
+void frame_mac_update(frame_mac_t *mac, uint8_t byte);
+
+/* Add the counter and write the tag */
+void frame_mac_final(frame_mac_t *mac, uint32_t counter, uint8_t *tag);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* FRAME_MAC_H */
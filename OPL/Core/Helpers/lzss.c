@@ -0,0 +1,187 @@
+/*
+ * Filename:    lzss.c
+ * Project:     OpenPAYGO Link
+ * Author:      Daniel Nedosseikine
+ * Company:     Solaris Offgrid
+ * Created on:  19/10/2026
+ * Description: LZSS compression of short buffers, decoded byte by byte.
+ */
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include "lzss.h"
+
+enum lzss_fields {
+    LZSS_TAG,
+    LZSS_LITERAL,
+    LZSS_INDEX,
+    LZSS_COUNT
+};
+
+/* Compression ****************************************************************/
+typedef struct {
+    uint8_t *dst;
+    uint8_t max;
+    uint8_t len;
+    uint8_t mask; // Next bit of dst[len - 1], 0 if a new byte is needed
+} bit_writer_t;
+
+static bool put_bits(bit_writer_t *w, uint8_t value, uint8_t count) {
+    while(count-- > 0) {
+        if(w->mask == 0) {
+            if(w->len == w->max) return false;
+            w->dst[w->len++] = 0;
+            w->mask = 0x80;
+        }
+        if(value & (1 << count)) w->dst[w->len - 1] |= w->mask;
+        w->mask >>= 1;
+    }
+    return true;
+}
+
+/* The dictionary and the data, as one buffer */
+static const uint8_t *window_src;
+static const uint8_t *window_dict;
+static uint8_t window_dict_len;
+
+static uint8_t window_at(uint8_t i) {
+    if(i < window_dict_len) return window_dict[i];
+    return window_src[i - window_dict_len];
+}
+
+static uint8_t pair_hash(uint8_t i) {
+    return (uint8_t)(window_at(i) * 29 + window_at(i + 1)) >>
+           (8 - LZSS_HASH_BITS);
+}
+
+/* Each bucket keeps the last LZSS_WAYS positions + 1 of its pairs */
+static void insert_pair(uint8_t (*buckets)[LZSS_WAYS], uint8_t i) {
+    uint8_t *bucket = buckets[pair_hash(i)];
+    memmove(bucket + 1, bucket, LZSS_WAYS - 1);
+    bucket[0] = i + 1;
+}
+
+uint8_t lzss_compress(const uint8_t *src, uint8_t len, uint8_t *dst,
+                      uint8_t dst_max, const uint8_t *dict, uint8_t dict_len) {
+    uint8_t buckets[1 << LZSS_HASH_BITS][LZSS_WAYS];
+    bit_writer_t w = {dst, dst_max, 0, 0};
+    uint8_t end = dict_len + len;
+    uint8_t i;
+
+    if((uint16_t)dict_len + len > 0xFF) return 0; // Positions are 8-bit
+
+    window_src = src;
+    window_dict = dict;
+    window_dict_len = dict_len;
+    memset(buckets, 0, sizeof(buckets));
+    for(i = 0; i + 1 < dict_len; i++)
+        insert_pair(buckets, i);
+
+    i = dict_len;
+    while(i < end) {
+        uint8_t match_len = 0;
+        uint8_t dist = 0;
+
+        if(i + 1 < end) { // Longest match among the positions of the pair
+            uint8_t *bucket = buckets[pair_hash(i)];
+            for(uint8_t k = 0; k < LZSS_WAYS && bucket[k] != 0; k++) {
+                uint8_t from = bucket[k] - 1;
+                uint8_t n = 0;
+                while(n < LZSS_MAX_MATCH && i + n < end &&
+                      window_at(from + n) == window_at(i + n))
+                    n++;
+                if(n > match_len) {
+                    match_len = n;
+                    dist = i - from; // Positions are 8-bit, always in window
+                }
+            }
+            insert_pair(buckets, i);
+        }
+
+        if(match_len >= LZSS_MIN_MATCH) {
+            if(!put_bits(&w, 0, 1) ||
+               !put_bits(&w, dist - 1, LZSS_INDEX_BITS) ||
+               !put_bits(&w, match_len - LZSS_MIN_MATCH, LZSS_COUNT_BITS))
+                return 0;
+            for(uint8_t k = 1; k < match_len; k++) { // Pairs inside the match
+                if(i + k + 1 < end) insert_pair(buckets, i + k);
+            }
+            i += match_len;
+        }
+        else {
+            if(!put_bits(&w, 1, 1) || !put_bits(&w, window_at(i), 8))
+                return 0;
+            i++;
+        }
+    }
+    return w.len;
+}
+/******************************************************************************/
+
+/* Decompression **************************************************************/
+void lzss_decoder_init(lzss_decoder_t *dec, uint8_t *out, uint8_t out_len,
+                       const uint8_t *dict, uint8_t dict_len) {
+    dec->out = out;
+    dec->out_len = out_len;
+    dec->dict = dict;
+    dec->dict_len = (dict != NULL) ? dict_len : 0;
+    dec->pos = 0;
+    dec->state = LZSS_TAG;
+    dec->bits = 1;
+    dec->value = 0;
+}
+
+static bool copy_match(lzss_decoder_t *dec, uint8_t count) {
+    uint16_t dist = (uint16_t)dec->index + 1;
+
+    if(dist > (uint16_t)dec->pos + dec->dict_len) return false;
+    if(count > dec->out_len - dec->pos) return false;
+
+    while(count-- > 0) {
+        int16_t from = (int16_t)dec->pos - dist;
+        dec->out[dec->pos++] = (from < 0) ? dec->dict[dec->dict_len + from]
+                                          : dec->out[from];
+    }
+    return true;
+}
+
+static void next_field(lzss_decoder_t *dec, uint8_t state, uint8_t bits) {
+    dec->state = state;
+    dec->bits = bits;
+    dec->value = 0;
+}
+
+bool lzss_decode(lzss_decoder_t *dec, uint8_t b) {
+    if(lzss_done(dec)) return false; // Longer than the encoder makes it
+
+    // The bits left in the last byte once done are padding
+    for(uint8_t mask = 0x80; mask != 0 && !lzss_done(dec); mask >>= 1) {
+        dec->value = (dec->value << 1) | ((b & mask) ? 1 : 0);
+        if(--dec->bits != 0) continue;
+
+        switch(dec->state) {
+            case LZSS_TAG:
+                next_field(dec, dec->value ? LZSS_LITERAL : LZSS_INDEX, 8);
+                break;
+            case LZSS_LITERAL:
+                dec->out[dec->pos++] = dec->value;
+                next_field(dec, LZSS_TAG, 1);
+                break;
+            case LZSS_INDEX:
+                dec->index = dec->value;
+                next_field(dec, LZSS_COUNT, LZSS_COUNT_BITS);
+                break;
+            case LZSS_COUNT:
+                if(!copy_match(dec, dec->value + LZSS_MIN_MATCH)) return false;
+                next_field(dec, LZSS_TAG, 1);
+                break;
+        }
+    }
+    return true;
+}
+
+bool lzss_done(lzss_decoder_t *dec) {
+    return dec->pos == dec->out_len;
+}
+/******************************************************************************/
@@ -0,0 +1,66 @@
+/*
+ * Filename:    lzss.h
+ * Project:     OpenPAYGO Link
+ * Author:      Daniel Nedosseikine
+ * Company:     Solaris Offgrid
+ * Created on:  19/10/2026
+ * Description: LZSS compression of short buffers, decoded byte by byte.
+ */
+
+#ifndef LZSS_H
+#define LZSS_H 1
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdint.h>
+#include <stdbool.h>
+
+/* Bit stream, most significant bit first:
+ * 1 + 8 bit literal
+ * 0 + 8 bit distance - 1 + 4 bit length - 2
+ * The window is the data already decoded, preceded by an optional dictionary
+ * known to both ends, so matches reach up to 256 bytes back. */
+#define LZSS_INDEX_BITS 8
+#define LZSS_COUNT_BITS 4
+#define LZSS_MIN_MATCH  2
+#define LZSS_MAX_MATCH  (LZSS_MIN_MATCH + (1 << LZSS_COUNT_BITS) - 1)
+#define LZSS_WINDOW     (1 << LZSS_INDEX_BITS)
+#define LZSS_HASH_BITS  5 // The compressor uses 4 << 5 bytes of stack
+#define LZSS_WAYS       4
+
+typedef struct {
+    uint8_t *out;
+    uint8_t out_len;
+    const uint8_t *dict;
+    uint8_t dict_len;
+    uint8_t pos; // Bytes decoded
+    uint8_t state; // Field being read
+    uint8_t bits; // Bits of the field still to read
+    uint8_t value;
+    uint8_t index; // Of the match being read
+} lzss_decoder_t;
+
+/* Compress len bytes of src into dst. dict can be NULL. Returns the compressed
+ * length, or 0 if it would be longer than dst_max. Only the last LZSS_WAYS
+ * positions of every hash of byte pairs are tried, so it runs in linear
+ * time. */
+uint8_t lzss_compress(const uint8_t *src, uint8_t len, uint8_t *dst,
+                      uint8_t dst_max, const uint8_t *dict, uint8_t dict_len);
+
+/* Decode into out, which must receive exactly out_len bytes */
+void lzss_decoder_init(lzss_decoder_t *dec, uint8_t *out, uint8_t out_len,
+                       const uint8_t *dict, uint8_t dict_len);
+
+/* Decode the next byte of the stream, returns false if it is corrupted */
+bool lzss_decode(lzss_decoder_t *dec, uint8_t b);
+
+/* All the out_len bytes were decoded */
+bool lzss_done(lzss_decoder_t *dec);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* LZSS_H */
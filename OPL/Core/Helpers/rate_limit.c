@@ -0,0 +1,22 @@
+/*
+ * Filename:    rate_limit.c
+ * Project:     OpenPAYGO Link
+ * Author:      Daniel Nedosseikine
+ * Company:     Solaris Offgrid
+ * Created on:  19/10/2026
+ * Description: Token bucket kept as a theoretical arrival time (GCRA).
+ */
+
+#include "rate_limit.h"
+
+bool rate_limit_allows(uint32_t tat, uint32_t now, uint16_t period,
+                       uint8_t burst) {
+    if(period == 0 || (int32_t)(tat - now) <= 0) return true;
+    if(burst > 0) burst--; // The request itself
+    return (uint32_t)(tat - now) <= (uint32_t)burst * period;
+}
+
+void rate_limit_consume(uint32_t *tat, uint32_t now, uint16_t period) {
+    if((int32_t)(*tat - now) < 0) *tat = now; // The bucket was full
+    *tat += period;
+}
@@ -0,0 +1,35 @@
+/*
+ * Filename:    rate_limit.h
+ * Project:     OpenPAYGO Link
+ * Author:      Daniel Nedosseikine
+ * Company:     Solaris Offgrid
+ * Created on:  19/10/2026
+ * Description: Token bucket kept as a theoretical arrival time (GCRA).
+ */
+
+#ifndef RATE_LIMIT_H
+#define RATE_LIMIT_H 1
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdint.h>
+#include <stdbool.h>
+
+/* Rates are given in tenths of requests per second, 0 means no limit */
+#define RATE_TO_PERIOD(_rate) ((_rate) ? 10000U / (_rate) : 0U) // ms
+
+/* Returns true if a request fits in a bucket of burst requests refilled every
+ * period ms. tat is the time the bucket is full again. */
+bool rate_limit_allows(uint32_t tat, uint32_t now, uint16_t period,
+                       uint8_t burst);
+
+/* Take a request from the bucket */
+void rate_limit_consume(uint32_t *tat, uint32_t now, uint16_t period);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* RATE_LIMIT_H */
@@ -0,0 +1,197 @@
+/*
+ * Filename:    rs.c
+ * Project:     OpenPAYGO Link
+ * Author:      Daniel Nedosseikine
+ * Company:     Solaris Offgrid
+ * Created on:  19/10/2026
+ * Description: Reed-Solomon code over GF(256), streamed byte by byte.
+ */
+
+#include <string.h>
+#include "rs.h"
+
+/* GF(256) with the polynomial 0x11D, powers and logarithms of alpha = 2 */
+static const uint8_t gf_exp[255] = {
+    0x01, 0x02, 0x04, 0x08, 0x10, 0x20, 0x40, 0x80, 0x1D, 0x3A, 0x74, 0xE8,
+    0xCD, 0x87, 0x13, 0x26, 0x4C, 0x98, 0x2D, 0x5A, 0xB4, 0x75, 0xEA, 0xC9,
+    0x8F, 0x03, 0x06, 0x0C, 0x18, 0x30, 0x60, 0xC0, 0x9D, 0x27, 0x4E, 0x9C,
+    0x25, 0x4A, 0x94, 0x35, 0x6A, 0xD4, 0xB5, 0x77, 0xEE, 0xC1, 0x9F, 0x23,
+    0x46, 0x8C, 0x05, 0x0A, 0x14, 0x28, 0x50, 0xA0, 0x5D, 0xBA, 0x69, 0xD2,
+    0xB9, 0x6F, 0xDE, 0xA1, 0x5F, 0xBE, 0x61, 0xC2, 0x99, 0x2F, 0x5E, 0xBC,
+    0x65, 0xCA, 0x89, 0x0F, 0x1E, 0x3C, 0x78, 0xF0, 0xFD, 0xE7, 0xD3, 0xBB,
+    0x6B, 0xD6, 0xB1, 0x7F, 0xFE, 0xE1, 0xDF, 0xA3, 0x5B, 0xB6, 0x71, 0xE2,
+    0xD9, 0xAF, 0x43, 0x86, 0x11, 0x22, 0x44, 0x88, 0x0D, 0x1A, 0x34, 0x68,
+    0xD0, 0xBD, 0x67, 0xCE, 0x81, 0x1F, 0x3E, 0x7C, 0xF8, 0xED, 0xC7, 0x93,
+    0x3B, 0x76, 0xEC, 0xC5, 0x97, 0x33, 0x66, 0xCC, 0x85, 0x17, 0x2E, 0x5C,
+    0xB8, 0x6D, 0xDA, 0xA9, 0x4F, 0x9E, 0x21, 0x42, 0x84, 0x15, 0x2A, 0x54,
+    0xA8, 0x4D, 0x9A, 0x29, 0x52, 0xA4, 0x55, 0xAA, 0x49, 0x92, 0x39, 0x72,
+    0xE4, 0xD5, 0xB7, 0x73, 0xE6, 0xD1, 0xBF, 0x63, 0xC6, 0x91, 0x3F, 0x7E,
+    0xFC, 0xE5, 0xD7, 0xB3, 0x7B, 0xF6, 0xF1, 0xFF, 0xE3, 0xDB, 0xAB, 0x4B,
+    0x96, 0x31, 0x62, 0xC4, 0x95, 0x37, 0x6E, 0xDC, 0xA5, 0x57, 0xAE, 0x41,
+    0x82, 0x19, 0x32, 0x64, 0xC8, 0x8D, 0x07, 0x0E, 0x1C, 0x38, 0x70, 0xE0,
+    0xDD, 0xA7, 0x53, 0xA6, 0x51, 0xA2, 0x59, 0xB2, 0x79, 0xF2, 0xF9, 0xEF,
+    0xC3, 0x9B, 0x2B, 0x56, 0xAC, 0x45, 0x8A, 0x09, 0x12, 0x24, 0x48, 0x90,
+    0x3D, 0x7A, 0xF4, 0xF5, 0xF7, 0xF3, 0xFB, 0xEB, 0xCB, 0x8B, 0x0B, 0x16,
+    0x2C, 0x58, 0xB0, 0x7D, 0xFA, 0xE9, 0xCF, 0x83, 0x1B, 0x36, 0x6C, 0xD8,
+    0xAD, 0x47, 0x8E
+};
+
+static const uint8_t gf_log[256] = {
+    0x00, 0x00, 0x01, 0x19, 0x02, 0x32, 0x1A, 0xC6, 0x03, 0xDF, 0x33, 0xEE,
+    0x1B, 0x68, 0xC7, 0x4B, 0x04, 0x64, 0xE0, 0x0E, 0x34, 0x8D, 0xEF, 0x81,
+    0x1C, 0xC1, 0x69, 0xF8, 0xC8, 0x08, 0x4C, 0x71, 0x05, 0x8A, 0x65, 0x2F,
+    0xE1, 0x24, 0x0F, 0x21, 0x35, 0x93, 0x8E, 0xDA, 0xF0, 0x12, 0x82, 0x45,
+    0x1D, 0xB5, 0xC2, 0x7D, 0x6A, 0x27, 0xF9, 0xB9, 0xC9, 0x9A, 0x09, 0x78,
+    0x4D, 0xE4, 0x72, 0xA6, 0x06, 0xBF, 0x8B, 0x62, 0x66, 0xDD, 0x30, 0xFD,
+    0xE2, 0x98, 0x25, 0xB3, 0x10, 0x91, 0x22, 0x88, 0x36, 0xD0, 0x94, 0xCE,
+    0x8F, 0x96, 0xDB, 0xBD, 0xF1, 0xD2, 0x13, 0x5C, 0x83, 0x38, 0x46, 0x40,
+    0x1E, 0x42, 0xB6, 0xA3, 0xC3, 0x48, 0x7E, 0x6E, 0x6B, 0x3A, 0x28, 0x54,
+    0xFA, 0x85, 0xBA, 0x3D, 0xCA, 0x5E, 0x9B, 0x9F, 0x0A, 0x15, 0x79, 0x2B,
+    0x4E, 0xD4, 0xE5, 0xAC, 0x73, 0xF3, 0xA7, 0x57, 0x07, 0x70, 0xC0, 0xF7,
+    0x8C, 0x80, 0x63, 0x0D, 0x67, 0x4A, 0xDE, 0xED, 0x31, 0xC5, 0xFE, 0x18,
+    0xE3, 0xA5, 0x99, 0x77, 0x26, 0xB8, 0xB4, 0x7C, 0x11, 0x44, 0x92, 0xD9,
+    0x23, 0x20, 0x89, 0x2E, 0x37, 0x3F, 0xD1, 0x5B, 0x95, 0xBC, 0xCF, 0xCD,
+    0x90, 0x87, 0x97, 0xB2, 0xDC, 0xFC, 0xBE, 0x61, 0xF2, 0x56, 0xD3, 0xAB,
+    0x14, 0x2A, 0x5D, 0x9E, 0x84, 0x3C, 0x39, 0x53, 0x47, 0x6D, 0x41, 0xA2,
+    0x1F, 0x2D, 0x43, 0xD8, 0xB7, 0x7B, 0xA4, 0x76, 0xC4, 0x17, 0x49, 0xEC,
+    0x7F, 0x0C, 0x6F, 0xF6, 0x6C, 0xA1, 0x3B, 0x52, 0x29, 0x9D, 0x55, 0xAA,
+    0xFB, 0x60, 0x86, 0xB1, 0xBB, 0xCC, 0x3E, 0x5A, 0xCB, 0x59, 0x5F, 0xB0,
+    0x9C, 0xA9, 0xA0, 0x51, 0x0B, 0xF5, 0x16, 0xEB, 0x7A, 0x75, 0x2C, 0xD7,
+    0x4F, 0xAE, 0xD5, 0xE9, 0xE6, 0xE7, 0xAD, 0xE8, 0x74, 0xD6, 0xF4, 0xEA,
+    0xA8, 0x50, 0x58, 0xAF
+};
+
+static uint8_t generator[RS_MAX_PARITY + 1]; // Highest degree first, monic
+
+static uint8_t gf_mul(uint8_t a, uint8_t b) {
+    uint16_t l;
+
+    if(a == 0 || b == 0) return 0;
+    l = (uint16_t)gf_log[a] + gf_log[b];
+    if(l >= 255) l -= 255;
+    return gf_exp[l];
+}
+
+static uint8_t gf_div(uint8_t a, uint8_t b) { // b != 0
+    uint16_t l;
+
+    if(a == 0) return 0;
+    l = (uint16_t)gf_log[a] + 255 - gf_log[b];
+    if(l >= 255) l -= 255;
+    return gf_exp[l];
+}
+
+/* alpha^power */
+static uint8_t gf_pow(uint16_t power) {
+    return gf_exp[power % 255];
+}
+
+void rs_init(uint8_t parity_len) {
+    memset(generator, 0, sizeof(generator));
+    generator[0] = 1;
+
+    // Product of (x - alpha^j) for j < parity_len
+    for(uint8_t j = 0; j < parity_len; j++) {
+        for(uint8_t i = j + 1; i > 0; i--)
+            generator[i] ^= gf_mul(generator[i - 1], gf_pow(j));
+    }
+}
+
+void rs_encode(uint8_t *parity, uint8_t parity_len, uint8_t byte) {
+    uint8_t feedback = byte ^ parity[0];
+
+    for(uint8_t i = 0; i + 1 < parity_len; i++)
+        parity[i] = parity[i + 1] ^ gf_mul(feedback, generator[i + 1]);
+    parity[parity_len - 1] = gf_mul(feedback, generator[parity_len]);
+}
+
+void rs_syndromes(uint8_t *syndromes, uint8_t parity_len, uint8_t byte) {
+    // Horner's rule, syndrome j is the received polynomial at alpha^j
+    syndromes[0] ^= byte;
+    for(uint8_t j = 1; j < parity_len; j++) {
+        syndromes[j] = gf_mul(syndromes[j], gf_exp[j]) ^ byte;
+    }
+}
+
+/* Evaluate poly (lowest degree first) at x */
+static uint8_t poly_eval(const uint8_t *poly, uint8_t degree, uint8_t x) {
+    uint8_t y = poly[degree];
+
+    for(uint8_t i = degree; i > 0; i--)
+        y = gf_mul(y, x) ^ poly[i - 1];
+    return y;
+}
+
+uint8_t rs_correct(const uint8_t *syndromes, uint8_t parity_len, uint8_t n,
+                   uint8_t *pos, uint8_t *val) {
+    uint8_t lambda[RS_MAX_PARITY + 1] = {1}; // Error locator
+    uint8_t prev[RS_MAX_PARITY + 1] = {1};
+    uint8_t tmp[RS_MAX_PARITY + 1];
+    uint8_t omega[RS_MAX_PARITY / 2]; // Error evaluator
+    uint8_t errors = 0, shift = 1, prev_d = 1;
+    uint8_t t = parity_len / 2;
+    uint8_t found = 0;
+    bool clean = true;
+
+    for(uint8_t j = 0; j < parity_len; j++) {
+        if(syndromes[j] != 0) clean = false;
+    }
+    if(clean) return 0;
+
+    // Berlekamp-Massey
+    for(uint8_t k = 0; k < parity_len; k++) {
+        uint8_t d = syndromes[k];
+        for(uint8_t i = 1; i <= errors; i++)
+            d ^= gf_mul(lambda[i], syndromes[k - i]);
+
+        if(d == 0) {
+            shift++;
+            continue;
+        }
+
+        uint8_t scale = gf_div(d, prev_d);
+        memcpy(tmp, lambda, sizeof(tmp));
+        for(uint8_t i = 0; i + shift <= parity_len; i++)
+            lambda[i + shift] ^= gf_mul(scale, prev[i]);
+
+        if(2 * errors <= k) {
+            errors = k + 1 - errors;
+            memcpy(prev, tmp, sizeof(prev));
+            prev_d = d;
+            shift = 1;
+        }
+        else {
+            shift++;
+        }
+    }
+    if(errors > t) return RS_FAILED;
+
+    // Omega = S * lambda mod x^errors
+    for(uint8_t i = 0; i < errors; i++) {
+        omega[i] = 0;
+        for(uint8_t j = 0; j <= i; j++)
+            omega[i] ^= gf_mul(syndromes[j], lambda[i - j]);
+    }
+
+    // Chien search, the byte at position i stands for the power n - 1 - i
+    for(uint8_t i = 0; i < n && found < errors; i++) {
+        uint8_t power = n - 1 - i;
+        uint8_t x_inv = gf_pow(255 - power);
+        if(poly_eval(lambda, errors, x_inv) != 0) continue;
+
+        // Forney: X * omega(1/X) / lambda'(1/X)
+        uint8_t derivative = 0;
+        for(uint8_t j = 1; j <= errors; j += 2)
+            derivative ^= gf_mul(lambda[j], gf_pow((uint16_t)(255 - power) *
+                                                    (j - 1)));
+        if(derivative == 0) return RS_FAILED;
+
+        pos[found] = i;
+        val[found] = gf_mul(gf_pow(power),
+                            gf_div(poly_eval(omega, errors - 1, x_inv),
+                                   derivative));
+        found++;
+    }
+
+    return (found == errors) ? found : RS_FAILED;
+}
@@ -0,0 +1,45 @@
+/*
+ * Filename:    rs.h
+ * Project:     OpenPAYGO Link
+ * Author:      Daniel Nedosseikine
+ * Company:     Solaris Offgrid
+ * Created on:  19/10/2026
+ * Description: Reed-Solomon code over GF(256), streamed byte by byte.
+ */
+
+#ifndef RS_H
+#define RS_H 1
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdint.h>
+#include <stdbool.h>
+
+/* Systematic code shortened to the frame length (up to 255 bytes): parity_len
+ * parity bytes follow the data and correct up to parity_len / 2 bytes. The
+ * sender and the receiver both work a byte at a time, so the parity and the
+ * syndromes are ready as soon as the last byte went through. */
+#define RS_MAX_PARITY 8
+#define RS_FAILED 0xFF
+
+/* Compute the generator polynomial, once */
+void rs_init(uint8_t parity_len);
+
+/* Add a data byte to the parity, which starts zeroed */
+void rs_encode(uint8_t *parity, uint8_t parity_len, uint8_t byte);
+
+/* Add a received byte, data or parity, to the syndromes, which start zeroed */
+void rs_syndromes(uint8_t *syndromes, uint8_t parity_len, uint8_t byte);
+
+/* Locate the errors of the n byte codeword. Returns their count, the bytes at
+ * pos must be XORed with val, or RS_FAILED if there are too many. */
+uint8_t rs_correct(const uint8_t *syndromes, uint8_t parity_len, uint8_t n,
+                   uint8_t *pos, uint8_t *val);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* RS_H */
@@ -0,0 +1,45 @@
+/*
+ * Filename:    speck.c
+ * Project:     OpenPAYGO Link
+ * Author:      Daniel Nedosseikine
+ * Company:     Solaris Offgrid
+ * Created on:  19/10/2026
+ * Description: Speck32/64 block cipher, encryption only. More info: ePrint
+ *              2013/404
+ */
+
+#include "speck.h"
+
+#define ROR16(_x, _r) (uint16_t)(((_x) >> (_r)) | ((_x) << (16 - (_r))))
+#define ROL16(_x, _r) (uint16_t)(((_x) << (_r)) | ((_x) >> (16 - (_r))))
+
+void speck_expand_key(const uint8_t *key, uint16_t *round_keys) {
+    uint16_t l[3];
+    uint16_t k = ((uint16_t)key[6] << 8) | key[7];
+
+    for(uint8_t i = 0; i < 3; i++) // l0, l1, l2
+        l[i] = ((uint16_t)key[4 - 2 * i] << 8) | key[5 - 2 * i];
+
+    for(uint8_t i = 0; i < SPECK_ROUNDS; i++) {
+        round_keys[i] = k;
+        uint16_t next = (uint16_t)(k + ROR16(l[i % 3], 7)) ^ i;
+        k = ROL16(k, 2) ^ next;
+        l[i % 3] = next;
+    }
+}
+
+void speck_encrypt(const uint16_t *round_keys, uint16_t *x, uint16_t *y) {
+    speck_rounds(round_keys, x, y, 0, SPECK_ROUNDS);
+}
+
+void speck_rounds(const uint16_t *round_keys, uint16_t *x, uint16_t *y,
+                  uint8_t first, uint8_t last) {
+    uint16_t a = *x, b = *y;
+
+    for(uint8_t i = first; i < last; i++) {
+        a = (uint16_t)(ROR16(a, 7) + b) ^ round_keys[i];
+        b = ROL16(b, 2) ^ a;
+    }
+    *x = a;
+    *y = b;
+}
@@ -0,0 +1,38 @@
+/*
+ * Filename:    speck.h
+ * Project:     OpenPAYGO Link
+ * Author:      Daniel Nedosseikine
+ * Company:     Solaris Offgrid
+ * Created on:  19/10/2026
+ * Description: Speck32/64 block cipher, encryption only. More info: ePrint
+ *              2013/404
+ */
+
+#ifndef SPECK_H
+#define SPECK_H 1
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdint.h>
+
+#define SPECK_KEY_SIZE 8 // 64-bit key
+#define SPECK_ROUNDS   22
+
+/* Compute the round keys once, key is the 4 key words (l2, l1, l0, k0) in
+ * network (big) endianness */
+void speck_expand_key(const uint8_t *key, uint16_t *round_keys);
+
+/* Encrypt the 32-bit block (x, y) in place */
+void speck_encrypt(const uint16_t *round_keys, uint16_t *x, uint16_t *y);
+
+/* Run the rounds first to last - 1 only, so an encryption can be split */
+void speck_rounds(const uint16_t *round_keys, uint16_t *x, uint16_t *y,
+                  uint8_t first, uint8_t last);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* SPECK_H */
@@ -13,6 +13,17 @@
 //#include <stdlib.h>
 #include "crc16.h"
 #include "byte_utils.h"
+#include "rate_limit.h"
+#ifdef OPL_AUTH
+#include "speck.h"
+#include "frame_mac.h"
+#endif /* OPL_AUTH */
+#ifdef OPL_ZIP
+#include "lzss.h"
+#endif /* OPL_ZIP */
+#ifdef OPL_FEC
+#include "rs.h"
+#endif /* OPL_FEC */
 #include "oplink_common.h"
 #include "oplink_com.h"
 #include "oplink_com_private.h"
@@ -37,12 +48,34 @@ typedef enum {Empty, Ready, Processing} rx_frame_state_t;
 static struct {
     rx_frame_state_t state;
     uint8_t busy_time;
-    uint8_t src : 4;
-    uint8_t dest : 4;
+    uint8_t src;
+    uint8_t dest;
     uint8_t mode : 1;
     uint8_t len : 7;
+    bool micro; // Micro frame, only the first CRC byte is sent
     uint16_t crc;
-} rx_frame = {Empty, SEND_REPLY_TIMEOUT, 0, 0, 0};
+    #ifdef OPL_ZIP
+    uint8_t zip; // Decompressed length and ZIP_DICT, 0 if not compressed
+    #endif /* OPL_ZIP */
+    #ifdef OPL_AUTH
+    frame_mac_t mac; // Computed by the UART ISR while receiving
+    uint8_t first; // First payload byte, the command of CMD frames
+    uint8_t trailer[AUTH_LEN]; // Counter and tag
+    #endif /* OPL_AUTH */
+    #ifdef OPL_FEC
+    struct {
+        uint8_t syndromes[FEC_LEN]; // Computed by the UART ISR
+        uint8_t len; // Bytes of the frame, parity included
+        uint8_t pos; // Of the next byte read out of the UART buffer
+        uint8_t count; // Corrupted bytes found
+        uint8_t at[FEC_T]; // Their positions
+        uint8_t val[FEC_T]; // XORed to correct them
+        #ifdef OPL_AUTH
+        uint8_t first; // Position of the first payload byte
+        #endif /* OPL_AUTH */
+    } fec;
+    #endif /* OPL_FEC */
+} rx_frame = {Empty, SEND_REPLY_TIMEOUT, 0, 0, 0, 0, false, 0};
 /******************************************************************************/
 
 /* Last sent request information **********************************************/
@@ -53,50 +86,689 @@ static struct {
     uint8_t busy_time;
     uint8_t dest;
     uint8_t cmd;
-} last_request = {None, RECEIVE_REPLY_TIMEOUT, 0xFF, 0xFF};
+    #ifdef MASTER
+    uint8_t *buf; // Of the external request, see opl_reply_request()
+    #endif /* MASTER */
+} last_request = {None, RECEIVE_REPLY_TIMEOUT, 0xFF, 0xFF
+    #ifdef MASTER
+    , NULL
+    #endif /* MASTER */
+};
+
+#ifdef MASTER
+static uint8_t *reply_request = NULL; // Answered by the frame handed out
+#endif /* MASTER */
 /******************************************************************************/
 
 /* External request queue structs *********************************************/
-#define MAX_REQUESTS 5 // Limited only by the memory available
+/* The queue holds up to MAX_REQUESTS - 1 requests. Every destination with
+ * requests has its own lane, a FIFO linked through the entries, and the lanes
+ * take turns in a ring so the next one is known without a scan. Broadcasts and
+ * multicasts share BROADCAST_LANE. On the master a destination can't take
+ * more than MAX_DEST_REQUESTS entries, lower it to keep room for the others.
+ * The master requests can have a timeout: a lane whose first request has one
+ * is served before its turn if that one is the closest to its deadline, and
+ * the requests that miss it are dropped. Meanwhile the requests without one
+ * are ordered as if they had REQUEST_MAX_WAIT, so they are not starved, but
+ * they are never dropped. */
+#define NO_REQUEST 0xFF
+#define BROADCAST_LANE 0
+#ifdef MASTER
+#define MAX_LANES MAX_REQUESTS // One per request, and the broadcast lane
+#else
+#define MAX_LANES 2 // The slaves only send to the master
+#endif /* MASTER */
+#define IS_BROADCAST(_dest) ((_dest) == DEFAULT_ADDR || IS_GROUP_ADDR(_dest))
 
 typedef struct {
     uint8_t dest;
-    uint8_t *buf; // Just a pointer
+    uint8_t *buf; // Just a pointer, NULL if the entry is free
     uint8_t len;
     bool wait_reply;
+    uint8_t next; // Next entry of the lane, NO_REQUEST for the last one
+    #ifdef MASTER
+    uint32_t pushed; // OPL_MILLIS() when pushed
+    uint16_t timeout; // Dropped if not sent within it, 0 for no deadline
+    #endif /* MASTER */
 } request_t;
 
+typedef struct {
+    uint8_t dest;
+    uint8_t count; // 0 if the lane is free
+    uint8_t head;
+    uint8_t tail;
+    uint8_t next; // Next lane in the ring
+} lane_t;
+
 static struct {
-    request_t *head;
-    request_t *tail;
     uint8_t count;
+    uint8_t last_lane; // Served last, NO_REQUEST if the ring is empty
     request_t elems[MAX_REQUESTS];
+    lane_t lanes[MAX_LANES];
+    #ifdef MASTER
+    uint8_t timed; // Requests with a timeout
+    opl_queue_stats_t stats;
+    #endif /* MASTER */
 } request_queue;
+
+#ifdef SLAVE
+/* Budget of the requests to the master, advertised by the master with PING */
+static struct {
+    uint16_t period; // ms
+    uint8_t burst;
+    uint32_t tat;
+} request_budget = {RATE_TO_PERIOD(REQUEST_RATE), REQUEST_BURST, 0};
+#endif /* SLAVE */
+/******************************************************************************/
+
+#ifdef SLAVE
+/* Staged replies *************************************************************/
+#define MAX_STAGED_REPLIES 4 // Limited only by the memory available
+
+typedef struct {
+    uint8_t key; // First payload byte of the requests it answers
+    uint8_t *buf; // Just a pointer
+    uint8_t len; // 0 if the slot is free
+} staged_reply_t;
+
+static staged_reply_t staged_replies[MAX_STAGED_REPLIES];
+static bool staged_activity = false; // A staged reply was sent from the ISR
+
+bool opl_send_bytes(uint8_t dest, frame_mode_t mode, uint8_t *data,
+                    uint8_t len, bool force_write);
+
+/* Not processing a frame nor waiting for a reply from the master */
+static bool safe_to_send_reply() {
+    return (rx_frame.state == Empty) && (last_request.reply_state == None);
+}
+
+bool stage_reply(uint8_t key, uint8_t *buf, uint8_t len) {
+    staged_reply_t *slot = NULL;
+
+    if(len > STAGED_MAX_LEN) return false;
+
+    for(uint8_t i = 0; i < MAX_STAGED_REPLIES; i++) {
+        if(staged_replies[i].len > 0 && staged_replies[i].key == key) {
+            slot = &staged_replies[i]; // Replace it
+            break;
+        }
+        if(staged_replies[i].len == 0 && slot == NULL)
+            slot = &staged_replies[i];
+    }
+    if(slot == NULL) return len == 0;
+
+    OPL_DISABLE_INTERRUPTS(); // The UART ISR reads the table
+    slot->key = key;
+    slot->buf = buf;
+    slot->len = len;
+    OPL_ENABLE_INTERRUPTS();
+
+    return true;
+}
+/******************************************************************************/
+#endif /* SLAVE */
+
+extern void link_activity(uint8_t src, uint8_t dest);
+
+#ifdef OPL_AUTH
+/* Authenticated frames *******************************************************/
+/* Every frame carries a MAC bound to a frame counter, so it can't be forged nor
+ * replayed. Only the 16 low bits of the counter are sent, the receiver accepts
+ * the next 0x7FFF values. The MAC of a slave is keyed with its session key,
+ * derived once per session from the network key, the nonce of its SIGNAL and
+ * the token of its FIND. Frames to or from DEFAULT_ADDR (handshake, discovery,
+ * broadcasts) have no session: they are keyed with the network key and the
+ * counter of the handshake is not checked, it relies on the nonces instead.
+ * The broadcasts and multicasts of the master carry its broadcast counter,
+ * which goes on across resets. Every PING with arguments gives it to the slave,
+ * which then only accepts the following values. */
+#if KEY_SIZE != SPECK_KEY_SIZE
+#error "KEY_SIZE doesn't match the cipher"
+#endif
+
+#define COUNTER_WINDOW 0x8000
+
+/* Session with node, NULL if there is none. Also called by the UART ISR. */
+extern auth_session_t *get_session(uint8_t node);
+
+static auth_session_t open_session; // Network key, for frames without session
+
+#ifdef MASTER
+/* OPL_SAVE_COUNTER records a bound COUNTER_RESERVE frames ahead of the
+ * broadcast counter, and a reset starts from it. The EEPROM is only written
+ * once every COUNTER_RESERVE / 2 frames. */
+#ifdef OPL_SAVE_COUNTER
+#define COUNTER_RESERVE 256
+static uint32_t counter_bound;
+#endif /* OPL_SAVE_COUNTER */
+#endif /* MASTER */
+
+#ifdef SLAVE
+static bool broadcast_synced = false; // Counter given by a PING since the reset
+#endif /* SLAVE */
+
+void auth_init() {
+    uint8_t key[KEY_SIZE];
+    OPL_LOAD_KEY(key);
+    speck_expand_key(key, open_session.round_keys);
+    memset(key, 0, KEY_SIZE);
+    #ifdef MASTER
+    #ifdef OPL_SAVE_COUNTER
+    open_session.tx = OPL_LOAD_COUNTER();
+    counter_bound = open_session.tx; // Saved right away by auth_save_counter()
+    #endif /* OPL_SAVE_COUNTER */
+    #endif /* MASTER */
+}
+
+#ifdef MASTER
+uint32_t auth_broadcast_counter() {
+    return open_session.tx;
+}
+
+void auth_save_counter() {
+    #ifdef OPL_SAVE_COUNTER
+    if(counter_bound - open_session.tx > COUNTER_RESERVE / 2) return;
+    counter_bound = open_session.tx + COUNTER_RESERVE;
+    OPL_SAVE_COUNTER(counter_bound);
+    #endif /* OPL_SAVE_COUNTER */
+}
+#endif /* MASTER */
+
+#ifdef SLAVE
+void auth_sync_broadcasts(uint32_t counter) {
+    open_session.rx = counter;
+    broadcast_synced = true;
+}
+#endif /* SLAVE */
+
+static void load_block(uint16_t *x, uint16_t *y, const uint8_t *buf) {
+    *x ^= ((uint16_t)buf[0] << 8) | buf[1];
+    *y ^= ((uint16_t)buf[2] << 8) | buf[3];
+}
+
+/* Each half of the key is the CBC-MAC of a label, the nonce and the token. It
+ * runs once per session, in the main loop. */
+void auth_new_session(auth_session_t *session, const uint8_t *nonce,
+                      const uint8_t *token) {
+    uint8_t key[KEY_SIZE];
+
+    for(uint8_t half = 0; half < 2; half++) {
+        uint16_t x = 0x4F50; // "OP"
+        uint16_t y = 0x4C00 | half; // "L", then the half
+        speck_encrypt(open_session.round_keys, &x, &y);
+        load_block(&x, &y, nonce);
+        speck_encrypt(open_session.round_keys, &x, &y);
+        load_block(&x, &y, token);
+        speck_encrypt(open_session.round_keys, &x, &y);
+        key[4 * half] = (uint8_t)(x >> 8);
+        key[4 * half + 1] = (uint8_t)x;
+        key[4 * half + 2] = (uint8_t)(y >> 8);
+        key[4 * half + 3] = (uint8_t)y;
+    }
+    speck_expand_key(key, session->round_keys);
+    memset(key, 0, KEY_SIZE);
+    session->tx = 0;
+    session->rx = 0;
+}
+
+/* Round keys of the frames exchanged with node */
+static const uint16_t *session_keys(uint8_t node) {
+    auth_session_t *session = get_session(node);
+    return (session != NULL) ? session->round_keys : open_session.round_keys;
+}
+
+/* Slave end of the link */
+static uint8_t link_node(uint8_t src, uint8_t dest) {
+    return (src == MASTER_ADDR) ? dest : src;
+}
+
+/* Finish the MAC of a received frame and check its tag and the counter of
+ * session. A RESUME starts a new session after a master reset, it is accepted
+ * with any counter and only its token proves it is fresh. */
+static bool frame_authentic(auth_session_t *session, bool resync,
+                            frame_mac_t *mac, uint8_t *trailer) {
+    uint16_t low = ((uint16_t)trailer[0] << 8) | trailer[1];
+    uint32_t counter = low;
+    uint8_t tag[MAC_TAG_LEN];
+    uint8_t diff = 0;
+
+    if(session != NULL && !resync) {
+        uint16_t delta = low - (uint16_t)session->rx;
+        if(delta == 0 || delta >= COUNTER_WINDOW) return false; // Replayed
+        counter = session->rx + delta;
+    }
+
+    frame_mac_final(mac, counter, tag);
+    for(uint8_t i = 0; i < MAC_TAG_LEN; i++)
+        diff |= tag[i] ^ trailer[2 + i];
+    if(diff != 0) return false;
+
+    if(session != NULL && !resync) session->rx = counter;
+    return true;
+}
+/******************************************************************************/
+#endif /* OPL_AUTH */
+
+#ifdef OPL_ZIP
+/* Compressed frames **********************************************************/
+/* DATA payloads are compressed with LZSS when it makes them shorter. The window
+ * is the payload itself, preceded by the shared dictionary if there is one, so
+ * the receiver decompresses straight into the application buffer. */
+#if ZIP_MAX_DICT + OPL_PAYLOAD_MAX_LEN > LZSS_WINDOW
+#error "The dictionary doesn't fit in the window"
+#endif
+
+static const uint8_t *zip_dict = NULL;
+static uint8_t zip_dict_len = 0;
+
+void opl_set_zip_dictionary(const uint8_t *dict, uint8_t len) {
+    if(len > ZIP_MAX_DICT) len = ZIP_MAX_DICT;
+    zip_dict = (len > 0) ? dict : NULL;
+    zip_dict_len = (dict != NULL) ? len : 0;
+}
+/******************************************************************************/
+#endif /* OPL_ZIP */
+
+#ifdef OPL_FEC
+/* Error correcting frames ****************************************************/
+/* The UART ISR computes the syndromes while receiving, so a clean frame costs
+ * nothing more. Otherwise the main loop locates the corrupted bytes before
+ * parsing the frame and corrects them as they are read out of the UART buffer.
+ * The CRC is still checked afterwards, it catches the frames with too many
+ * errors. */
+#if FEC_LEN > RS_MAX_PARITY
+#error "FEC_T is too big"
+#endif
+
+#define MAJORITY(_a, _b, _c) (((_a) & (_b)) | ((_a) & (_c)) | ((_b) & (_c)))
+
+void fec_init() {
+    rs_init(FEC_LEN);
+}
+
+static uint8_t rx_crc_len() {
+    return rx_frame.micro ? MICRO_CRC_LEN : CRC_LEN;
+}
+
+/* Locate the errors of the received frame, before reading it */
+static void fec_decode() {
+    rx_frame.fec.pos = 0;
+    rx_frame.fec.count = rs_correct(rx_frame.fec.syndromes, FEC_LEN,
+                                    rx_frame.fec.len, rx_frame.fec.at,
+                                    rx_frame.fec.val);
+    if(rx_frame.fec.count == RS_FAILED) rx_frame.fec.count = 0; // CRC fails
+
+    #ifdef OPL_AUTH
+    // The MAC of the ISR covered the errors, it is redone while reading. The
+    // key is set once the address is read.
+    if(rx_frame.fec.count > 0) frame_mac_init(&rx_frame.mac, NULL);
+    rx_frame.fec.first = 0xFF;
+    #endif /* OPL_AUTH */
+}
+
+/* Read the next byte of the frame and correct it */
+static uint8_t fec_read_byte() {
+    uint8_t byte = OPL_UART_READ_BYTE();
+    uint8_t pos = rx_frame.fec.pos++;
+
+    for(uint8_t i = 0; i < rx_frame.fec.count; i++) {
+        if(rx_frame.fec.at[i] == pos) byte ^= rx_frame.fec.val[i];
+    }
+
+    #ifdef OPL_AUTH
+    if(rx_frame.fec.count > 0) {
+        uint8_t trailer = rx_frame.fec.len - FEC_LEN - rx_crc_len() -
+                          AUTH_LEN;
+        if(pos < trailer)
+            frame_mac_update(&rx_frame.mac, byte);
+        else if(pos < trailer + AUTH_LEN)
+            rx_frame.trailer[pos - trailer] = byte;
+        if(pos == rx_frame.fec.first) rx_frame.first = byte;
+    }
+    #endif /* OPL_AUTH */
+
+    return byte;
+}
+
+#define READ_BYTE() fec_read_byte()
 /******************************************************************************/
+#else
+#define READ_BYTE() OPL_UART_READ_BYTE()
+#endif /* OPL_FEC */
+
+#ifdef OPL_COALESCE
+/* Multi-record frames ********************************************************/
+/* The master packs the requests queued for a slave into one frame. The slave
+ * answers with one record per request, in the same order and empty if it got
+ * no reply, in one frame sent once the last request was processed. The records
+ * are read and checked at once, then opl_parse() hands them out one at a time
+ * as if they were frames. */
+#if MULTI_MAX_LEN + MULTI_HEADER_LEN > OPL_PAYLOAD_MAX_LEN
+#error "MULTI_MAX_LEN is too big"
+#endif
+
+static struct {
+    uint8_t buf[MULTI_MAX_LEN];
+    uint8_t len; // 0 once all of them were handed out
+    uint8_t pos; // Of the next record
+    uint8_t count; // Handed out
+    uint8_t total;
+    uint8_t at; // Next byte of the record handed out
+    uint8_t left; // Bytes of it not read yet
+} records;
+
+#ifdef MASTER
+/* Requests of the last multi-record frame, in order, so each reply is matched
+ * with its request and the ones left unanswered are reported */
+static struct {
+    uint8_t dest;
+    uint8_t count; // 0 once all of them were answered or reported
+    uint8_t *bufs[MAX_DEST_REQUESTS];
+} sent_records;
+
+extern void request_dropped(uint8_t dest, uint8_t *data, uint8_t status);
+
+/* Report the requests of the frame from the record first on */
+static void records_unanswered(uint8_t first, uint8_t status) {
+    uint8_t count = sent_records.count;
+    sent_records.count = 0;
+    for(uint8_t i = first; i < count; i++)
+        request_dropped(sent_records.dest, sent_records.bufs[i], status);
+}
+#endif /* MASTER */
+
+#ifdef SLAVE
+static struct {
+    uint8_t buf[MULTI_HEADER_LEN + MULTI_MAX_LEN]; // Length, then the records
+    uint8_t len;
+    uint8_t count;
+} replies;
+
+bool opl_send_bytes(uint8_t dest, frame_mode_t mode, uint8_t *data,
+                    uint8_t len, bool force_write);
+
+/* One reply per record handed out, empty if the application gave none */
+static void pad_replies(uint8_t count) {
+    while(replies.count < count) {
+        replies.buf[MULTI_HEADER_LEN + replies.len++] = 0;
+        replies.count++;
+    }
+}
+
+static void send_replies() {
+    pad_replies(records.total);
+    records.len = 0;
+    replies.buf[0] = replies.len;
+    opl_send_bytes(MASTER_ADDR, MULTI, replies.buf,
+                   replies.len + MULTI_HEADER_LEN, true);
+}
+
+/* Reply to the record handed out, sent with the others after the last one */
+static bool add_reply(uint8_t *buf, uint8_t len) {
+    // Keep a byte for each empty reply the next records might need
+    uint8_t room = MULTI_MAX_LEN - replies.len -
+                   (records.total - replies.count - 1);
+
+    if(replies.count >= records.count || len + 1 > room) return false;
+
+    replies.buf[MULTI_HEADER_LEN + replies.len++] = len;
+    memcpy(replies.buf + MULTI_HEADER_LEN + replies.len, buf, len);
+    replies.len += len;
+    replies.count++;
+
+    if(replies.count == records.total) send_replies();
+    return true;
+}
+#endif /* SLAVE */
+
+/* Count the records of a frame, 0 if one of them overflows it */
+static uint8_t count_records(uint8_t len) {
+    uint8_t count = 0;
+
+    for(uint8_t pos = 0; pos < len; pos += records.buf[pos] + 1) {
+        if(records.buf[pos] >= len - pos) return 0;
+        count++;
+    }
+    return count;
+}
+
+/* Hand out the next record that isn't empty, returns its length. On the
+ * master an empty record is a request left unanswered, it is reported to
+ * request_dropped() instead. */
+static uint8_t next_record() {
+    while(records.pos < records.len) {
+        #ifdef SLAVE
+        pad_replies(records.count);
+        #endif /* SLAVE */
+        records.left = records.buf[records.pos];
+        records.at = records.pos + 1;
+        records.pos = records.at + records.left;
+        #ifdef MASTER
+        uint8_t *buf = (records.count < sent_records.count) ?
+                       sent_records.bufs[records.count] : NULL;
+        #endif /* MASTER */
+        records.count++;
+        #ifdef MASTER
+        if(records.left == 0 && buf != NULL)
+            request_dropped(sent_records.dest, buf, OPL_REQUEST_NO_REPLY);
+        reply_request = buf;
+        #endif /* MASTER */
+        if(records.left > 0) return records.left;
+    }
+
+    #ifdef SLAVE
+    send_replies();
+    #else
+    records.len = 0;
+    records_unanswered(records.count, OPL_REQUEST_NO_REPLY); // Missing ones
+    #endif /* SLAVE */
+    return NO_BYTES;
+}
+
+static bool read_record(uint8_t *buf, uint8_t len) {
+    if(len > records.left) len = records.left;
+    memcpy(buf, records.buf + records.at, len);
+    records.at += len;
+    records.left -= len;
+    return true;
+}
+/******************************************************************************/
+#endif /* OPL_COALESCE */
 
 /* Low level UART interface functions *****************************************/
+#ifdef OPL_AUTH
+#define FOOTER_LEN (AUTH_LEN + CRC_LEN + FEC_LEN)
+#else
+#define FOOTER_LEN (CRC_LEN + FEC_LEN)
+#endif /* OPL_AUTH */
+
+/* Coarse 4-bit address used for the UART address wake-up. Extended addresses
+ * are folded into 1..MAX_SHORT_ADDR so they never wake up the master or the
+ * nodes waiting on DEFAULT_ADDR. Groups wake up every slave. */
+static uint8_t addr_nibble(uint8_t addr) {
+    if(addr <= 0x0F) return addr;
+    if(IS_GROUP_ADDR(addr)) return DEFAULT_ADDR;
+    return 1 + (addr - 1) % MAX_SHORT_ADDR;
+}
+
 void opl_node_set_addr(uint8_t new_addr) {
-    new_addr &= 0x0F;
     opl_node.addr = new_addr;
-    OPL_UART_SET_ADDR(new_addr);
+    OPL_UART_SET_ADDR(addr_nibble(new_addr));
+}
+
+#ifdef SLAVE
+static uint8_t node_groups = 0; // Multicast groups, bit n for GROUP_ADDR(n)
+
+void opl_node_set_groups(uint8_t groups) {
+    node_groups = groups;
+}
+
+/* Node id of an extended frame addressed to one of our groups */
+static bool group_member(uint8_t node) {
+    return IS_GROUP_ADDR(node) &&
+           (node_groups & (1 << (node - FIRST_GROUP_ADDR)));
+}
+
+static staged_reply_t *find_staged_reply(uint8_t key) {
+    for(uint8_t i = 0; i < MAX_STAGED_REPLIES; i++) {
+        if(staged_replies[i].len > 0 && staged_replies[i].key == key)
+            return &staged_replies[i];
+    }
+    return NULL;
 }
+#endif /* SLAVE */
 
 void uart_rx_callback(uint8_t b) {
     static uint8_t len = 0xFF;
     static uint8_t count;
+    static uint8_t header_len;
+    #ifdef SLAVE
+    static uint16_t crc;
+    static uint8_t dest;
+    static staged_reply_t *reply;
+    #endif /* SLAVE */
+    #ifdef OPL_AUTH
+    static frame_mac_t mac; // Updated with every byte, the tag is ready sooner
+    static uint8_t node; // Slave end of the link, selects the key
+    static uint8_t first;
+    static uint8_t trailer[AUTH_LEN];
+    static uint8_t check_len; // After the trailer, shorter for micro frames
+    #endif /* OPL_AUTH */
+    #ifdef OPL_FEC
+    static uint8_t syndromes[FEC_LEN];
+    static uint8_t copies[FEC_META_COPIES]; // Of the meta byte
+    static bool voted; // The meta byte is known, ZIP headers come after it
+    #endif /* OPL_FEC */
 
     if(OPL_UART_IS_ADDR()) {
         len = 0xFF;
         count = 1; // First byte of the frame
+        header_len = (b >> 4) == EXT_ADDR_NIBBLE ? EXT_HEADER_LEN : HEADER_LEN;
+        #ifdef OPL_AUTH
+        node = link_node(b >> 4, b & 0x0F); // Node byte of extended frames later
+        check_len = CRC_LEN + FEC_LEN;
+        frame_mac_init(&mac, NULL);
+        frame_mac_update(&mac, b);
+        #endif /* OPL_AUTH */
+        #ifdef OPL_FEC
+        memset(syndromes, 0, FEC_LEN);
+        rs_syndromes(syndromes, FEC_LEN, b);
+        voted = false;
+        #endif /* OPL_FEC */
+        #ifdef SLAVE
+        crc = update_crc16(CRC_INIT, b);
+        reply = NULL;
+        // Only requests from the master can be answered with a staged reply
+        dest = ((b >> 4) == MASTER_ADDR) ? (b & 0x0F) : DEFAULT_ADDR;
+        b &= 0x0F;
+        if(header_len == HEADER_LEN && b != opl_node.addr && b != DEFAULT_ADDR)
+            OPL_UART_MUTE(); // Short frame for a node sharing our nibble
+        #endif /* SLAVE */
     }
     else {
         count++;
-        if(count == 2) {
-            len = (b & 0x7F) + OVERHEAD; // len + header + footer
+        #ifdef OPL_FEC
+        rs_syndromes(syndromes, FEC_LEN, b);
+        #endif /* OPL_FEC */
+        #ifdef OPL_AUTH
+        if(count == 2 && header_len == EXT_HEADER_LEN) node = b;
+        if(count == header_len) mac.round_keys = session_keys(node);
+        if(count == header_len + 1) first = b;
+        if(count + AUTH_LEN + check_len <= len) // Header and payload
+            frame_mac_update(&mac, b);
+        else if(count + check_len <= len)
+            trailer[count + AUTH_LEN + check_len - 1 - len] = b;
+        #endif /* OPL_AUTH */
+        #ifdef SLAVE
+        if(count + FEC_LEN <= len) crc = update_crc16(crc, b); // Not parity
+        if(count == header_len + 1 && dest != DEFAULT_ADDR) {
+            reply = find_staged_reply(b); // First payload byte is the key
         }
+        #endif /* SLAVE */
+        #ifdef OPL_FEC
+        if(!voted && count + FEC_META_COPIES >= header_len) {
+            if(count < header_len) { // A copy, the meta byte comes last
+                copies[count + FEC_META_COPIES - header_len] = b;
+            }
+            else {
+                b = MAJORITY(copies[0], copies[1], b);
+                voted = true;
+            }
+        }
+        #endif /* OPL_FEC */
+        #ifdef OPL_ZIP
+        if(count == header_len && b == ZIP_META) {
+            header_len += ZIP_HEADER_LEN; // The length comes last
+            #ifdef SLAVE
+            dest = DEFAULT_ADDR; // The key byte is compressed, no staged reply
+            #endif /* SLAVE */
+        }
+        else
+        #endif /* OPL_ZIP */
+        #ifdef OPL_COALESCE
+        if(count == header_len && b == MULTI_META) {
+            header_len += MULTI_HEADER_LEN; // The length comes last
+            #ifdef SLAVE
+            dest = DEFAULT_ADDR; // No staged reply
+            #endif /* SLAVE */
+        }
+        else
+        #endif /* OPL_COALESCE */
+        if(count == header_len && IS_MICRO(b)) {
+            // No payload and a shorter CRC
+            len = header_len + FOOTER_LEN - CRC_LEN + MICRO_CRC_LEN;
+            #ifdef OPL_AUTH
+            check_len = MICRO_CRC_LEN + FEC_LEN;
+            #endif /* OPL_AUTH */
+            #ifdef SLAVE
+            dest = DEFAULT_ADDR;
+            #endif /* SLAVE */
+        }
+        else if(count == header_len) {
+            len = (b & 0x7F) + header_len + FOOTER_LEN; // len + header + footer
+            #ifdef SLAVE
+            if((b >> 7) != DATA || dest != opl_node.addr) dest = DEFAULT_ADDR;
+            #endif /* SLAVE */
+        }
+        #ifdef SLAVE
+        else if(count == 2 && header_len == EXT_HEADER_LEN &&
+                b != opl_node.addr && b != DEFAULT_ADDR && !group_member(b)) {
+            // Node id of an extended frame (the meta byte comes later), it
+            // shares our address nibble but it is meant for a different node,
+            // or for a group we are not a member of
+            OPL_UART_MUTE();
+        }
+        else if(count == 2 && header_len == EXT_HEADER_LEN) {
+            dest = b; // Node id of an extended frame from the master
+        }
+        #endif /* SLAVE */
         else if(count == len) {
             OPL_UART_MUTE(); // Mute here until next addr byte matches
+            #ifdef SLAVE
+            // Answer right away if the request has a staged reply, the frame
+            // is then dropped and never reaches opl_parse(). A corrupted one
+            // goes there to be corrected with OPL_FEC.
+            if(reply != NULL && crc == 0x0000 && safe_to_send_reply()
+            #ifdef OPL_AUTH
+               && frame_authentic(get_session(dest), false, &mac, trailer)
+            #endif /* OPL_AUTH */
+               ) {
+                OPL_UART_FLUSH_RX();
+                opl_send_bytes(MASTER_ADDR, DATA, reply->buf, reply->len, true);
+                staged_activity = true;
+                return;
+            }
+            #endif /* SLAVE */
             OPL_UART_DISABLE_RX(); // Only one frame at a time can be processed
+            #ifdef OPL_AUTH
+            rx_frame.mac = mac;
+            rx_frame.first = first;
+            memcpy(rx_frame.trailer, trailer, AUTH_LEN);
+            #endif /* OPL_AUTH */
+            #ifdef OPL_FEC
+            memcpy(rx_frame.fec.syndromes, syndromes, FEC_LEN);
+            rx_frame.fec.len = len;
+            #endif /* OPL_FEC */
             rx_frame.state = Ready;
             rx_frame.busy_time = SEND_REPLY_TIMEOUT;
         }
@@ -108,7 +780,7 @@ static uint16_t opl_read_bytes(uint16_t crc, uint8_t *buf, uint8_t len) {
     uint8_t byte;
 
     for(uint8_t i = 0; i < len; i++) {
-        byte = OPL_UART_READ_BYTE();
+        byte = READ_BYTE();
         crc = update_crc16(crc, byte);
         if(buf != NULL) buf[i] = byte; // Compute the CRC but don't store
     }
@@ -116,12 +788,51 @@ static uint16_t opl_read_bytes(uint16_t crc, uint8_t *buf, uint8_t len) {
     return crc;
 }
 
+/* Check values of a frame being sent */
+typedef struct {
+    uint16_t crc;
+    #ifdef OPL_AUTH
+    frame_mac_t mac;
+    #endif /* OPL_AUTH */
+    #ifdef OPL_FEC
+    uint8_t parity[FEC_LEN];
+    #endif /* OPL_FEC */
+} tx_check_t;
+
+/* Check values covering a byte, each one also covers the bytes of the next */
+typedef enum {PARITY_ONLY, CRC_TOO, MAC_TOO} tx_cover_t;
+
+/* Add a byte to the check values before it is written */
+static uint8_t tx_check(tx_check_t *tx, uint8_t b, tx_cover_t cover) {
+    #ifdef OPL_FEC
+    rs_encode(tx->parity, FEC_LEN, b);
+    #endif /* OPL_FEC */
+    if(cover >= CRC_TOO) tx->crc = update_crc16(tx->crc, b);
+    #ifdef OPL_AUTH
+    if(cover == MAC_TOO) frame_mac_update(&tx->mac, b);
+    #endif /* OPL_AUTH */
+    return b;
+}
+
 bool opl_send_bytes(uint8_t dest, frame_mode_t mode, uint8_t *data,
                     uint8_t len, bool force_write) {
 
     uint8_t result = false;
     uint8_t addr = ((opl_node.addr << 4) & 0xF0) | (dest & 0x0F); // src/dest
     uint8_t meta = (mode << 7) | len;
+    if(mode == ZIP) meta = ZIP_META;
+    else if(mode == MULTI) meta = MULTI_META;
+    else if(mode == MICRO) meta = data[0]; // And no payload
+    // The slave end of the exchange, it is the one that might need 8 bits
+    uint8_t node = (dest == MASTER_ADDR) ? opl_node.addr : dest;
+    tx_check_t tx;
+    #ifdef OPL_AUTH
+    auth_session_t *session;
+    uint8_t auth[AUTH_LEN];
+    #endif /* OPL_AUTH */
+
+    if(node > MAX_SHORT_ADDR)
+        addr = (EXT_ADDR_NIBBLE << 4) | addr_nibble(dest);
 
     #ifdef SLAVE
     OPL_LIN_ENABLE_TX(); // Set LIN transceiver to Operation Mode
@@ -132,26 +843,56 @@ bool opl_send_bytes(uint8_t dest, frame_mode_t mode, uint8_t *data,
     if(force_write == true || OPL_UART_IS_BUSY() == false) {
         OPL_UART_DISABLE_RX();  // Disable RX so you don't read your own data
 
+        tx.crc = CRC_INIT;
+        #ifdef OPL_FEC
+        memset(tx.parity, 0, FEC_LEN);
+        #endif /* OPL_FEC */
+        #ifdef OPL_AUTH
+        // After disabling RX, the ISR might send a staged reply otherwise
+        session = get_session(node);
+        uint32_t counter = (session != NULL) ? ++session->tx
+                                             : ++open_session.tx;
+        if(session == NULL && !(IS_BROADCAST(dest) && mode != CMD &&
+                                mode != MICRO))
+            counter = (uint16_t)counter; // Handshake, can't be resynced
+        auth[0] = (uint8_t)(counter >> 8);
+        auth[1] = (uint8_t)counter;
+        frame_mac_init(&tx.mac, (session != NULL) ? session->round_keys
+                                                  : open_session.round_keys);
+        #endif /* OPL_AUTH */
+
         OPL_UART_WRITE_BREAK(); // Otherwise LIN transceiver misses first byte
         OPL_UART_WRITE_BYTE(SYNC_BYTE);
 
-        uint16_t crc = CRC_INIT;
+        OPL_UART_WRITE_ADDR(tx_check(&tx, addr, MAC_TOO));
 
-        crc = update_crc16(crc, addr);
-        OPL_UART_WRITE_ADDR(addr);
+        if(node > MAX_SHORT_ADDR)
+            OPL_UART_WRITE_BYTE(tx_check(&tx, node, MAC_TOO));
 
-        crc = update_crc16(crc, meta);
-        OPL_UART_WRITE_BYTE(meta);
+        for(uint8_t i = 0; i <= FEC_META_COPIES; i++) // Copies with OPL_FEC
+            OPL_UART_WRITE_BYTE(tx_check(&tx, meta, MAC_TOO));
 
-        for(uint8_t i = 0; i < len; i++) {
-            crc = update_crc16(crc, data[i]);
-            OPL_UART_WRITE_BYTE(data[i]);
-        }
+        for(uint8_t i = 0; i < len; i++) // The MAC runs while the byte goes out
+            OPL_UART_WRITE_BYTE(tx_check(&tx, data[i], MAC_TOO));
+
+        #ifdef OPL_AUTH
+        frame_mac_final(&tx.mac, counter, auth + 2);
+        for(uint8_t i = 0; i < AUTH_LEN; i++)
+            OPL_UART_WRITE_BYTE(tx_check(&tx, auth[i], CRC_TOO));
+        #endif /* OPL_AUTH */
+
+        uint16_t crc = opl_hton16(tx.crc); // Convert to network (big) endianness
 
-        crc = opl_hton16(crc); // Convert to network (big) endianness
+        // First CRC byte, MSB, then the second one, LSB
+        OPL_UART_WRITE_BYTE(tx_check(&tx, (uint8_t)(crc >> 8), PARITY_ONLY));
+        if(mode != MICRO)
+            OPL_UART_WRITE_BYTE(tx_check(&tx, (uint8_t)(crc & 0x00FF),
+                                         PARITY_ONLY));
 
-        OPL_UART_WRITE_BYTE((uint8_t)(crc >> 8)); // First CRC byte, MSB
-        OPL_UART_WRITE_BYTE((uint8_t)(crc & 0x00FF)); // Second CRC byte, LSB
+        #ifdef OPL_FEC
+        for(uint8_t i = 0; i < FEC_LEN; i++)
+            OPL_UART_WRITE_BYTE(tx.parity[i]);
+        #endif /* OPL_FEC */
 
         result = true;
     }
@@ -168,12 +909,26 @@ bool opl_send_bytes(uint8_t dest, frame_mode_t mode, uint8_t *data,
 /******************************************************************************/
 
 /* Auxiliary communication functions ******************************************/
+static uint8_t busy_count = 0; // Loops to wait after the bus was busy
+
 node_state_t update_node_state() {
     node_state_t result = NODE_OK;
 
+    #ifdef SLAVE
+    if(staged_activity) {
+        staged_activity = false;
+        link_activity(MASTER_ADDR, opl_node.addr);
+    }
+    #endif /* SLAVE */
+
     if(rx_frame.state != Empty && --rx_frame.busy_time == 0) {
         UART_ENABLE_RX();
         rx_frame.state = Empty;
+        #ifdef OPL_COALESCE
+        #ifdef SLAVE
+        records.len = 0; // Too late to reply
+        #endif /* SLAVE */
+        #endif /* OPL_COALESCE */
         result = SEND_TIMEOUT_ERROR;
     }
 
@@ -182,7 +937,6 @@ node_state_t update_node_state() {
         result = RECEIVE_TIMEOUT_ERROR; // Higher priority
     }
 
-    static uint8_t busy_count = 0;
     if(busy_count == 0) {
         opl_node.bus_busy = OPL_UART_IS_BUSY();
         if(opl_node.bus_busy) {
@@ -190,7 +944,9 @@ node_state_t update_node_state() {
             busy_count = BUS_WAIT();
         }
     }
-    else busy_count--;
+    else if(--busy_count == 0) {
+        OPL_UART_CLEAR_BUSY(); // Sense the bus again over the next loop only
+    }
 
     return result;
 }
@@ -200,6 +956,13 @@ bool safe_to_send() {
            (opl_node.bus_busy == false);
 }
 
+bool com_idle() {
+    #ifdef SLAVE
+    if(staged_activity) return false;
+    #endif /* SLAVE */
+    return safe_to_send() && (busy_count == 0) && (request_queue.count == 0);
+}
+
 uint8_t get_last_dest() {
     return last_request.dest;
 }
@@ -207,23 +970,40 @@ uint8_t get_last_dest() {
 uint8_t get_last_cmd() {
     return last_request.cmd;
 }
+
+uint8_t get_frame_src() {
+    return rx_frame.src;
+}
 /******************************************************************************/
 
 /* Internal communication functions *******************************************/
 bool opl_send_cmd(uint8_t addr, uint8_t cmd, uint8_t *args, uint8_t len,
                   bool wait_reply, bool force_write) {
     uint8_t buffer[CMD_MAX_LEN];
+    bool sent;
 
     if(len > CMD_MAX_LEN - 1) return false;
 
-    buffer[0] = cmd;
-    if(args != NULL) memcpy(buffer + 1, args, len);
+    #ifdef OPL_MICRO
+    if(cmd <= MICRO_CMD_MASK && (len == 0 || (len == 1 && args != NULL &&
+                                               args[0] <= MICRO_MAX_ARG))) {
+        buffer[0] = (CMD << 7) | MICRO_FLAG | cmd; // Fits in a micro frame
+        if(len == 1) buffer[0] |= (args[0] + 1) << MICRO_ARG_SHIFT;
+        sent = opl_send_bytes(addr, MICRO, buffer, 0, force_write);
+    }
+    else
+    #endif /* OPL_MICRO */
+    {
+        buffer[0] = cmd;
+        if(args != NULL) memcpy(buffer + 1, args, len);
+        sent = opl_send_bytes(addr, CMD, buffer, len + 1, force_write);
+    }
 
-    if(opl_send_bytes(addr, CMD, buffer, len + 1, force_write)) {
+    if(sent) {
         if(wait_reply) {
             last_request.reply_state = Pending;
             last_request.busy_time = RECEIVE_REPLY_TIMEOUT;
-            last_request.dest = addr & 0x0F;
+            last_request.dest = addr;
             last_request.cmd = cmd;
         }
         return true;
@@ -233,20 +1013,103 @@ bool opl_send_cmd(uint8_t addr, uint8_t cmd, uint8_t *args, uint8_t len,
 }
 
 extern void route_command(uint8_t *buf, uint8_t len);
+
+#ifdef MASTER
+extern bool accept_request(uint8_t src);
+extern void request_dropped(uint8_t dest, uint8_t *data, uint8_t status);
+#endif /* MASTER */
 /******************************************************************************/
 
 /* High level communication functions *****************************************/
+/* Check the frame once all the data bytes were read */
+static bool read_footer() {
+    bool crc_ok;
+
+    #ifdef OPL_AUTH
+    rx_frame.crc = opl_read_bytes(rx_frame.crc, NULL, AUTH_LEN);
+    #endif /* OPL_AUTH */
+    // Read the CRC and test if it is correct
+    if(rx_frame.micro) { // Only the first byte, as it is sent
+        uint8_t check;
+        opl_read_bytes(0, &check, MICRO_CRC_LEN);
+        crc_ok = (check == (uint8_t)(opl_hton16(rx_frame.crc) >> 8));
+    }
+    else {
+        crc_ok = ( 0x0000 == opl_read_bytes(rx_frame.crc, NULL, CRC_LEN) );
+    }
+    #ifdef OPL_FEC
+    opl_read_bytes(0, NULL, FEC_LEN); // Parity, already used
+    #endif /* OPL_FEC */
+    #ifdef OPL_AUTH
+    auth_session_t *session = get_session(link_node(rx_frame.src,
+                                                    rx_frame.dest));
+    #ifdef SLAVE
+    if(rx_frame.src == MASTER_ADDR && IS_BROADCAST(rx_frame.dest) &&
+       rx_frame.mode == DATA) { // Broadcast counter
+        session = &open_session;
+        crc_ok = crc_ok && broadcast_synced;
+    }
+    #endif /* SLAVE */
+    crc_ok = crc_ok && frame_authentic(
+        session,
+        rx_frame.src == MASTER_ADDR && rx_frame.mode == CMD &&
+        !rx_frame.micro && rx_frame.first == RESUME,
+        &rx_frame.mac, rx_frame.trailer);
+    #endif /* OPL_AUTH */
+    if(crc_ok) link_activity(rx_frame.src, rx_frame.dest); // Liveness
+    if(( crc_ok == false) || (last_request.reply_state == Received) ) {
+        last_request.reply_state = None;
+        OPL_UART_ENABLE_RX();
+        rx_frame.state = Empty;
+    }
+    // To prevent the node getting stuck if the buffer was not fully read
+    // nor the reply was sent, after a timeout the UART RX will be reenabled
+    return crc_ok;
+}
+
 uint8_t opl_parse() {
     uint8_t result = RX_NOT_READY;
 
+    #ifdef OPL_COALESCE
+    if(records.len > 0) return next_record();
+    bool multi = false;
+    #endif /* OPL_COALESCE */
+
     if(rx_frame.state == Ready) {
         rx_frame.state = Processing;
+        #ifdef MASTER
+        reply_request = NULL;
+        #endif /* MASTER */
+
+        #ifdef OPL_FEC
+        fec_decode();
+        uint8_t copies[FEC_META_COPIES];
+        #endif /* OPL_FEC */
 
         uint8_t byte; // Bitwise on arrays was causing issues
         rx_frame.crc = opl_read_bytes(CRC_INIT, &byte, 1);
         rx_frame.src = byte >> 4; // First 4 bits
         rx_frame.dest = byte & 0x0F; // Remaining 4 bits
 
+        if(rx_frame.src == EXT_ADDR_NIBBLE) { // The full node id follows
+            rx_frame.crc = opl_read_bytes(rx_frame.crc, &byte, 1);
+            if(rx_frame.dest == MASTER_ADDR) {
+                rx_frame.src = byte;
+            }
+            else {
+                rx_frame.src = MASTER_ADDR;
+                rx_frame.dest = byte;
+            }
+        }
+
+        #ifdef OPL_FEC
+        #ifdef OPL_AUTH
+        if(rx_frame.fec.count > 0) // The sender is known now
+            rx_frame.mac.round_keys =
+                session_keys(link_node(rx_frame.src, rx_frame.dest));
+        #endif /* OPL_AUTH */
+        #endif /* OPL_FEC */
+
         // Keep proccessing if we are not waiting for a reply or if we are
         // waiting for a reply and we received a message from the requested node
         switch(last_request.reply_state) { // Idea: expand this to return errors
@@ -258,14 +1121,119 @@ uint8_t opl_parse() {
                 }
                 else {
                     last_request.reply_state = Received;
+                    #ifdef MASTER
+                    if(last_request.cmd == EXT)
+                        reply_request = last_request.buf;
+                    #endif /* MASTER */
                     // fallthrough to the next case
                 }
             case None:
+                #ifdef OPL_FEC
+                rx_frame.crc = opl_read_bytes(rx_frame.crc, copies,
+                                              FEC_META_COPIES);
+                #endif /* OPL_FEC */
                 rx_frame.crc = opl_read_bytes(rx_frame.crc, &byte, 1);
+                #ifdef OPL_FEC
+                byte = MAJORITY(copies[0], copies[1], byte); // As the ISR did
+                #endif /* OPL_FEC */
                 rx_frame.mode = byte >> 7; // First bit
                 rx_frame.len = byte & 0x7F; // Remaining 7 bits
+                rx_frame.micro = IS_MICRO(byte);
+                if(rx_frame.micro) rx_frame.len = 0; // Command in the meta
 
-                if(rx_frame.len > 0 && rx_frame.mode == CMD) {
+                #ifdef OPL_ZIP
+                rx_frame.zip = 0;
+                if(byte == ZIP_META) {
+                    rx_frame.crc = opl_read_bytes(rx_frame.crc, &rx_frame.zip,
+                                                  1);
+                    rx_frame.crc = opl_read_bytes(rx_frame.crc, &byte, 1);
+                    rx_frame.len = byte;
+                    if((rx_frame.zip & ZIP_LEN_MASK) == 0) { // Malformed
+                        OPL_UART_ENABLE_RX();
+                        rx_frame.state = Empty;
+                        break;
+                    }
+                }
+                #endif /* OPL_ZIP */
+
+                #ifdef OPL_COALESCE
+                if(byte == MULTI_META) {
+                    multi = true;
+                    rx_frame.crc = opl_read_bytes(rx_frame.crc, &byte, 1);
+                    rx_frame.len = byte;
+                    if(rx_frame.len > MULTI_MAX_LEN) { // It wouldn't fit
+                        OPL_UART_ENABLE_RX();
+                        rx_frame.state = Empty;
+                        break;
+                    }
+                }
+                #endif /* OPL_COALESCE */
+
+                #ifdef OPL_FEC
+                // A wrong correction of the meta byte, the length doesn't
+                // match what the ISR received
+                if(rx_frame.fec.pos + rx_frame.len + FOOTER_LEN - CRC_LEN +
+                   rx_crc_len() != rx_frame.fec.len) {
+                    OPL_UART_ENABLE_RX();
+                    rx_frame.state = Empty;
+                    break;
+                }
+                #ifdef OPL_AUTH
+                rx_frame.fec.first = rx_frame.fec.pos;
+                #endif /* OPL_AUTH */
+                #endif /* OPL_FEC */
+
+                #ifdef MASTER
+                // Unsolicited requests of a slave over its budget are dropped
+                if(rx_frame.mode == DATA &&
+                   last_request.reply_state != Received &&
+                   !accept_request(rx_frame.src)) {
+                    OPL_UART_ENABLE_RX();
+                    rx_frame.state = Empty;
+                    break;
+                }
+                #endif /* MASTER */
+
+                if(rx_frame.mode == CMD && rx_frame.len > CMD_MAX_LEN) {
+                    OPL_UART_ENABLE_RX(); // Garbled, it wouldn't fit
+                    rx_frame.state = Empty;
+                    break;
+                }
+
+                #ifdef OPL_COALESCE
+                if(multi) { // Read at once, then handed out
+                    uint8_t len = rx_frame.len;
+                    if(opl_read(records.buf, len)) {
+                        records.total = count_records(len);
+                        records.len = (records.total > 0) ? len : 0;
+                        records.pos = 0;
+                        records.count = 0;
+                        #ifdef SLAVE
+                        replies.len = 0;
+                        replies.count = 0;
+                        if(records.len == 0) { // Malformed, no reply
+                            OPL_UART_ENABLE_RX();
+                            rx_frame.state = Empty;
+                        }
+                        #endif /* SLAVE */
+                        if(records.len > 0) result = next_record();
+                    }
+                    #ifdef MASTER
+                    if(records.len == 0 && rx_frame.src == sent_records.dest)
+                        records_unanswered(0, OPL_REQUEST_NO_REPLY); // Lost
+                    #endif /* MASTER */
+                }
+                else
+                #endif /* OPL_COALESCE */
+                if(rx_frame.micro) { // Routed without the payload path
+                    uint8_t cmd[2];
+                    uint8_t arg = (byte & 0x3F) >> MICRO_ARG_SHIFT;
+                    cmd[0] = byte & MICRO_CMD_MASK;
+                    cmd[1] = arg - 1;
+                    if(read_footer()) route_command(cmd, (arg > 0) ? 2 : 1);
+                    result = NO_BYTES;
+                }
+                else if(rx_frame.len > 0 && rx_frame.mode == CMD) {
                     uint8_t tmp_buf[CMD_MAX_LEN];
                     uint8_t len = rx_frame.len; // Save the len before reading
                     if(opl_read(tmp_buf, rx_frame.len)) {
@@ -275,6 +1243,9 @@ uint8_t opl_parse() {
                 }
                 else {
                     result = rx_frame.len;
+                    #ifdef OPL_ZIP
+                    if(rx_frame.zip != 0) result = rx_frame.zip & ZIP_LEN_MASK;
+                    #endif /* OPL_ZIP */
                 }
                 break;
         }
@@ -282,82 +1253,429 @@ uint8_t opl_parse() {
     return result;
 }
 
+#ifdef OPL_ZIP
+/* Decompress the payload while it is read out of the UART buffer, buf is the
+ * window so nothing else is needed. The whole frame is read at once. */
+static bool read_zipped(uint8_t *buf, uint8_t len) {
+    lzss_decoder_t decoder;
+    uint8_t byte;
+    bool unzip_ok = (len >= (rx_frame.zip & ZIP_LEN_MASK)) &&
+                    (zip_dict != NULL || !(rx_frame.zip & ZIP_DICT));
+
+    lzss_decoder_init(&decoder, buf, rx_frame.zip & ZIP_LEN_MASK,
+                      (rx_frame.zip & ZIP_DICT) ? zip_dict : NULL,
+                      zip_dict_len);
+    while(rx_frame.len > 0) {
+        rx_frame.crc = opl_read_bytes(rx_frame.crc, &byte, 1);
+        rx_frame.len--;
+        if(unzip_ok) unzip_ok = lzss_decode(&decoder, byte);
+    }
+    unzip_ok = unzip_ok && lzss_done(&decoder);
+    return read_footer() && unzip_ok;
+}
+#endif /* OPL_ZIP */
+
 bool opl_read(uint8_t *buf, uint8_t len) {
-    bool crc_ok = false;
+    #ifdef OPL_COALESCE
+    if(records.len > 0) return read_record(buf, len);
+    #endif /* OPL_COALESCE */
+    #ifdef OPL_ZIP
+    if(rx_frame.zip != 0) return read_zipped(buf, len);
+    #endif /* OPL_ZIP */
 
     if(len > rx_frame.len) len = rx_frame.len;
 
     rx_frame.crc = opl_read_bytes(rx_frame.crc, buf, len);
 
     rx_frame.len -= len;
-    if(rx_frame.len == 0) { // All the data bytes were read
-        // Read the CRC and test if it is correct
-        crc_ok = ( 0x0000 == opl_read_bytes(rx_frame.crc, NULL, CRC_LEN) );
-        if(( crc_ok == false) || (last_request.reply_state == Received) ) {
-            last_request.reply_state = None;
-            OPL_UART_ENABLE_RX();
-            rx_frame.state = Empty;
-        }
-        // To prevent the node getting stuck if the buffer was not fully read
-        // nor the reply was sent, after a timeout the UART RX will be reenabled
-    }
-    return crc_ok;
+    if(rx_frame.len == 0) return read_footer(); // All the data bytes were read
+    return false;
 }
 
+#ifdef OPL_ZIP
+/* Send a DATA frame compressed if that makes it shorter. The bus is checked
+ * first too, so a busy bus doesn't cost a compression every loop. */
+static bool send_data(uint8_t dest, uint8_t *data, uint8_t len,
+                      bool force_write) {
+    uint8_t zipped[OPL_PAYLOAD_MAX_LEN];
+    uint8_t zip_len = 0;
+
+    if(force_write == false && OPL_UART_IS_BUSY()) return false;
+
+    if(len >= ZIP_MIN_LEN) // Only if it saves a byte at least
+        zip_len = lzss_compress(data, len, zipped + ZIP_HEADER_LEN,
+                                len - ZIP_HEADER_LEN - 1, zip_dict,
+                                zip_dict_len);
+    if(zip_len == 0) return opl_send_bytes(dest, DATA, data, len, force_write);
+
+    zipped[0] = len | ((zip_dict != NULL) ? ZIP_DICT : 0);
+    zipped[1] = zip_len;
+    return opl_send_bytes(dest, ZIP, zipped, zip_len + ZIP_HEADER_LEN,
+                          force_write);
+}
+#else
+#define send_data(_dest, _data, _len, _force_write) \
+    opl_send_bytes(_dest, DATA, _data, _len, _force_write)
+#endif /* OPL_ZIP */
+
 /* Used only for DATA type frames sent by the application layer. */
 bool opl_send_reply(uint8_t *buf, uint8_t len) {
     if(rx_frame.state != Processing || rx_frame.mode != DATA) return false;
+    if(IS_GROUP_ADDR(rx_frame.dest)) return false; // The members would collide
+
+    #ifdef OPL_COALESCE
+    #ifdef SLAVE
+    if(records.len > 0) return add_reply(buf, len);
+    #endif /* SLAVE */
+    #endif /* OPL_COALESCE */
 
-    opl_send_bytes(rx_frame.src, DATA, buf, len, true); // Reply to the source
+    send_data(rx_frame.src, buf, len, true); // Reply to the source
     return true;
 }
 /******************************************************************************/
 
 /* External request queue functions *******************************************/
 void request_queue_init() {
-    request_queue.head = request_queue.elems;
-    request_queue.tail = request_queue.elems;
-    request_queue.count = 0;
+    memset(&request_queue, 0, sizeof(request_queue));
+    request_queue.last_lane = NO_REQUEST;
+}
+
+/* Lane of the requests to dest, a free one if it has none. NULL if they are all
+ * taken, which only happens to a full queue. */
+static lane_t *find_lane(uint8_t dest) {
+    lane_t *free_lane = NULL;
+
+    if(IS_BROADCAST(dest)) return &request_queue.lanes[BROADCAST_LANE];
+
+    for(uint8_t i = BROADCAST_LANE + 1; i < MAX_LANES; i++) {
+        lane_t *lane = &request_queue.lanes[i];
+        if(lane->count > 0 && lane->dest == dest) return lane;
+        if(lane->count == 0 && free_lane == NULL) free_lane = lane;
+    }
+    return free_lane;
+}
+
+/* Add a lane to the ring, it is served after all the others */
+static void lane_link(uint8_t l) {
+    lane_t *lanes = request_queue.lanes;
+
+    if(request_queue.last_lane == NO_REQUEST) {
+        lanes[l].next = l;
+    }
+    else {
+        lanes[l].next = lanes[request_queue.last_lane].next;
+        lanes[request_queue.last_lane].next = l;
+    }
+    request_queue.last_lane = l;
+}
+
+/* Remove a lane from the ring. The lane served next is right after the last
+ * one, so dispatch_request() doesn't walk the ring. */
+static void lane_unlink(uint8_t l) {
+    lane_t *lanes = request_queue.lanes;
+    uint8_t prev = request_queue.last_lane;
+
+    while(lanes[prev].next != l) prev = lanes[prev].next;
+
+    if(prev == l) {
+        request_queue.last_lane = NO_REQUEST; // It was the only one
+    }
+    else {
+        lanes[prev].next = lanes[l].next;
+        if(request_queue.last_lane == l) request_queue.last_lane = prev;
+    }
+}
+
+/* Add a request at the end of the lane of dest. Returns its entry, NO_REQUEST
+ * if the queue or the lane is full. */
+static uint8_t queue_request(uint8_t dest, uint8_t *data, uint8_t len,
+                             bool wait_reply) {
+    uint8_t free_elem = NO_REQUEST;
+
+    if(request_queue.count >= MAX_REQUESTS - 1) return NO_REQUEST;
+
+    lane_t *lane = find_lane(dest);
+    if(lane == NULL) return NO_REQUEST;
+    #ifdef MASTER
+    if(lane->count >= MAX_DEST_REQUESTS) return NO_REQUEST;
+    #endif /* MASTER */
+
+    for(uint8_t i = 0; i < MAX_REQUESTS && free_elem == NO_REQUEST; i++) {
+        if(request_queue.elems[i].buf == NULL) free_elem = i;
+    }
+
+    request_t *request = &request_queue.elems[free_elem];
+    request->dest = dest;
+    request->buf = data;
+    request->len = len;
+    request->wait_reply = wait_reply;
+    request->next = NO_REQUEST;
+    #ifdef MASTER
+    request->pushed = OPL_MILLIS();
+    request->timeout = 0;
+    #endif /* MASTER */
+    request_queue.count++;
+
+    if(lane->count++ == 0) {
+        lane->dest = dest;
+        lane->head = free_elem;
+        lane_link(lane - request_queue.lanes);
+    }
+    else {
+        request_queue.elems[lane->tail].next = free_elem;
+    }
+    lane->tail = free_elem;
+
+    return free_elem;
 }
 
 bool push_request(uint8_t dest, uint8_t *data, uint8_t len, bool wait_reply) {
-    if(request_queue.count < MAX_REQUESTS - 1) {
-        request_queue.head->dest = dest;
-        request_queue.head->buf = data;
-        request_queue.head->len = len;
-        request_queue.head->wait_reply = wait_reply;
-
-        request_queue.count++;
-        if(request_queue.head - request_queue.elems == MAX_REQUESTS - 1)
-            request_queue.head = request_queue.elems; // First element
-        else
-            request_queue.head++;
+    return queue_request(dest, data, len, wait_reply) != NO_REQUEST;
+}
 
-        return true;
+#ifdef MASTER
+bool push_request_timeout(uint8_t dest, uint8_t *data, uint8_t len,
+                          bool wait_reply, uint16_t timeout) {
+    uint8_t i = queue_request(dest, data, len, wait_reply);
+    if(i == NO_REQUEST) return false;
+
+    request_queue.elems[i].timeout = timeout;
+    if(timeout > 0) request_queue.timed++;
+    return true;
+}
+
+static uint32_t request_age(request_t *request) {
+    return OPL_MILLIS() - request->pushed;
+}
+
+/* Time left before the deadline of the request, 0 once it passed. The
+ * requests without a timeout have REQUEST_MAX_WAIT. */
+static uint16_t request_slack(request_t *request) {
+    uint32_t age = request_age(request);
+    uint16_t timeout = request->timeout > 0 ? request->timeout
+                                            : REQUEST_MAX_WAIT;
+    return age < timeout ? timeout - (uint16_t)age : 0;
+}
+#endif /* MASTER */
+
+/* Free the entry of a request removed from its lane */
+static void request_free(request_t *request) {
+    #ifdef MASTER
+    if(request->timeout > 0) request_queue.timed--;
+    #endif /* MASTER */
+    request->buf = NULL;
+    request_queue.count--;
+}
+
+bool request_queued(uint8_t *data) {
+    for(uint8_t i = 0; i < MAX_REQUESTS; i++) {
+        if(request_queue.elems[i].buf == data) return true;
     }
-    else
-        return false;
+    return false;
 }
 
-void dispatch_request() {
-    if(request_queue.count > 0) {
-        if(opl_send_bytes(request_queue.tail->dest, DATA,
-                          request_queue.tail->buf, request_queue.tail->len,
-                          false)) { // If it was possible to send then clear
-
-            if(request_queue.tail->wait_reply) {
-                last_request.reply_state = Pending;
-                last_request.busy_time = RECEIVE_REPLY_TIMEOUT;
-                last_request.dest = request_queue.tail->dest;
-                last_request.cmd = EXT; // External request dummy command
-            }
+#ifdef SLAVE
+void set_request_budget(uint8_t rate, uint8_t burst) {
+    request_budget.period = RATE_TO_PERIOD(rate);
+    request_budget.burst = burst;
+}
+#endif /* SLAVE */
+
+#ifdef MASTER
+void drop_requests(uint8_t dest, uint8_t status) {
+    #ifdef OPL_COALESCE
+    if(sent_records.count > 0 && sent_records.dest == dest)
+        records_unanswered(0, status); // Their reply never came
+    #endif /* OPL_COALESCE */
+
+    lane_t *lane = find_lane(dest);
+    if(lane == NULL || lane->count == 0 || IS_BROADCAST(dest)) return;
+
+    uint8_t next;
+    lane_unlink(lane - request_queue.lanes);
+    lane->count = 0; // Free before the callback, it can push again
+    for(uint8_t i = lane->head; i != NO_REQUEST; i = next) {
+        uint8_t *buf = request_queue.elems[i].buf;
+        next = request_queue.elems[i].next;
+        request_free(&request_queue.elems[i]);
+        request_dropped(dest, buf, status);
+    }
+}
+
+/* Remove a request from the middle of its lane */
+static void lane_remove(uint8_t i) {
+    request_t *request = &request_queue.elems[i];
+    lane_t *lane = find_lane(request->dest);
+    uint8_t prev = NO_REQUEST;
+
+    for(uint8_t j = lane->head; j != i; j = request_queue.elems[j].next)
+        prev = j;
+
+    if(prev == NO_REQUEST) lane->head = request->next;
+    else request_queue.elems[prev].next = request->next;
+    if(lane->tail == i) lane->tail = prev;
+    if(--lane->count == 0) lane_unlink(lane - request_queue.lanes);
+    request_free(request);
+}
+
+void expire_requests(uint8_t status) {
+    if(request_queue.timed == 0) return;
+
+    for(uint8_t i = 0; i < MAX_REQUESTS; i++) {
+        request_t *request = &request_queue.elems[i];
+        if(request->buf == NULL || request->timeout == 0 ||
+           request_slack(request) > 0)
+            continue;
+
+        uint8_t dest = request->dest;
+        uint8_t *buf = request->buf;
+        lane_remove(i); // Before the callback, it can push again
+        request_queue.stats.expired++;
+        request_dropped(dest, buf, status);
+    }
+}
 
-            request_queue.count--;
-            if(request_queue.tail - request_queue.elems == MAX_REQUESTS - 1)
-                request_queue.tail = request_queue.elems; // First element
-            else
-                request_queue.tail++;
+/* Earliest deadline first: the lane whose first request has the least time
+ * left, the ones without a timeout included. Ties are served in turn. */
+static uint8_t earliest_lane() {
+    uint8_t best = NO_REQUEST;
+    uint16_t best_slack = 0;
+    uint8_t l = request_queue.last_lane;
+
+    do {
+        l = request_queue.lanes[l].next;
+        uint16_t slack =
+            request_slack(&request_queue.elems[request_queue.lanes[l].head]);
+        if(best == NO_REQUEST || slack < best_slack) {
+            best = l;
+            best_slack = slack;
         }
+    } while(l != request_queue.last_lane);
+
+    return best;
+}
+
+void opl_read_queue_stats(opl_queue_stats_t *stats) {
+    *stats = request_queue.stats;
+    memset(&request_queue.stats, 0, sizeof(request_queue.stats));
+}
+
+uint8_t *opl_reply_request() {
+    return reply_request;
+}
+#endif /* MASTER */
+
+/* Clear the first request of the lane once it was sent */
+static void request_sent(lane_t *lane) {
+    request_t *request = &request_queue.elems[lane->head];
+
+    if(request->wait_reply) {
+        last_request.reply_state = Pending;
+        last_request.busy_time = RECEIVE_REPLY_TIMEOUT;
+        last_request.dest = request->dest;
+        last_request.cmd = EXT; // External request dummy command
+        #ifdef MASTER
+        last_request.buf = request->buf;
+        #endif /* MASTER */
+    }
+
+    #ifdef MASTER
+    uint32_t age = request_age(request);
+    request_queue.stats.sent++;
+    request_queue.stats.total_age += age;
+    if(age > request_queue.stats.max_age) request_queue.stats.max_age = age;
+    #endif /* MASTER */
+
+    lane->head = request->next;
+    lane->count--;
+    request_free(request);
+}
+
+/* The lane was served, the next one in the ring is served next time unless it
+ * was served before its turn */
+static void lane_served(uint8_t l, bool in_turn) {
+    if(request_queue.lanes[l].count == 0) lane_unlink(l);
+    else if(in_turn) request_queue.last_lane = l;
+}
+
+#ifdef OPL_COALESCE
+#ifdef MASTER
+/* Send the first requests of the lane in one multi-record frame, as long as
+ * they wait for a reply. Returns false if only one fits, so it is sent alone. */
+static bool send_records(uint8_t l, bool in_turn) {
+    lane_t *lane = &request_queue.lanes[l];
+    uint8_t frame[MULTI_HEADER_LEN + MULTI_MAX_LEN];
+    uint8_t count = 0, len = 0;
+
+    for(uint8_t i = lane->head; i != NO_REQUEST;
+        i = request_queue.elems[i].next) {
+        request_t *request = &request_queue.elems[i];
+        if(!request->wait_reply || len + 1 + request->len > MULTI_MAX_LEN)
+            break;
+
+        frame[MULTI_HEADER_LEN + len] = request->len;
+        memcpy(frame + MULTI_HEADER_LEN + len + 1, request->buf, request->len);
+        len += request->len + 1;
+        count++;
+    }
+    if(count < 2) return false;
+
+    frame[0] = len;
+    if(opl_send_bytes(lane->dest, MULTI, frame, len + MULTI_HEADER_LEN,
+                      false)) {
+        sent_records.dest = lane->dest;
+        sent_records.count = 0;
+        while(count-- > 0) {
+            sent_records.bufs[sent_records.count++] =
+                request_queue.elems[lane->head].buf;
+            request_sent(lane);
+        }
+        lane_served(l, in_turn);
+    }
+    return true; // Even if the bus was busy, they are sent together later
+}
+#endif /* MASTER */
+#endif /* OPL_COALESCE */
+
+void dispatch_request() {
+    if(request_queue.count == 0) return;
+
+    #ifdef SLAVE
+    if(!rate_limit_allows(request_budget.tat, OPL_MILLIS(),
+                          request_budget.period, request_budget.burst))
+        return; // Over the budget given by the master, wait
+    #endif /* SLAVE */
+
+    // The lane after the one served last, its first request
+    uint8_t l = request_queue.lanes[request_queue.last_lane].next;
+    bool in_turn = true;
+
+    #ifdef MASTER
+    if(request_queue.timed > 0) {
+        uint8_t earliest = earliest_lane();
+        in_turn = (earliest == l);
+        l = earliest;
+    }
+    #endif /* MASTER */
+
+    lane_t *lane = &request_queue.lanes[l];
+    request_t *request = &request_queue.elems[lane->head];
+
+    #ifdef OPL_COALESCE
+    #ifdef MASTER
+    if(request->wait_reply && send_records(l, in_turn)) return;
+    #endif /* MASTER */
+    #endif /* OPL_COALESCE */
+
+    if(send_data(request->dest, request->buf, request->len,
+                 false)) { // If it was possible to send then clear
+        #ifdef SLAVE
+        rate_limit_consume(&request_budget.tat, OPL_MILLIS(),
+                           request_budget.period);
+        #endif /* SLAVE */
+
+        request_sent(lane);
+        lane_served(l, in_turn);
     }
 }
 /******************************************************************************/
@@ -18,14 +18,15 @@ extern "C" {
 #include <stdbool.h>
 
 /* Check if there is a frame ready to be read and parse the header in that case.
- * Returns the number of received bytes (0-124). When the function is called,
- * it clears all the unread bytes from the last call. */
+ * Returns the number of received bytes, up to OPL_PAYLOAD_MAX_LEN. When the
+ * function is called, it clears all the unread bytes from the last call. */
 uint8_t opl_parse();
 
 /* Read the desired number of received bytes, and return true if the CRC is OK.
  * The "len" parameter can be less than what opl_parse() returns, but then
  * several calls are needed to calculate properly the CRC. This function should
- * be called, right after calling opl_parse() and in the same loop iteration. */
+ * be called, right after calling opl_parse() and in the same loop iteration.
+ * With OPL_ZIP a compressed frame has to be read with a single call. */
 bool opl_read(uint8_t *buf, uint8_t len);
 
 /* Send a reply to a request. It must be called only after opl_read() returns
@@ -33,6 +34,39 @@ bool opl_read(uint8_t *buf, uint8_t len);
  * otherwise. */
 bool opl_send_reply(uint8_t *buf, uint8_t len);
 
+#ifdef MASTER
+/* Status of a request dropped from the queue without being sent, or sent and
+ * left unanswered */
+enum opl_request_status {
+    OPL_REQUEST_SLAVE_DOWN = 1, // The slave missed a reply
+    OPL_REQUEST_EXPIRED    = 2, // Not sent before its timeout
+    OPL_REQUEST_NO_REPLY   = 3 // Sent with OPL_COALESCE, the slave didn't reply
+};
+
+/* Buffer of the request answered by the frame opl_parse() returned, as it was
+ * pushed, or NULL if the frame is not a reply */
+uint8_t *opl_reply_request();
+
+/* Request queue statistics, the times are in ms */
+typedef struct {
+    uint16_t sent; // Requests sent
+    uint16_t expired; // Requests dropped past their deadline
+    uint32_t max_age; // Longest wait of a request sent
+    uint32_t total_age; // Sum of the waits of the requests sent
+} opl_queue_stats_t;
+
+/* Copy the request queue statistics to stats and reset them, the average wait
+ * is total_age / sent */
+void opl_read_queue_stats(opl_queue_stats_t *stats);
+#endif /* MASTER */
+
+#ifdef OPL_ZIP
+/* Set the dictionary the DATA frames are compressed with, up to ZIP_MAX_DICT
+ * bytes of text the payloads often contain. All the nodes must use the same.
+ * It is kept as a pointer, NULL removes it. */
+void opl_set_zip_dictionary(const uint8_t *dict, uint8_t len);
+#endif /* OPL_ZIP */
+
 #ifdef __cplusplus
 }
 #endif
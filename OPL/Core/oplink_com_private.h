@@ -17,14 +17,66 @@ extern "C" {
 #include <stdint.h>
 #include <stdbool.h>
 #include "oplink_common.h"
+#ifdef OPL_AUTH
+#include "speck.h"
+#endif /* OPL_AUTH */
 
 #define LOOP_TIME 50U //50ms
 #define SEND_REPLY_TIMEOUT 2U
 #define RECEIVE_REPLY_TIMEOUT 3U // Smaller than SEND_REPLY_TIMEOUT
+#ifndef MAX_REQUESTS // Can be overridden in oplink_adapters.h
+#define MAX_REQUESTS 5 // Request queue size, limited only by the memory available
+#endif
+#ifndef MAX_DEST_REQUESTS // Master, requests per destination, can be lowered
+#define MAX_DEST_REQUESTS (MAX_REQUESTS - 1) // The whole queue
+#endif
+#ifndef REQUEST_MAX_WAIT // Master, ms, deadline of the requests without one
+#define REQUEST_MAX_WAIT 1000 // when they compete with timed ones, never dropped
+#endif
+
+#ifdef OPL_AUTH
+/* Key and frame counters of an authenticated link, new with every session */
+typedef struct {
+    uint16_t round_keys[SPECK_ROUNDS]; // Of the session key
+    uint32_t tx; // Last counter sent
+    uint32_t rx; // Last counter accepted
+} auth_session_t;
+
+/* Load the network key with OPL_LOAD_KEY */
+void auth_init();
+
+/* Derive the session key from the network key, the nonce and the token
+ * (TOKEN_SIZE bytes each) and restart the counters */
+void auth_new_session(auth_session_t *session, const uint8_t *nonce,
+                      const uint8_t *token);
+
+#ifdef MASTER
+/* Last broadcast counter sent, see OPL_SAVE_COUNTER */
+uint32_t auth_broadcast_counter();
+
+/* Save the bound of the broadcast counter when it gets close, main loop only */
+void auth_save_counter();
+#endif /* MASTER */
+
+#ifdef SLAVE
+/* Accept the broadcasts with a counter above the one given by the master */
+void auth_sync_broadcasts(uint32_t counter);
+#endif /* SLAVE */
+#endif /* OPL_AUTH */
+
+#ifdef OPL_FEC
+/* Compute the Reed-Solomon generator */
+void fec_init();
+#endif /* OPL_FEC */
 
 /* Set the node address */
 void opl_node_set_addr(uint8_t new_addr);
 
+#ifdef SLAVE
+/* Set the multicast groups of the slave, bit n for GROUP_ADDR(n) */
+void opl_node_set_groups(uint8_t groups);
+#endif /* SLAVE */
+
 /* Callback from UART RX ISR */
 void uart_rx_callback(uint8_t b);
 
@@ -37,12 +89,19 @@ node_state_t update_node_state();
  * is idle. Return false otherwise. */
 bool safe_to_send();
 
+/* Return true if nothing needs update_node_state() to run: no frame, reply or
+ * bus wait pending and no request queued. */
+bool com_idle();
+
 /* Returns the last destination */
 uint8_t get_last_dest();
 
 /* Returns the last command */
 uint8_t get_last_cmd();
 
+/* Returns the source of the frame being processed */
+uint8_t get_frame_src();
+
 /* Send a command type frame with the specified parameters. */
 bool opl_send_cmd(uint8_t addr, uint8_t cmd, uint8_t *args, uint8_t len,
                   bool wait_reply, bool force_write);
@@ -50,11 +109,44 @@ bool opl_send_cmd(uint8_t addr, uint8_t cmd, uint8_t *args, uint8_t len,
 /* Initialize the external request queue. */
 void request_queue_init();
 
-/* Push a request to the queue. Returns true on success and false otherwise. */
+/* Push a request to the queue. Returns true on success and false otherwise,
+ * also when the master has MAX_DEST_REQUESTS queued for the destination. */
 bool push_request(uint8_t dest, uint8_t *data, uint8_t len, bool wait_reply);
 
-/* Send a request if the bus is idle. On success remove it from the list. */
+#ifdef SLAVE
+/* Set the budget of the requests to the master: rate in tenths of requests per
+ * second (0 for no limit) and burst. */
+void set_request_budget(uint8_t rate, uint8_t burst);
+#endif /* SLAVE */
+
+#ifdef MASTER
+/* Same as push_request(), the request is dropped if it is not sent within
+ * timeout ms, 0 for no deadline. */
+bool push_request_timeout(uint8_t dest, uint8_t *data, uint8_t len,
+                          bool wait_reply, uint16_t timeout);
+
+/* Remove the requests queued for dest without sending them, each one is
+ * reported to request_dropped() with status. */
+void drop_requests(uint8_t dest, uint8_t status);
+
+/* Remove the requests past their deadline, each one is reported to
+ * request_dropped() with status. */
+void expire_requests(uint8_t status);
+#endif /* MASTER */
+
+/* Returns true if a request pushed with this buffer was not sent yet. The
+ * buffer can still be updated in place, with the same length. */
+bool request_queued(uint8_t *data);
+
+/* Send a request if the bus is idle, the master serves the destinations in
+ * turns, the closest deadline first. On success remove it from the list. */
 void dispatch_request();
+
+#ifdef SLAVE
+/* Answer the DATA requests whose first byte is "key" with buf from the UART
+ * ISR. A len of 0 removes the staged reply. Returns false if the table is full.*/
+bool stage_reply(uint8_t key, uint8_t *buf, uint8_t len);
+#endif /* SLAVE */
 #ifdef __cplusplus
 }
 #endif
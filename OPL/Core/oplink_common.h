@@ -17,23 +17,128 @@ extern "C" {
 #include "oplink_adapters.h"
 
 #define HSK_VER 0x01 // Handshake version
+
+#ifndef MAX_SLAVES // Can be overridden in oplink_adapters.h
 #define MAX_SLAVES  5
+#endif
 
-#define HEADER_LEN  2
+/* Forward error correction, see OPL_FEC: the meta byte is sent 3 times and the
+ * receiver takes the majority of every bit, so the frame length survives a
+ * corrupted copy. The frame ends with Reed-Solomon parity bytes after the CRC,
+ * correcting up to FEC_T corrupted bytes anywhere in the frame. */
+#ifdef OPL_FEC
+#ifndef FEC_T // Can be overridden in oplink_adapters.h
+#define FEC_T 2
+#endif
+#define FEC_LEN (2 * FEC_T) // Parity bytes
+#define FEC_META_COPIES 2 // Before the meta byte
+#else
+#define FEC_LEN 0
+#define FEC_META_COPIES 0
+#endif
+
+#define HEADER_LEN  (2 + FEC_META_COPIES)
+#define EXT_HEADER_LEN (3 + FEC_META_COPIES) // Address byte + node id + meta
 #define CRC_LEN     2
 #define OVERHEAD 4 // HEADER_LEN + CRC_LEN
 #define CMD_MAX_LEN 16
-#define OPL_PAYLOAD_MAX_LEN 124 // 128 byte UART buffer - 4 OVERHEAD
+
+/* Authenticated frames, see OPL_AUTH: the payload is followed by the 16 low bits
+ * of the frame counter and the MAC tag, before the CRC */
+#define EXT_HEADER_EXTRA (EXT_HEADER_LEN - HEADER_LEN) // Node id byte
+#ifdef OPL_AUTH
+#define AUTH_LEN 6 // Counter (2B) + tag (4B)
+#define OPL_PAYLOAD_MAX_LEN (124 - EXT_HEADER_EXTRA - AUTH_LEN - FEC_LEN - \
+                             FEC_META_COPIES)
+#else
+// 128 byte UART buffer - 4 OVERHEAD - the node id of an extended frame
+#define OPL_PAYLOAD_MAX_LEN (124 - EXT_HEADER_EXTRA - FEC_LEN - FEC_META_COPIES)
+#endif
+
+/* Compressed DATA frames, see OPL_ZIP: the meta byte holds ZIP_META instead of
+ * the length, followed by the length once decompressed (with the ZIP_DICT flag
+ * if the shared dictionary was used) and the length of the compressed payload.
+ * They must be smaller than the DATA frame they replace. */
+#define ZIP_META       0x7F // Never a valid length
+#define ZIP_HEADER_LEN 2
+#define ZIP_DICT       0x80
+#define ZIP_LEN_MASK   0x7F
+#define ZIP_MIN_LEN    8 // Shorter payloads are sent as they are
+#define ZIP_MAX_DICT   128
+
+/* Multi-record DATA frames, see OPL_COALESCE: the meta byte holds MULTI_META,
+ * followed by the length of the records. Each record is its length followed by
+ * its bytes. */
+#define MULTI_META       0x7E // Never a valid length
+#define MULTI_HEADER_LEN 1
+#ifndef MULTI_MAX_LEN // Can be overridden in oplink_adapters.h
+#define MULTI_MAX_LEN    (OPL_PAYLOAD_MAX_LEN - MULTI_HEADER_LEN)
+#endif
+
+/* Staged replies are sent from the UART RX interrupt, which busy-waits on every
+ * byte, about 0.57 ms each at 19200 baud. The interrupts at the same priority,
+ * the millisecond timer usually, are held meanwhile, so they are kept short. */
+#ifndef STAGED_MAX_LEN // Can be overridden in oplink_adapters.h
+#define STAGED_MAX_LEN 4
+#endif
+
+/* Micro frames, see OPL_MICRO: a core command without arguments, or with one
+ * argument up to MICRO_MAX_ARG, rides in the meta byte of a CMD frame without
+ * payload. The meta byte holds MICRO_FLAG, the argument + 1 (0 without
+ * argument) and the command. The check is only the first byte of the CRC.
+ * Without OPL_MICRO they are neither sent nor accepted. */
+#define MICRO_FLAG      0x40 // Never set in the length of a CMD frame
+#define MICRO_CMD_MASK  0x0F
+#define MICRO_ARG_SHIFT 4
+#define MICRO_MAX_ARG   2
+#define MICRO_CRC_LEN   1
+#ifdef OPL_MICRO
+#define IS_MICRO(_meta) (((_meta) & (0x80 | MICRO_FLAG)) == (0x80 | MICRO_FLAG))
+#else
+#define IS_MICRO(_meta) false
+#endif /* OPL_MICRO */
 
 #define MASTER_ADDR  0x0F
 #define DEFAULT_ADDR 0x00
 #define SOURCE_ADDR  0xF0
 
+/* Extended addressing: the address byte only has room for 4-bit addresses, so
+ * nodes above MAX_SHORT_ADDR use frames with EXT_ADDR_NIBBLE as the source
+ * nibble followed by the full 8-bit node id. The destination nibble still
+ * holds a coarse address so the UART address wake-up keeps filtering. */
+#define EXT_ADDR_NIBBLE 0x0E
+#define MAX_SHORT_ADDR  0x0D
+#define MAX_EXT_ADDR    (FIRST_GROUP_ADDR - 1)
+
+/* Multicast groups: the master makes every slave a member of some of the
+ * MAX_GROUPS groups. A frame to a group is an extended frame to DEFAULT_ADDR,
+ * so it wakes up every slave, with GROUP_ADDR(group) as the node id. The slaves
+ * that aren't members mute on that byte, before the payload. */
+#define MAX_GROUPS       8 // Bits of the membership mask
+#define FIRST_GROUP_ADDR (0x100 - MAX_GROUPS) // Never given to a slave
+#define GROUP_ADDR(_group) (FIRST_GROUP_ADDR + (_group))
+#define IS_GROUP_ADDR(_addr) ((_addr) >= FIRST_GROUP_ADDR)
+
+#if MAX_SLAVES > MAX_EXT_ADDR - 1 // MASTER_ADDR is never given to a slave
+#error "MAX_SLAVES is too big"
+#endif
+
+/* Default no ping window of the slaves, the master changes it with PING */
+#define NO_PING_TIME 60000 // ms
+
+/* Default budget of the requests a slave sends to the master, the master can
+ * change it per slave. Rate in tenths of requests per second. */
+#define REQUEST_RATE  10
+#define REQUEST_BURST 4
+
 #define SYNC_BYTE 0x55
 
 typedef enum {
     DATA = 0,
-    CMD  = 1
+    CMD  = 1,
+    ZIP  = 2, // DATA with a compressed payload, only used to send
+    MICRO = 3, // CMD in the meta byte, given as data[0], only used to send
+    MULTI = 4 // DATA with records, only used to send
 } frame_mode_t;
 
 enum parse_result {
@@ -47,7 +152,10 @@ enum core_commands {
     GET_UID  = 2,
     PING     = 3,
     ALERT    = 4,
+    RESUME   = 5,
     ACK      = 6,  // ASCII
+    DISCOVER = 7,
+    REJOIN   = 8,
     NACK     = 15, // ASCII
     EXT      = 20  // Dummy command
 };
@@ -55,6 +163,29 @@ enum core_commands {
 #define IPv6_SIZE 6
 #define UID_SIZE  12
 #define KEY_SIZE  8
+#define TOKEN_SIZE 4 // Session token, issued by the master with FIND
+
+/* RESUME arguments, with OPL_AUTH the master also issues a new token */
+#ifdef OPL_AUTH
+#define RESUME_ARGS (2 * TOKEN_SIZE)
+#else
+#define RESUME_ARGS TOKEN_SIZE
+#endif
+
+/* PING arguments, with OPL_AUTH the master also gives its broadcast counter */
+#ifdef OPL_AUTH
+#define PING_ARGS 8
+#else
+#define PING_ARGS 4
+#endif
+
+/* Persistent slave table record: address, UID length, UID and token, with
+ * OPL_AUTH also the nonce of the session key */
+#ifdef OPL_AUTH
+#define SLAVE_RECORD_SIZE (2 + UID_SIZE + 2 * TOKEN_SIZE)
+#else
+#define SLAVE_RECORD_SIZE (2 + UID_SIZE + TOKEN_SIZE)
+#endif
 
 enum slave_mode {
     NO_CONFIG  = 0,
@@ -18,54 +18,362 @@
 #include "oplink_master.h"
 
 #define CYCLES_PER_SECOND 20 // 1000 / LOOP_TIME
+#define MAX_HANDSHAKES 4 // Slaves joining at the same time
+#define HANDSHAKE_RETRY 2 // Resends of a handshake step without reply
+#define NO_HANDSHAKE 0xFF
 
-static uint8_t new_slave_addr;
+/* Handshakes: every SIGNAL opens a session keyed by the nonce of the slave, and
+ * the sessions are served in turns so the slaves that power up together join
+ * in parallel. A session ends with the slave in the list, its first PING is
+ * sent as any other. */
+enum handshake_step {HSK_FREE = 0, HSK_FIND, HSK_GET_UID};
+
+typedef struct {
+    uint8_t step;
+    uint8_t addr;
+    uint8_t retry;
+    uint8_t nonce[TOKEN_SIZE];
+    uint8_t token[TOKEN_SIZE];
+} handshake_t;
+
+static handshake_t handshakes[MAX_HANDSHAKES];
+static uint8_t current_hsk = NO_HANDSHAKE; // Session waiting for a reply
+static uint8_t next_hsk = 0;
+
+static opl_request_callback_t request_callback = NULL;
+
+/* Discovery: binary search over the UID space driven by the master. A query
+ * holds a prefix of the UID, and the slaves waiting to join whose UID starts
+ * with it reply with SIGNAL. Silence prunes the branch, a collision splits it
+ * in two and a valid SIGNAL starts a handshake as usual. */
+#define DISCOVERY_BITS (UID_SIZE * 8)
+
+enum discovery_result {SILENCE, COLLISION, FOUND, REFUSED, LIST_FULL};
+
+static struct {
+    bool running;
+    bool waiting; // Query sent, the result is not known yet
+    bool activity; // Bytes received while waiting
+    bool descended; // The current prefix is the 0 branch of a collision
+    uint8_t depth; // Prefix length in bits
+    uint8_t prefix[UID_SIZE];
+} discovery;
+
+/* The session token only has to differ between sessions, it is not a secret */
+static void new_token(uint8_t *token, uint8_t *nonce) {
+    static uint8_t sessions = 0;
+    uint32_t millis = OPL_MILLIS();
+
+    sessions++;
+    for(uint8_t i = 0; i < TOKEN_SIZE; i++)
+        token[i] = nonce[i] ^ (uint8_t)(millis >> (8 * i)) ^ sessions;
+}
+
+/* PING(1B), WINDOW(1B), RATE(1B), BURST(1B), GROUPS(1B)
+ * and BROADCAST COUNTER(4B) with OPL_AUTH.
+ * The arguments are only sent when the no ping window, the request budget or
+ * the multicast groups change, or the slave rejoined. A slave restored from the persistent table gets
+ * RESUME(1B), TOKEN(4B) instead, so it keeps its address without a new
+ * handshake. With OPL_AUTH the frame counters were lost, so RESUME also carries
+ * a NEW TOKEN(4B) and a new session key is derived from the old and the new
+ * token. The slot switches to it only once the slave ACKs. */
+static bool send_ping(uint8_t addr, bool force_write) {
+    uint8_t *token = slave_resume_token(addr);
+    if(token != NULL) {
+        #ifdef OPL_AUTH
+        uint8_t args[RESUME_ARGS];
+        memcpy(args, token, TOKEN_SIZE);
+        new_token(args + TOKEN_SIZE, token);
+        slave_new_session(addr, NULL, NULL); // Sent with the saved session key
+        if(!opl_send_cmd(addr, RESUME, args, RESUME_ARGS, true, force_write))
+            return false;
+        slave_resume_offer(addr, args + TOKEN_SIZE); // Until the ACK
+        return true;
+        #else
+        return opl_send_cmd(addr, RESUME, token, TOKEN_SIZE, true, force_write);
+        #endif /* OPL_AUTH */
+    }
+
+    uint8_t args[PING_ARGS];
+    args[0] = slave_ping_window(addr);
+    slave_get_budget(addr, args + 1);
+    args[3] = slave_get_groups(addr);
+    #ifdef OPL_AUTH
+    uint32_t counter = auth_broadcast_counter();
+    for(uint8_t i = 0; i < 4; i++)
+        args[4 + i] = (uint8_t)(counter >> (24 - 8 * i));
+    #endif /* OPL_AUTH */
+    return opl_send_cmd(addr, PING, args, args[0] ? PING_ARGS : 0, true,
+                        force_write);
+}
 
 bool opl_push_request(uint8_t *uid, uint8_t *data, uint8_t len) {
-    uint8_t dest = map_uid_to_addr(uid);
-    if(dest == 0) return false; // No uid match
-    return push_request(dest, data, len, true); // Wait for reply
+    return opl_push_request_handle(get_slave_handle(uid), data, len);
+}
+
+bool opl_push_request_handle(opl_handle_t handle, uint8_t *data, uint8_t len) {
+    return opl_push_request_timeout(handle, data, len, 0);
+}
+
+bool opl_push_request_timeout(opl_handle_t handle, uint8_t *data, uint8_t len,
+                              uint16_t timeout) {
+    uint8_t dest = map_handle_to_addr(handle);
+    if(dest == 0) return false; // Stale or invalid handle
+    if(!slave_available(dest)) return false; // Fail fast, the breaker is open
+    return push_request_timeout(dest, data, len, true, // Wait for reply
+                                timeout);
+}
+
+bool opl_set_request_budget(opl_handle_t handle, uint8_t rate, uint8_t burst) {
+    uint8_t addr = map_handle_to_addr(handle);
+    if(addr == 0) return false; // Stale or invalid handle
+    slave_set_budget(addr, rate, burst);
+    return true;
 }
 
 bool opl_push_broadcast(uint8_t *data, uint8_t len) {
     return push_request(0x00, data, len, false); // Don't wait for reply
 }
 
-static void handle_new_slave(uint8_t *args) {
-    new_slave_addr = slave_list_available();
-    uint8_t temp_buf[5];
-    if(new_slave_addr) {
-        switch(args[0]) { // Test the version
-            case 0x01:
-                memcpy(temp_buf, args + 1, 4);
-                temp_buf[4] = new_slave_addr;
-                opl_send_cmd(DEFAULT_ADDR, FIND, temp_buf, 5, true, true);
+void opl_set_request_callback(opl_request_callback_t callback) {
+    request_callback = callback;
+}
+
+bool opl_set_groups(opl_handle_t handle, uint8_t groups) {
+    uint8_t addr = map_handle_to_addr(handle);
+    if(addr == 0) return false; // Stale or invalid handle
+    slave_set_groups(addr, groups);
+    return true;
+}
+
+bool opl_push_multicast(uint8_t group, uint8_t *data, uint8_t len) {
+    if(group >= MAX_GROUPS) return false;
+    return push_request(GROUP_ADDR(group), data, len, false); // No reply
+}
+
+static void handshake_end(uint8_t index) {
+    slave_list_release(handshakes[index].addr); // No-op if the slave was added
+    handshakes[index].step = HSK_FREE;
+}
+
+/* Send the next step of the next session waiting for it, if any. Right after a
+ * reply the bus is known to be free, so the steps are chained with force_write
+ * and the sessions don't wait for the next loop. */
+static bool dispatch_handshake(bool force_write) {
+    for(uint8_t n = 0; n < MAX_HANDSHAKES; n++) {
+        uint8_t i = next_hsk;
+        next_hsk = (next_hsk + 1) % MAX_HANDSHAKES;
+        handshake_t *hsk = &handshakes[i];
+        uint8_t temp_buf[2 * TOKEN_SIZE + 1];
+
+        switch(hsk->step) {
+            case HSK_FIND: // FIND(1B), NONCE(4B), ADDR(1B), TOKEN(4B)
+                memcpy(temp_buf, hsk->nonce, TOKEN_SIZE);
+                temp_buf[TOKEN_SIZE] = hsk->addr;
+                memcpy(temp_buf + TOKEN_SIZE + 1, hsk->token, TOKEN_SIZE);
+                if(!opl_send_cmd(DEFAULT_ADDR, FIND, temp_buf,
+                                 sizeof(temp_buf), true, force_write))
+                    return false;
+                break;
+            case HSK_GET_UID:
+                if(!opl_send_cmd(hsk->addr, GET_UID, NULL, 0, true,
+                                 force_write))
+                    return false;
                 break;
+            default:
+                continue;
+        }
+        current_hsk = i;
+        return true;
+    }
+    return false;
+}
+
+static bool handshake_idle() {
+    for(uint8_t i = 0; i < MAX_HANDSHAKES; i++)
+        if(handshakes[i].step != HSK_FREE) return false;
+    return true;
+}
+
+#define PREFIX_BIT(_i) (0x80 >> ((_i) & 0x07))
+
+/* DISCOVER(1B), DEPTH(1B), PREFIX(DEPTH bits rounded up to bytes) */
+static bool send_discover() {
+    uint8_t temp_buf[UID_SIZE + 1];
+    uint8_t len = (discovery.depth + 7) / 8;
+
+    temp_buf[0] = discovery.depth;
+    memcpy(temp_buf + 1, discovery.prefix, len);
+    if(!opl_send_cmd(DEFAULT_ADDR, DISCOVER, temp_buf, len + 1, true, false))
+        return false;
+
+    OPL_UART_CLEAR_BUSY(); // Only the bytes after the query count
+    discovery.waiting = true;
+    discovery.activity = false;
+    return true;
+}
+
+static void discovery_descend() {
+    discovery.prefix[discovery.depth / 8] &= ~PREFIX_BIT(discovery.depth);
+    discovery.depth++;
+    discovery.descended = true;
+}
+
+/* Move to the next branch in depth-first order, or end the discovery */
+static void discovery_next() {
+    while(discovery.depth > 0) {
+        uint8_t bit = discovery.depth - 1;
+        uint8_t *byte = &discovery.prefix[bit / 8];
+
+        if((*byte & PREFIX_BIT(bit)) == 0) {
+            *byte |= PREFIX_BIT(bit);
+            // The 0 branch of a collision was silent, so the 1 branch holds
+            // all the colliding slaves: split it without asking
+            if(discovery.descended && discovery.depth < DISCOVERY_BITS)
+                discovery_descend();
+            return;
         }
+        discovery.depth--;
     }
+    discovery.running = false;
+}
+
+static void discovery_result(uint8_t result) {
+    discovery.waiting = false;
+
+    switch(result) {
+        case FOUND: // Ask again, the slave found doesn't reply anymore
+            discovery.descended = false;
+            break;
+        case REFUSED: // It can't join, asking again finds it again
+            discovery_next();
+            break;
+        case LIST_FULL: // Nobody else can join either
+            discovery.running = false;
+            break;
+        case COLLISION:
+            if(discovery.depth < DISCOVERY_BITS) discovery_descend();
+            else discovery_next(); // Same UID, they have to signal
+            break;
+        case SILENCE:
+            discovery_next();
+            break;
+    }
+}
+
+bool opl_discover() {
+    if(discovery.running) return false;
+    memset(&discovery, 0, sizeof(discovery));
+    discovery.running = true;
+    return true;
+}
+
+bool opl_discovery_running() {
+    return discovery.running;
+}
+
+/* REJOIN(1B), TOKEN(4B) from the address the slave had */
+static void handle_rejoin(uint8_t *buf, uint8_t len) {
+    uint8_t src = get_frame_src();
+    if(len == TOKEN_SIZE + 1 && slave_rejoin(src, buf + 1))
+        opl_send_cmd(src, ACK, NULL, 0, false, true);
+    else
+        opl_send_cmd(src, NACK, NULL, 0, false, true);
+}
+
+/* Open a session for a SIGNAL. Returns FOUND if the slave has a session or
+ * will get one once another ends, REFUSED or LIST_FULL if it can't join. */
+static uint8_t handle_new_slave(uint8_t *args) {
+    uint8_t free_hsk = NO_HANDSHAKE;
+
+    if(args[0] != HSK_VER) return REFUSED; // Test the version
+
+    for(uint8_t i = 0; i < MAX_HANDSHAKES; i++) {
+        if(handshakes[i].step == HSK_FREE) {
+            if(free_hsk == NO_HANDSHAKE) free_hsk = i;
+        }
+        else if(memcmp(handshakes[i].nonce, args + 1, TOKEN_SIZE) == 0) {
+            handshakes[i].retry = 0; // Repeated SIGNAL, the session goes on
+            return FOUND;
+        }
+    }
+    if(free_hsk == NO_HANDSHAKE) return FOUND; // The slave will signal again
+
+    uint8_t addr = slave_list_reserve();
+    if(addr == 0) // Unless the free slots are only reserved by other sessions
+        return slave_list_full() ? LIST_FULL : FOUND;
+
+    handshakes[free_hsk].step = HSK_FIND;
+    handshakes[free_hsk].addr = addr;
+    handshakes[free_hsk].retry = 0;
+    memcpy(handshakes[free_hsk].nonce, args + 1, TOKEN_SIZE);
+    new_token(handshakes[free_hsk].token, args + 1);
+    #ifdef OPL_AUTH
+    // Derived once, the frames from GET_UID on are keyed with it
+    slave_new_session(addr, args + 1, handshakes[free_hsk].token);
+    #endif /* OPL_AUTH */
+
+    // Reply right away unless another session is waiting for its reply
+    if(current_hsk == NO_HANDSHAKE) dispatch_handshake(true);
+    return FOUND;
+}
+
+static void handshake_timeout() {
+    if(current_hsk == NO_HANDSHAKE) return;
+    if(++handshakes[current_hsk].retry > HANDSHAKE_RETRY)
+        handshake_end(current_hsk);
+    current_hsk = NO_HANDSHAKE;
+}
+
+/* A slave without UID is known by its address, in 2 hex characters */
+static void addr_to_uid(uint8_t addr, uint8_t *uid) {
+    static const char hex[] = "0123456789ABCDEF";
+    uid[0] = hex[addr >> 4];
+    uid[1] = hex[addr & 0x0F];
 }
 
 static void handle_ack(uint8_t *args, uint8_t len) {
-    uint8_t addr_buffer;
+    uint8_t addr_uid[2];
+    handshake_t *hsk = &handshakes[current_hsk % MAX_HANDSHAKES];
+
     switch(get_last_cmd()) {
         case FIND:
-            opl_send_cmd(new_slave_addr, GET_UID, NULL, 0, true, true);
+            if(current_hsk == NO_HANDSHAKE) break;
+            hsk->step = HSK_GET_UID;
+            hsk->retry = 0;
+            current_hsk = NO_HANDSHAKE;
+            dispatch_handshake(true);
             break;
         case GET_UID:
+            if(current_hsk == NO_HANDSHAKE) break;
             if(len <= UID_SIZE) {
                 if(len != 0) {
-                    slave_list_add(new_slave_addr, args, len);
+                    slave_list_add(hsk->addr, args, len, hsk->token);
                 }
                 else {
-                    addr_buffer = new_slave_addr + '0';
-                    slave_list_add(new_slave_addr, &addr_buffer, 1);
+                    addr_to_uid(hsk->addr, addr_uid);
+                    slave_list_add(hsk->addr, addr_uid, sizeof(addr_uid),
+                                   hsk->token);
                 }
-
-                opl_send_cmd(new_slave_addr, PING, NULL, 0, true, true);
+            }
+            handshake_end(current_hsk);
+            current_hsk = NO_HANDSHAKE;
+            if(!dispatch_handshake(true)) {
+                uint8_t ping_addr = next_slave_ping(); // Completes handshakes
+                if(ping_addr > 0) send_ping(ping_addr, true);
             }
             break;
         case PING:
-            slave_set_ping_period(get_last_dest(), PING_PERIOD);
+        case RESUME:
+            slave_ping_ack(get_last_dest());
+            break;
+    }
+}
+
+static void handle_nack() {
+    switch(get_last_cmd()) {
+        case RESUME: // The slave doesn't know the session anymore
+            slave_clear_slot(ADDR_TO_SLOT(get_last_dest()));
             break;
     }
 }
@@ -75,6 +383,12 @@ void opl_init() {
     OPL_LIN_ENABLE_TX();
 
     opl_node_set_addr(MASTER_ADDR);
+    #ifdef OPL_AUTH
+    auth_init();
+    #endif /* OPL_AUTH */
+    #ifdef OPL_FEC
+    fec_init();
+    #endif /* OPL_FEC */
     slave_list_init();
     request_queue_init();
     // Set UART to 9-N-1 mode @ 19200 baud with addr 0x0F
@@ -90,15 +404,47 @@ void route_command(uint8_t *buf, uint8_t len) {
     //if(last_request.reply != pending) {
         switch(buf[0]){
             case SIGNAL:
-                handle_new_slave(buf + 1);
+                if(discovery.waiting && get_last_cmd() == DISCOVER)
+                    discovery_result(handle_new_slave(buf + 1));
+                else
+                    handle_new_slave(buf + 1);
                 break;
             case ACK:
                 handle_ack(buf + 1, --len); // We know len is at least 1
                 break;
+            case NACK:
+                handle_nack();
+                break;
+            case REJOIN:
+                handle_rejoin(buf, len);
+                break;
         }
     //}
 }
 
+/* Called from opl_parse() for every request a slave sends on its own */
+bool accept_request(uint8_t src) {
+    return slave_take_request(src);
+}
+
+/* Called for every request removed from the queue or left unanswered */
+void request_dropped(uint8_t dest, uint8_t *data, uint8_t status) {
+    if(request_callback != NULL)
+        request_callback(map_addr_to_handle(dest), data, status);
+}
+
+/* Called from opl_read() for every frame with a valid CRC. */
+void link_activity(uint8_t src, uint8_t dest) {
+    slave_seen(src);
+}
+
+#ifdef OPL_AUTH
+/* Called from the COM layer for every frame sent or received */
+auth_session_t *get_session(uint8_t node) {
+    return slave_session(node);
+}
+#endif /* OPL_AUTH */
+
 void opl_keep_alive() {
     static uint32_t old_millis = 0;
     static uint8_t seconds = 0;
@@ -111,20 +457,41 @@ void opl_keep_alive() {
             slave_list_ping_tick(); // Just tick
         }
 
+        expire_requests(OPL_REQUEST_EXPIRED); // Stale, not worth the bus time
+        #ifdef OPL_AUTH
+        auth_save_counter();
+        #endif /* OPL_AUTH */
+
+        if(discovery.waiting && OPL_UART_IS_BUSY())
+            discovery.activity = true; // Something replied to the query
+
         if(update_node_state() == RECEIVE_TIMEOUT_ERROR) {
-            // Increase slave ping error if it didn't reply to the PING
-            if(get_last_cmd() == PING)
+            // A slave that didn't reply to a PING or a request opens its
+            // breaker, the requests queued for it fail now
+            if(get_last_cmd() == PING || get_last_cmd() == RESUME ||
+               get_last_cmd() == EXT) {
+                drop_requests(get_last_dest(), OPL_REQUEST_SLAVE_DOWN);
                 slave_ping_error(get_last_dest());
+            }
+            else if(get_last_cmd() == FIND || get_last_cmd() == GET_UID)
+                handshake_timeout();
         }
 
+        if(discovery.waiting && safe_to_send()) // Reply done or timed out
+            discovery_result(discovery.activity ? COLLISION : SILENCE);
+
         if(safe_to_send()) {
-            // Ping has higher priority so it is checked first
-            uint8_t ping_addr = next_slave_ping();
+            // Joining slaves time out quickly, then discovery, pings and
+            // requests. The slave found by a query joins before the next one.
+            if(!dispatch_handshake(false) &&
+               !(discovery.running && handshake_idle() && send_discover())) {
+                uint8_t ping_addr = next_slave_ping();
 
-            if(ping_addr > 0) // Addresses start from 1, 0 means no need to ping
-                opl_send_cmd(ping_addr, PING, NULL, 0, true, false);
-            else // Dispatch next request if any
-                dispatch_request();
+                if(ping_addr > 0) // Addresses start from 1, 0 means no ping
+                    send_ping(ping_addr, false);
+                else // Dispatch next request if any
+                    dispatch_request();
+            }
         }
     }
 }
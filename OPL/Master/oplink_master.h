@@ -32,15 +32,73 @@ void opl_init();
  * Send ping to the connected devices */
 void opl_keep_alive();
 
+/* Called for every request dropped from the queue, and with OPL_COALESCE for
+ * every request sent in a multi-record frame and left unanswered, see
+ * opl_request_status. data is the buffer it was pushed with. The handle is
+ * OPL_NO_HANDLE if the slave left. The callback runs from opl_keep_alive() or
+ * opl_parse(), it can push requests but it should return quickly. */
+typedef void (*opl_request_callback_t)(opl_handle_t handle, uint8_t *data,
+                                       uint8_t status);
+
+/* Register the function called for the dropped requests, NULL to remove it */
+void opl_set_request_callback(opl_request_callback_t callback);
+
 /* Push a request to the queue. The request will be sent to the addr
  * corresponding to the provided uid as soon as the device is idle and the bus
- * is free. */
+ * is free. The slaves are served in turns, and a slave can't have more than
+ * MAX_DEST_REQUESTS requests in the queue. With OPL_COALESCE the requests
+ * queued for a slave are sent together in one frame, up to MULTI_MAX_LEN, and
+ * their replies come back in one frame too. opl_parse() then returns them one
+ * at a time, in the order of the requests, and opl_reply_request() tells which
+ * request each one answers. A slave that missed the reply to a
+ * request or a PING is unavailable until it acknowledges the PING sent 2 s
+ * later: the requests queued for it are dropped with OPL_REQUEST_SLAVE_DOWN
+ * and new ones are refused. */
 bool opl_push_request(uint8_t *uid, uint8_t *data, uint8_t len);
 
+/* Same as opl_push_request() but using a handle from get_slave_handle(), which
+ * avoids resolving the uid on every request. Returns false if the slave left
+ * the network since the handle was obtained. */
+bool opl_push_request_handle(opl_handle_t handle, uint8_t *data, uint8_t len);
+
+/* Same as opl_push_request_handle() with a deadline: the request is dropped
+ * with OPL_REQUEST_EXPIRED if it is not sent within timeout ms (0 for none).
+ * The slave whose next request has the closest deadline is served first. The
+ * requests without one are never dropped, but are served as if their deadline
+ * was REQUEST_MAX_WAIT ms. opl_read_queue_stats() tells how long the requests
+ * wait. */
+bool opl_push_request_timeout(opl_handle_t handle, uint8_t *data, uint8_t len,
+                              uint16_t timeout);
+
+/* Set the budget of the requests the slave sends on its own: rate in tenths of
+ * requests per second (0 for no limit) and burst. It is sent to the slave with
+ * the next PING, and the requests over it are dropped. Returns false if the
+ * handle is stale. The default is REQUEST_RATE and REQUEST_BURST. */
+bool opl_set_request_budget(opl_handle_t handle, uint8_t rate, uint8_t burst);
+
 /* Push a request to the queue. The request will be sent to all the nodes as
  * soon as the device is idle and the bus is free. */
 bool opl_push_broadcast(uint8_t *data, uint8_t len);
 
+/* Make the slave a member of the multicast groups set in groups, bit n for
+ * group n (MAX_GROUPS of them). They are sent with a PING in the next second.
+ * Returns false if the handle is stale. A slave joining again has no group. */
+bool opl_set_groups(opl_handle_t handle, uint8_t groups);
+
+/* Push a request to the queue. The request will be sent in one frame to all
+ * the members of the group, that can't reply to it. Returns false if the
+ * group is not below MAX_GROUPS or the queue is full. */
+bool opl_push_multicast(uint8_t group, uint8_t *data, uint8_t len);
+
+/* Start a discovery of the slaves waiting to join. The master searches the UID
+ * space instead of waiting for the slaves to signal, so the time to find all
+ * of them is bounded. It ends early once the slave list is full, see
+ * OPL_SLAVE_LIST_FULL. Returns false if a discovery is already running. */
+bool opl_discover();
+
+/* Returns true until the discovery started by opl_discover() is over */
+bool opl_discovery_running();
+
 #ifdef __cplusplus
 }
 #endif
@@ -8,31 +8,289 @@
  */
 
 #include <stdint.h>
+#include <stdbool.h>
 #include <string.h>
 #include "slave_list.h"
 #include "slave_list_private.h"
+#include "rate_limit.h"
 
 slave_t slaves[MAX_SLAVES];
 
+static uint8_t n_slaves = 0; // Occupied slots, lets the scans exit early
+
+/* Ping scheduling: timing wheel with one bucket per second. Every slave waits
+ * in the bucket of the second it is due, and each tick moves the slaves that
+ * expired to the due list. The head of the due list is the slave being pinged
+ * and it stays there until the PING is acknowledged or fails. */
+#define NO_SLOT 0xFF
+#define WHEEL_MASK (PING_WHEEL_SIZE - 1)
+
+enum ping_state {PING_IDLE = 0, PING_WHEEL, PING_DUE};
+
+static uint16_t ping_clock = 0;
+static uint8_t wheel[PING_WHEEL_SIZE];
+static uint8_t due_head = NO_SLOT;
+static uint8_t due_tail = NO_SLOT;
+
+static uint8_t uid_index[UID_INDEX_SIZE];
+
+static opl_net_callback_t net_callback = NULL;
+static uint8_t generation = 0;
+
+#ifdef OPL_AUTH
+/* Session offered by the RESUME waiting for its ACK. The slot keeps its nonce,
+ * token and session until the slave confirms it switched, so a lost RESUME or
+ * a lost ACK leaves the slot as it was. There is one reply at a time. */
+static struct {
+    uint8_t addr; // 0 when no RESUME is pending
+    uint8_t token[TOKEN_SIZE];
+    auth_session_t session;
+} resume_offer;
+#endif /* OPL_AUTH */
+
+#define INDEX_MASK (UID_INDEX_SIZE - 1)
+
+static uint16_t uid_hash(const uint8_t *uid, uint8_t len) {
+    uint16_t hash = 5381;
+    for(uint8_t i = 0; i < len; i++)
+        hash = ((hash << 5) + hash) ^ uid[i];
+    return hash & INDEX_MASK;
+}
+
+/* Return the index position holding the UID, or the empty position where it
+ * would have to be inserted. There is always an empty position left. */
+static uint16_t uid_index_find(const uint8_t *uid, uint8_t len) {
+    uint16_t pos = uid_hash(uid, len);
+    while(uid_index[pos] != 0) {
+        slave_t *slave = &slaves[uid_index[pos] - 1];
+        if(slave->uid_len == len && memcmp(slave->uid, uid, len) == 0)
+            break;
+        pos = (pos + 1) & INDEX_MASK;
+    }
+    return pos;
+}
+
+/* Backward shift deletion, it keeps the probe sequences short without having
+ * to use tombstones. */
+static void uid_index_remove(uint16_t pos) {
+    uint16_t next = pos;
+    while(1) {
+        next = (next + 1) & INDEX_MASK;
+        if(uid_index[next] == 0) break;
+
+        slave_t *slave = &slaves[uid_index[next] - 1];
+        uint16_t home = uid_hash(slave->uid, slave->uid_len);
+
+        // Move the entry only if its home is not cyclically in (pos, next]
+        if( (pos <= next) ? (pos < home && home <= next) :
+                            (pos < home || home <= next) )
+            continue;
+
+        uid_index[pos] = uid_index[next];
+        pos = next;
+    }
+    uid_index[pos] = 0;
+}
+
+static void ping_unlink(uint8_t index) {
+    uint8_t *head;
+    uint8_t prev = NO_SLOT;
+
+    switch(slaves[index].ping_state) {
+        case PING_WHEEL:
+            head = &wheel[slaves[index].ping_due & WHEEL_MASK];
+            break;
+        case PING_DUE:
+            head = &due_head;
+            break;
+        default:
+            return; // Not scheduled
+    }
+
+    for(uint8_t i = *head; i != index; i = slaves[i].ping_next)
+        prev = i;
+
+    if(prev == NO_SLOT) *head = slaves[index].ping_next;
+    else slaves[prev].ping_next = slaves[index].ping_next;
+
+    if(head == &due_head && index == due_tail) due_tail = prev;
+    slaves[index].ping_state = PING_IDLE;
+}
+
+static void ping_due_push(uint8_t index) {
+    slaves[index].ping_state = PING_DUE;
+    slaves[index].ping_next = NO_SLOT;
+    if(due_tail == NO_SLOT) due_head = index;
+    else slaves[due_tail].ping_next = index;
+    due_tail = index;
+}
+
+static void ping_schedule(uint8_t index, uint8_t seconds) {
+    ping_unlink(index);
+
+    // Spread the pings, take the closest earlier second without pings if any
+    uint16_t due = ping_clock + seconds;
+    for(uint8_t i = 0; i < PING_SPREAD && i < seconds - 1; i++) {
+        if(wheel[(due - i) & WHEEL_MASK] == NO_SLOT) {
+            due -= i;
+            break;
+        }
+    }
+
+    slaves[index].ping_due = due;
+    slaves[index].ping_state = PING_WHEEL;
+    slaves[index].ping_next = wheel[due & WHEEL_MASK];
+    wheel[due & WHEEL_MASK] = index;
+}
+
+static opl_handle_t slot_handle(uint8_t index) {
+    return ((uint16_t)slaves[index].gen << 8) | slaves[index].addr;
+}
+
+static void network_changed(opl_net_event_t event, uint8_t index) {
+    generation++;
+    if(net_callback != NULL)
+        net_callback(event, slaves[index].uid, slaves[index].uid_len,
+                     slot_handle(index));
+}
+
+/* Persistent slave table: every slot is written when it changes, and it is
+ * loaded at init so the slaves are resumed instead of going through the whole
+ * handshake again. */
+static void slot_save(uint8_t index) {
+#ifdef OPL_SAVE_SLAVE
+    slave_record_t record;
+    memset(&record, 0, sizeof(record));
+    if(slaves[index].addr != 0x00) {
+        record.addr = slaves[index].addr;
+        record.uid_len = slaves[index].uid_len;
+        memcpy(record.uid, slaves[index].uid, UID_SIZE);
+        memcpy(record.token, slaves[index].token, TOKEN_SIZE);
+        #ifdef OPL_AUTH
+        memcpy(record.nonce, slaves[index].nonce, TOKEN_SIZE);
+        #endif /* OPL_AUTH */
+    }
+    OPL_SAVE_SLAVE(index, (uint8_t *)&record);
+#else
+    (void)index;
+#endif
+}
+
+static void slot_set(uint8_t index, uint8_t addr, uint8_t *uid, uint8_t len,
+                     uint8_t *token) {
+    slaves[index].addr = addr;
+    slaves[index].uid_len = len;
+    memcpy(slaves[index].uid, uid, len);
+    memcpy(slaves[index].token, token, TOKEN_SIZE);
+    uid_index[uid_index_find(uid, len)] = index + 1;
+    n_slaves++;
+    slaves[index].ping_period = PING_PERIOD;
+    slaves[index].ping_window = 0; // The slave uses its default window
+    slaves[index].request_rate = REQUEST_RATE;
+    slaves[index].request_burst = REQUEST_BURST;
+    slaves[index].request_tat = OPL_MILLIS();
+    slaves[index].groups = 0;
+}
+
+#ifdef OPL_LOAD_SLAVE
+static void slave_list_load() {
+    slave_record_t record;
+    for(uint8_t i = 0; i < MAX_SLAVES; i++) {
+        OPL_LOAD_SLAVE(i, (uint8_t *)&record);
+        if(record.addr != SLOT_TO_ADDR(i) || record.uid_len == 0 ||
+           record.uid_len > UID_SIZE ||
+           map_uid_to_addr(record.uid, record.uid_len) != 0)
+            continue; // Empty or corrupted record
+
+        slot_set(i, record.addr, record.uid, record.uid_len, record.token);
+        #ifdef OPL_AUTH
+        memcpy(slaves[i].nonce, record.nonce, TOKEN_SIZE); // Key derived later
+        #endif /* OPL_AUTH */
+        slaves[i].resume = true;
+        ping_due_push(i); // Resume all of them right away
+        generation++;
+    }
+}
+#endif
+
+/* Free an occupied slot without notifying the application */
+static void slot_remove(uint8_t index) {
+    uid_index_remove(uid_index_find(slaves[index].uid, slaves[index].uid_len));
+    slaves[index].gen++; // Invalidate the handles to this slot
+    ping_unlink(index);
+    n_slaves--;
+    slaves[index].addr = 0x00;
+    slaves[index].uid_len = 0;
+    slaves[index].resume = false;
+    slot_save(index);
+}
+
 void slave_list_init() {
     for(uint8_t i = 0; i < MAX_SLAVES; i++) {
         slave_clear_slot(i);
     }
+    n_slaves = 0;
+
+    memset(wheel, NO_SLOT, PING_WHEEL_SIZE);
+    due_head = NO_SLOT;
+    due_tail = NO_SLOT;
+
+#ifdef OPL_LOAD_SLAVE
+    slave_list_load();
+#endif
 }
 
-uint8_t slave_list_available() {
-    for(uint8_t i = 0; i < MAX_SLAVES; i++)
-        if(slaves[i].addr == 0x00)
-            return i + 1; // Valid addresses start from 1
+/* Returns a free address and keeps it for the handshake in progress, or 0 if
+ * there is none. Several handshakes can run at the same time. A slave refused
+ * because the list is full is reported with OPL_SLAVE_LIST_FULL. */
+uint8_t slave_list_reserve() {
+    if(slave_list_full()) {
+        if(net_callback != NULL)
+            net_callback(OPL_SLAVE_LIST_FULL, NULL, 0, OPL_NO_HANDLE);
+        return 0;
+    }
+    for(uint8_t i = 0; i < MAX_SLAVES; i++) {
+        if(slaves[i].addr == 0x00 && (!slaves[i].reserved ||
+           (slaves[i].quarantined &&
+            (int16_t)(ping_clock - slaves[i].ping_due) >= 0))) {
+            slaves[i].reserved = true;
+            slaves[i].quarantined = false;
+            return SLOT_TO_ADDR(i);
+        }
+    }
     return 0;
 }
 
-bool slave_list_add(uint8_t new_addr, uint8_t *uid, uint8_t len) {
-    slave_clear_slot(map_uid_to_addr(uid) - 1); // Remove old entry if any
-    uint8_t index = new_addr - 1;
-    if(slaves[index].addr == 0x00) { // Convert from addr to index
-        slaves[index].addr = new_addr;
-        if(uid != NULL) memcpy(slaves[index].uid, uid, len);
+bool slave_list_full() {
+    return n_slaves == MAX_SLAVES;
+}
+
+/* End the reservation of a handshake. If the slave wasn't added, it might
+ * have taken the address anyway, if the ACK to FIND was lost for instance. The
+ * address is only free again after ADDR_QUARANTINE. */
+void slave_list_release(uint8_t addr) {
+    uint8_t index = ADDR_TO_SLOT(addr);
+    if(!slaves[index].reserved) return; // Added
+    slaves[index].quarantined = true;
+    slaves[index].ping_due = ping_clock + ADDR_QUARANTINE; // Free slot, unused
+}
+
+bool slave_list_add(uint8_t new_addr, uint8_t *uid, uint8_t len,
+                    uint8_t *token) {
+    uint8_t index = ADDR_TO_SLOT(new_addr);
+    if(slaves[index].addr == 0x00) {
+        uint8_t old_addr = map_uid_to_addr(uid, len);
+        if(old_addr) slot_remove(ADDR_TO_SLOT(old_addr)); // Remove old entry
+
+        slot_set(index, new_addr, uid, len, token);
+        slaves[index].reserved = false;
+        slaves[index].quarantined = false;
+        slot_save(index);
+        // The first PING completes the handshake, it is sent right away
+        ping_due_push(index);
+
+        network_changed(old_addr ? OPL_SLAVE_READDRESSED : OPL_SLAVE_JOINED,
+                        index);
         return true;
     }
     else{
@@ -41,75 +299,282 @@ bool slave_list_add(uint8_t new_addr, uint8_t *uid, uint8_t len) {
 }
 
 void slave_clear_slot(uint8_t index) {
-    slaves[index].addr = 0x00;
+    #ifdef OPL_AUTH
+    if(resume_offer.addr == SLOT_TO_ADDR(index)) resume_offer.addr = 0x00;
+    #endif /* OPL_AUTH */
+    if(slaves[index].addr != 0x00) {
+        network_changed(OPL_SLAVE_LEFT, index);
+        slot_remove(index);
+    }
+    slaves[index].uid_len = 0;
     memset(slaves[index].uid, 0, UID_SIZE);
-    slaves[index].ping_count = 0xFF;
+    slaves[index].ping_due = 0;
     slaves[index].ping_error = 0;
 }
 
+/* Adaptive ping period: every acknowledged PING stretches the period of the
+ * slave up to PING_PERIOD_MAX, while a missed PING is retried after PING_RETRY
+ * so a dead slave is dropped in seconds. A slave that recovers after a missed
+ * PING starts again from PING_PERIOD. */
+static uint8_t next_ping_period(uint8_t index) {
+    if(slaves[index].ping_period > PING_PERIOD_MAX - PING_PERIOD_STEP)
+        return PING_PERIOD_MAX;
+    return slaves[index].ping_period + PING_PERIOD_STEP;
+}
+
+/* Circuit breaker: a slave that missed the reply to a PING or to a request has
+ * its breaker open until a PING is acknowledged. Meanwhile its requests fail
+ * right away instead of holding the bus until their reply timeout, and the
+ * PING retry is the single probe that closes it again. */
 void slave_ping_error(uint8_t addr) {
-    if(++(slaves[--addr].ping_error) == MAX_PING_ERROR) // Convert to index
-        slave_clear_slot(addr); // Pass the index
+    uint8_t index = ADDR_TO_SLOT(addr);
+    if(slaves[index].addr != addr) return; // Left in the meantime
+
+    #ifdef OPL_AUTH
+    if(resume_offer.addr == addr) resume_offer.addr = 0x00; // Keep the old one
+    #endif /* OPL_AUTH */
+    if(++(slaves[index].ping_error) == MAX_PING_ERROR)
+        slave_clear_slot(index);
+    else
+        ping_schedule(index, PING_RETRY); // Confirm the failure quickly
 }
 
-void slave_set_ping_period(uint8_t addr, uint8_t ticks) {
-    if(ticks) {
-        slaves[--addr].ping_count = ticks; // Convert from addr to index
-        slaves[addr].ping_error = 0;
-    }
+bool slave_available(uint8_t addr) {
+    return slaves[ADDR_TO_SLOT(addr)].ping_error == 0; // Breaker closed
 }
 
-static bool ping_flag = false;
+/* Returns the no ping window (seconds) to send with the next PING, or 0 if the
+ * slave already has it. It covers the period used if the PING succeeds. */
+uint8_t slave_ping_window(uint8_t addr) {
+    uint8_t index = ADDR_TO_SLOT(addr);
+    uint8_t window = next_ping_period(index) + PING_GRACE;
+    return (window == slaves[index].ping_window) ? 0 : window;
+}
 
-void slave_list_ping_tick(){
-    for(uint8_t i = 0; i < MAX_SLAVES; i++)
-        if( (slaves[i].addr != 0x00) && (slaves[i].ping_count > 0) )
-            if(--slaves[i].ping_count == 0)
-                ping_flag = true; // At least one slave needs to be pinged
+void slave_ping_ack(uint8_t addr) {
+    uint8_t index = ADDR_TO_SLOT(addr);
+    if(slaves[index].addr != addr) return; // Left in the meantime
+
+    if(slaves[index].resume) {
+        // Confirmed, the slave still has its old window until the next PING
+        slaves[index].resume = false;
+        #ifdef OPL_AUTH
+        if(resume_offer.addr == addr) { // The old token becomes the nonce
+            memcpy(slaves[index].nonce, slaves[index].token, TOKEN_SIZE);
+            memcpy(slaves[index].token, resume_offer.token, TOKEN_SIZE);
+            slaves[index].session = resume_offer.session;
+            resume_offer.addr = 0x00;
+        }
+        slot_save(index); // With the token issued by RESUME
+        #endif /* OPL_AUTH */
+    }
+    else {
+        slaves[index].ping_window = next_ping_period(index) + PING_GRACE;
+        if(slaves[index].ping_error) slaves[index].ping_period = PING_PERIOD;
+        else slaves[index].ping_period = next_ping_period(index);
+    }
+
+    slaves[index].ping_error = 0;
+    ping_schedule(index, slaves[index].ping_period);
 }
 
-/* This function implements a circular structure to verify if a slave needs to
- * be pinged. There are two for loops, checking from the last index up to the
- * max and from 0 up to the last index. The reason for this is to make sure
- * all the nodes are visited while keeping track of what node was pinged last.
- */
-uint8_t next_slave_ping() {
-    static uint8_t last = 0;
+/* Returns the session token if the slave has to be resumed instead of pinged */
+uint8_t *slave_resume_token(uint8_t addr) {
+    uint8_t index = ADDR_TO_SLOT(addr);
+    return slaves[index].resume ? slaves[index].token : NULL;
+}
 
-    if(ping_flag == false) return 0; // Early return to skip the loops
+/* A slave that was unplugged for a moment rejoins with its address and token.
+ * It reset its no ping window, so the next PING is advanced to send it again
+ * before the slave gives up on the network. */
+bool slave_rejoin(uint8_t addr, uint8_t *token) {
+    if(addr == 0x00 || addr == MASTER_ADDR) return false;
 
-    uint8_t this = last;
+    uint8_t index = ADDR_TO_SLOT(addr);
+    if(index >= MAX_SLAVES || slaves[index].addr != addr ||
+       memcmp(slaves[index].token, token, TOKEN_SIZE) != 0)
+        return false;
 
-    for( ; last < MAX_SLAVES; last++)
-        if(slaves[last].ping_count == 0)
-            return ++last; // Increase for next call & to convert to address
+    slaves[index].ping_error = 0;
+    slaves[index].ping_window = 0;
+    slaves[index].ping_period = PING_PERIOD;
+    slaves[index].resume = false; // It proved it has the session
+    ping_schedule(index, 1);
+    return true;
+}
 
-    for(last = 0; last < this; last++)
-        if(slaves[last].ping_count == 0)
-            return ++last; // Increase for next call & to convert to address
+/* Any valid frame from a slave proves it is alive as well as a PING, so its
+ * next PING is postponed. Explicit PINGs are only sent to idle slaves. Retries
+ * after a missed PING are not postponed, they decide the ping period, and
+ * neither are the PINGs with arguments the slave doesn't have yet. */
+void slave_seen(uint8_t addr) {
+    if(addr == 0x00 || addr == MASTER_ADDR) return;
 
-    ping_flag = false; // If we are here it is because no slave needs ping
-    return 0;
+    uint8_t index = ADDR_TO_SLOT(addr);
+    if(index < MAX_SLAVES && slaves[index].addr == addr &&
+       slaves[index].ping_error == 0 && !slaves[index].resume &&
+       slaves[index].ping_window != 0)
+        ping_schedule(index, slaves[index].ping_period);
+}
+
+void slave_list_ping_tick(){
+    ping_clock++;
+
+    // Only the slaves due in this second or in later rounds are visited
+    uint8_t *link = &wheel[ping_clock & WHEEL_MASK];
+    while(*link != NO_SLOT) {
+        uint8_t index = *link;
+        if(slaves[index].ping_due == ping_clock) {
+            *link = slaves[index].ping_next;
+            ping_due_push(index);
+        }
+        else {
+            link = &slaves[index].ping_next;
+        }
+    }
+}
+
+uint8_t next_slave_ping() {
+    if(due_head == NO_SLOT) return 0; // No slave needs to be pinged
+    return slaves[due_head].addr;
 }
 
 void get_slave_list(opl_slave_list_t *ptr) {
     uint8_t count = 0;
-    for(uint8_t i = 0; i < MAX_SLAVES; i++) {
+    for(uint8_t i = 0; i < MAX_SLAVES && count < n_slaves; i++) {
         if(slaves[i].addr != 0) {
-            memcpy(ptr->uids[i], slaves[i].uid, strlen(slaves[i].uid));
+            memcpy(ptr->uids[count], slaves[i].uid, slaves[i].uid_len);
+            ptr->uids[count][slaves[i].uid_len] = '\0';
             count++;
         }
     }
     ptr->n_slaves = count;
+    ptr->generation = generation;
 
     for(uint8_t i = count; i < MAX_SLAVES; i++){
         ptr->uids[i][0] = '\0'; // Set first value of each uid slot to 0
     }
 }
 
-uint8_t map_uid_to_addr(uint8_t *uid) {
-    for(uint8_t i = 0; i < MAX_SLAVES; i++)
-        if(memcmp(uid, slaves[i].uid, strlen(slaves[i].uid)) == 0)
-            return slaves[i].addr;
-    return 0;
+opl_handle_t get_slave_handle(uint8_t *uid) {
+    uint8_t len = 0;
+    while(len < UID_SIZE && uid[len] != '\0') len++;
+
+    uint8_t addr = map_uid_to_addr(uid, len);
+    if(addr == 0) return OPL_NO_HANDLE;
+    return slot_handle(ADDR_TO_SLOT(addr));
+}
+
+uint8_t get_slave_list_generation() {
+    return generation;
+}
+
+void set_slave_list_callback(opl_net_callback_t callback) {
+    net_callback = callback;
+}
+
+uint8_t map_uid_to_addr(uint8_t *uid, uint8_t len) {
+    if(len == 0 || len > UID_SIZE) return 0;
+    uint8_t index = uid_index[uid_index_find(uid, len)];
+    if(index == 0) return 0; // No uid match
+    return slaves[index - 1].addr;
+}
+
+/* The budget goes with the no ping window, so clearing the window sends both
+ * with the next PING */
+void slave_set_budget(uint8_t addr, uint8_t rate, uint8_t burst) {
+    uint8_t index = ADDR_TO_SLOT(addr);
+    slaves[index].request_rate = rate;
+    slaves[index].request_burst = burst;
+    slaves[index].ping_window = 0;
+}
+
+void slave_get_budget(uint8_t addr, uint8_t *budget) {
+    uint8_t index = ADDR_TO_SLOT(addr);
+    budget[0] = slaves[index].request_rate;
+    budget[1] = slaves[index].request_burst;
+}
+
+/* The groups go with the no ping window too, and the PING is advanced so the
+ * multicasts reach the slave soon. A retry or a RESUME is already close. */
+void slave_set_groups(uint8_t addr, uint8_t groups) {
+    uint8_t index = ADDR_TO_SLOT(addr);
+    slaves[index].groups = groups;
+    slaves[index].ping_window = 0;
+    if(slaves[index].ping_error == 0 && !slaves[index].resume)
+        ping_schedule(index, 1);
+}
+
+uint8_t slave_get_groups(uint8_t addr) {
+    return slaves[ADDR_TO_SLOT(addr)].groups;
+}
+
+/* Police the requests sent by the slave with the budget it was given, with one
+ * more request of tolerance for the clock drift */
+bool slave_take_request(uint8_t addr) {
+    if(addr == 0x00 || addr == MASTER_ADDR) return true;
+
+    uint8_t index = ADDR_TO_SLOT(addr);
+    if(index >= MAX_SLAVES || slaves[index].addr != addr) return true;
+
+    uint16_t period = RATE_TO_PERIOD(slaves[index].request_rate);
+    uint8_t burst = slaves[index].request_burst + 1;
+    if(!rate_limit_allows(slaves[index].request_tat, OPL_MILLIS(), period,
+                          burst))
+        return false;
+    rate_limit_consume(&slaves[index].request_tat, OPL_MILLIS(), period);
+    return true;
+}
+
+opl_handle_t map_addr_to_handle(uint8_t addr) {
+    if(addr == 0x00 || addr == MASTER_ADDR) return OPL_NO_HANDLE;
+
+    uint8_t index = ADDR_TO_SLOT(addr);
+    if(index >= MAX_SLAVES || slaves[index].addr != addr) return OPL_NO_HANDLE;
+    return slot_handle(index);
+}
+
+uint8_t map_handle_to_addr(opl_handle_t handle) {
+    uint8_t addr = handle & 0xFF;
+    if(addr == 0x00 || addr == MASTER_ADDR) return 0;
+
+    uint8_t index = ADDR_TO_SLOT(addr);
+    if(index >= MAX_SLAVES) return 0;
+    if(slaves[index].addr != addr || slaves[index].gen != (handle >> 8))
+        return 0; // The slave left, the handle is stale
+    return addr;
+}
+
+#ifdef OPL_AUTH
+/* Derive the session key of the slot from a new nonce and token, or from the
+ * ones it has when they are NULL. The slot can still be reserved for a
+ * handshake. */
+void slave_new_session(uint8_t addr, uint8_t *nonce, uint8_t *token) {
+    uint8_t index = ADDR_TO_SLOT(addr);
+    if(nonce != NULL) memcpy(slaves[index].nonce, nonce, TOKEN_SIZE);
+    if(token != NULL) memcpy(slaves[index].token, token, TOKEN_SIZE);
+    auth_new_session(&slaves[index].session, slaves[index].nonce,
+                     slaves[index].token);
+}
+
+/* Derive the session offered by a RESUME that was just sent with token. It
+ * only checks the ACK, see slave_ping_ack(). */
+void slave_resume_offer(uint8_t addr, uint8_t *token) {
+    uint8_t index = ADDR_TO_SLOT(addr);
+    memcpy(resume_offer.token, token, TOKEN_SIZE);
+    auth_new_session(&resume_offer.session, slaves[index].token, token);
+    resume_offer.addr = addr;
+}
+
+auth_session_t *slave_session(uint8_t addr) {
+    if(addr == 0x00 || addr == MASTER_ADDR) return NULL;
+    if(addr == resume_offer.addr) return &resume_offer.session;
+
+    uint8_t index = ADDR_TO_SLOT(addr);
+    if(index >= MAX_SLAVES ||
+       (slaves[index].addr != addr && !slaves[index].reserved))
+        return NULL;
+
+    return &slaves[index].session;
 }
+#endif /* OPL_AUTH */
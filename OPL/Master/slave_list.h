@@ -22,16 +22,62 @@ extern "C" {
  */
 typedef struct {
     uint8_t n_slaves;
+    uint8_t generation; // See get_slave_list_generation()
     uint8_t uids[MAX_SLAVES][UID_SIZE + 1];
 } opl_slave_list_t;
 
+/*
+ * Stable reference to a connected slave. It stays valid until the slave leaves
+ * the network, even if another slave takes its address later on.
+ */
+typedef uint16_t opl_handle_t;
+#define OPL_NO_HANDLE 0
+
+/*
+ * Network change events. A slave that handshakes again with the same UID while
+ * it is still in the list gets a new address and its old handle goes stale.
+ */
+typedef enum {
+    OPL_SLAVE_JOINED,
+    OPL_SLAVE_LEFT,
+    OPL_SLAVE_READDRESSED,
+    OPL_SLAVE_LIST_FULL // A slave was refused, MAX_SLAVES are connected
+} opl_net_event_t;
+
+/*
+ * The handle is the new one for OPL_SLAVE_JOINED and OPL_SLAVE_READDRESSED, and
+ * the last one (stale after the callback returns) for OPL_SLAVE_LEFT. The uid
+ * is not null-terminated. OPL_SLAVE_LIST_FULL comes with no uid and no handle,
+ * every time a slave signals while the list is full. The callback runs from opl_parse() or
+ * opl_keep_alive(), it can push requests but it should return quickly.
+ */
+typedef void (*opl_net_callback_t)(opl_net_event_t event, uint8_t *uid,
+                                   uint8_t len, opl_handle_t handle);
+
 /*
  * Fills the passed struct with the most updated network status: number of nodes
- * and UID of each node. It is recommended to call this function periodically.
- * TODO: add a network change (node connected/disconnected) callback.
+ * and UID of each node. Use the network callback or the generation to know
+ * when it is worth calling it.
  */
 void get_slave_list(opl_slave_list_t *ptr);
 
+/*
+ * Returns a counter incremented on every network change. If it matches the
+ * generation of the last list, the list is still up to date.
+ */
+uint8_t get_slave_list_generation();
+
+/*
+ * Registers the function called on every network change, NULL to remove it.
+ */
+void set_slave_list_callback(opl_net_callback_t callback);
+
+/*
+ * Resolves a null-terminated UID to a handle, or OPL_NO_HANDLE if no connected
+ * slave has it. Requests pushed with the handle skip the UID lookup.
+ */
+opl_handle_t get_slave_handle(uint8_t *uid);
+
 #ifdef __cplusplus
 }
 #endif
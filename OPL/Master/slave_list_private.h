@@ -13,33 +13,139 @@
 #include <stdint.h>
 #include <stdbool.h>
 #include "oplink_common.h"
+#include "oplink_com_private.h"
+#include "slave_list.h"
 
 #define MAX_PING_ERROR 3
-#define PING_PERIOD 30 // seconds
+#define PING_PERIOD 30 // seconds, period of a new or unreliable slave
+#define PING_PERIOD_MAX 120 // seconds, reached by reliable slaves
+#define PING_PERIOD_STEP 30 // seconds added after every acknowledged PING
+#define PING_RETRY 2 // seconds between PINGs after a missed one
+/* Margin of the no ping window negotiated with the slave, so it doesn't reset
+ * before the master gave up on it */
+#define PING_GRACE (MAX_PING_ERROR * (PING_RETRY + 1) + 2)
+// seconds an address stays reserved after a failed handshake, the slave may
+// hold it until its default no ping window expires
+#define ADDR_QUARANTINE (NO_PING_TIME / 1000 + 2)
+
+#if PING_PERIOD_MAX + PING_GRACE > 0xFF
+#error "The no ping window doesn't fit in the PING argument"
+#endif
+#define PING_WHEEL_SIZE 32 // seconds, power of 2
+#define PING_SPREAD 8 // Max seconds a ping is advanced to avoid bursts
+
+/* Slot index <-> node address. Valid addresses start from 1 and MASTER_ADDR is
+ * never handed out to a slave, so it is skipped when MAX_SLAVES is big. */
+#define SLOT_TO_ADDR(_i) ((_i) < MASTER_ADDR - 1 ? (_i) + 1 : (_i) + 2)
+#define ADDR_TO_SLOT(_a) ((_a) < MASTER_ADDR ? (_a) - 1 : (_a) - 2)
+
+/* UID index: open-addressed table with linear probing. It holds slot index + 1
+ * (0 means empty) and it is at least twice as big as the slave list. */
+#if MAX_SLAVES <= 4
+#define UID_INDEX_SIZE 8
+#elif MAX_SLAVES <= 8
+#define UID_INDEX_SIZE 16
+#elif MAX_SLAVES <= 16
+#define UID_INDEX_SIZE 32
+#elif MAX_SLAVES <= 32
+#define UID_INDEX_SIZE 64
+#elif MAX_SLAVES <= 64
+#define UID_INDEX_SIZE 128
+#elif MAX_SLAVES <= 128
+#define UID_INDEX_SIZE 256
+#else
+#define UID_INDEX_SIZE 512
+#endif
 
 typedef struct {
     uint8_t addr;
+    uint8_t gen; // Incremented every time the slot is cleared, see handles
+    uint8_t uid_len;
     uint8_t uid[UID_SIZE];
-    uint8_t ping_count;
+    uint8_t token[TOKEN_SIZE];
+    bool resume; // Restored from the slave table, not confirmed yet
+    bool reserved; // Free slot promised to a slave during its handshake
+    bool quarantined; // Reserved after a failed handshake until ping_due
+    uint16_t ping_due; // Ping clock second when the slave has to be pinged
     uint8_t ping_error;
+    uint8_t ping_period; // seconds, adapted to the link reliability
+    uint8_t ping_window; // seconds, last no ping window the slave acknowledged
+    uint8_t ping_state;
+    uint8_t ping_next; // Next slot in the same wheel bucket or in the due list
+    uint8_t request_rate; // Tenths of requests per second, sent with PING
+    uint8_t request_burst;
+    uint32_t request_tat; // Bucket of the requests from the slave, see rate_limit
+    uint8_t groups; // Multicast groups, bit n for GROUP_ADDR(n), sent with PING
+    #ifdef OPL_AUTH
+    uint8_t nonce[TOKEN_SIZE]; // The session key is derived from it and token
+    auth_session_t session;
+    #endif /* OPL_AUTH */
 } slave_t;
 
+/* Record of the persistent slave table, see OPL_SAVE_SLAVE */
+typedef struct {
+    uint8_t addr;
+    uint8_t uid_len;
+    uint8_t uid[UID_SIZE];
+    uint8_t token[TOKEN_SIZE];
+    #ifdef OPL_AUTH
+    uint8_t nonce[TOKEN_SIZE];
+    #endif /* OPL_AUTH */
+} slave_record_t;
+
 void slave_list_init();
 
-uint8_t slave_list_available();
+uint8_t slave_list_reserve();
+
+bool slave_list_full();
+
+void slave_list_release(uint8_t addr);
 
-bool slave_list_add(uint8_t new_addr, uint8_t *uid, uint8_t len);
+bool slave_list_add(uint8_t new_addr, uint8_t *uid, uint8_t len,
+                    uint8_t *token);
 
-void slave_clear_slot(uint8_t addr);
+void slave_clear_slot(uint8_t index);
 
 void slave_ping_error(uint8_t addr);
 
-void slave_set_ping_period(uint8_t addr, uint8_t ticks);
+bool slave_available(uint8_t addr);
+
+uint8_t slave_ping_window(uint8_t addr);
+
+void slave_ping_ack(uint8_t addr);
+
+uint8_t *slave_resume_token(uint8_t addr);
+
+bool slave_rejoin(uint8_t addr, uint8_t *token);
+
+void slave_seen(uint8_t addr);
 
 void slave_list_ping_tick();
 
 uint8_t next_slave_ping();
 
-uint8_t map_uid_to_addr(uint8_t *uid);
+uint8_t map_uid_to_addr(uint8_t *uid, uint8_t len);
+
+uint8_t map_handle_to_addr(opl_handle_t handle);
+
+opl_handle_t map_addr_to_handle(uint8_t addr);
+
+void slave_set_budget(uint8_t addr, uint8_t rate, uint8_t burst);
+
+void slave_get_budget(uint8_t addr, uint8_t *budget);
+
+void slave_set_groups(uint8_t addr, uint8_t groups);
+
+uint8_t slave_get_groups(uint8_t addr);
+
+bool slave_take_request(uint8_t addr);
+
+#ifdef OPL_AUTH
+void slave_new_session(uint8_t addr, uint8_t *nonce, uint8_t *token);
+
+void slave_resume_offer(uint8_t addr, uint8_t *token);
+
+auth_session_t *slave_session(uint8_t addr);
+#endif /* OPL_AUTH */
 
 #endif /* SLAVE_LIST_PRIVATE_H */
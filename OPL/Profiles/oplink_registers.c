@@ -0,0 +1,476 @@
+/*
+ * Filename:    oplink_registers.c
+ * Project:     OpenPAYGO Link
+ * Author:      Daniel Nedosseikine
+ * Company:     Solaris Offgrid
+ * Created on:  19/10/2026
+ * Description: Optional register map profile on top of the DATA frames.
+ */
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include "oplink_common.h"
+#include "oplink_com.h"
+#include "oplink_com_private.h"
+#include "oplink_registers.h"
+#ifdef MASTER
+#include "oplink_master.h"
+#include "slave_list_private.h"
+#endif /* MASTER */
+
+#define REG_HEADER_LEN 4 // Reply: op, status, start, count
+
+/* Value encoding *************************************************************/
+static void reg_put(uint8_t *buf, uint8_t size, uint32_t value) {
+    for(uint8_t i = size; i > 0; i--) {
+        buf[i - 1] = (uint8_t)value; // Network (big) endianness
+        value >>= 8;
+    }
+}
+
+static uint32_t reg_get(uint8_t *buf, uint8_t size) {
+    uint32_t value = 0;
+    for(uint8_t i = 0; i < size; i++) value = (value << 8) | buf[i];
+    return value;
+}
+
+static int32_t reg_signed(uint32_t value, uint8_t type) {
+    uint8_t size = REG_SIZE(type);
+
+    if((type & REG_SIGNED) && size < 4 && (value >> (size * 8 - 1)))
+        value |= 0xFFFFFFFF << (size * 8); // Sign extension
+
+    return (int32_t)value;
+}
+/******************************************************************************/
+
+#ifdef SLAVE
+/* Slave register table *******************************************************/
+static struct {
+    const opl_register_t *table;
+    uint8_t count;
+    opl_reg_write_callback_t callback;
+} regs = {NULL, 0, NULL};
+
+static uint8_t reg_buffer[REG_MAX_LEN];
+
+#define REG_RETRY_TIME 1000 // ms before a publication without ack is repeated
+
+typedef struct {
+    uint8_t len; // Publication length, 0 if the subscription is free
+    bool fresh; // Never published
+    bool unacked; // Published, the master didn't acknowledge it yet
+    uint16_t deadband;
+    uint16_t interval; // ms
+    uint32_t sent_ms;
+    uint8_t buf[REG_PUBLISH_LEN]; // Last publication, op status start count
+} subscription_t;
+
+static subscription_t subs[MAX_SUBSCRIPTIONS];
+
+void opl_reg_init(const opl_register_t *table, uint8_t count,
+                  opl_reg_write_callback_t callback) {
+    regs.table = table;
+    regs.count = count;
+    regs.callback = callback;
+}
+
+static uint32_t reg_load(uint8_t reg) {
+    void *ptr = regs.table[reg].ptr;
+    switch(REG_SIZE(regs.table[reg].type)) {
+        case 1: return *(uint8_t *)ptr;
+        case 2: return *(uint16_t *)ptr;
+        default: return *(uint32_t *)ptr;
+    }
+}
+
+static void reg_store(uint8_t reg, uint32_t value) {
+    void *ptr = regs.table[reg].ptr;
+    switch(REG_SIZE(regs.table[reg].type)) {
+        case 1: *(uint8_t *)ptr = (uint8_t)value; break;
+        case 2: *(uint16_t *)ptr = (uint16_t)value; break;
+        default: *(uint32_t *)ptr = value; break;
+    }
+}
+
+/* Append the values of the registers to the reply, returns the new length or 0
+ * if they don't fit in a frame */
+static uint8_t reg_append(uint8_t pos, uint8_t reg) {
+    uint8_t size = REG_SIZE(regs.table[reg].type);
+    if(pos + size > REG_MAX_LEN) return 0;
+    reg_put(reg_buffer + pos, size, reg_load(reg));
+    return pos + size;
+}
+
+static uint8_t reg_write(uint8_t *buf, uint8_t len) {
+    uint8_t start = buf[1], count = buf[2];
+    uint8_t pos = 3;
+
+    // Check the whole request first, the registers are written all or none
+    for(uint8_t reg = start; reg < start + count; reg++) {
+        if(regs.table[reg].type & REG_RO) return REG_READ_ONLY;
+        pos += REG_SIZE(regs.table[reg].type);
+    }
+    if(pos != len) return REG_BAD_LEN;
+
+    pos = 3;
+    for(uint8_t reg = start; reg < start + count; reg++) {
+        uint8_t size = REG_SIZE(regs.table[reg].type);
+        reg_store(reg, reg_get(buf + pos, size));
+        pos += size;
+        if(regs.callback != NULL) regs.callback(reg);
+    }
+    return REG_OK;
+}
+
+static uint8_t reg_subscribe(uint8_t *buf, uint8_t len) {
+    uint8_t start = buf[1], count = buf[2];
+    uint8_t pub_len = REG_HEADER_LEN;
+    subscription_t *sub = NULL;
+
+    if(len != 7) return REG_BAD_LEN;
+    if(count == 0) {
+        memset(subs, 0, sizeof(subs)); // Remove all the subscriptions
+        return REG_OK;
+    }
+    if(start + count > regs.count) return REG_BAD_REG;
+
+    for(uint8_t reg = start; reg < start + count; reg++)
+        pub_len += REG_SIZE(regs.table[reg].type);
+    if(pub_len > REG_PUBLISH_LEN) return REG_BAD_LEN;
+
+    for(uint8_t i = 0; i < MAX_SUBSCRIPTIONS; i++) {
+        if(subs[i].len > 0 && subs[i].buf[2] == start) {
+            sub = &subs[i]; // Replace it
+            break;
+        }
+        if(subs[i].len == 0 && sub == NULL) sub = &subs[i];
+    }
+    if(sub == NULL) return REG_NO_ROOM;
+
+    sub->len = pub_len;
+    sub->fresh = true;
+    sub->unacked = false;
+    sub->deadband = (uint16_t)reg_get(buf + 3, 2);
+    sub->interval = (uint16_t)reg_get(buf + 5, 2);
+    sub->buf[0] = REG_PUBLISH;
+    sub->buf[1] = REG_OK;
+    sub->buf[2] = start;
+    sub->buf[3] = count;
+    return REG_OK;
+}
+
+static void reg_ack(uint8_t *buf, uint8_t len) {
+    for(uint8_t i = 0; i < MAX_SUBSCRIPTIONS; i++) {
+        if(subs[i].len > 0 && len >= 3 && subs[i].buf[2] == buf[2])
+            subs[i].unacked = false;
+    }
+}
+
+bool opl_reg_process(uint8_t *buf, uint8_t len) {
+    if(len < 3 || buf[0] < REG_DESCRIBE || buf[0] > REG_PUBLISH)
+        return false;
+
+    if(buf[0] == REG_PUBLISH) { // The master acknowledged a publication
+        reg_ack(buf, len);
+        return true;
+    }
+
+    uint8_t op = buf[0], count = buf[2];
+    uint8_t reply_len = REG_HEADER_LEN;
+    uint8_t status = REG_OK;
+
+    reg_buffer[0] = op;
+    reg_buffer[2] = buf[1];
+    reg_buffer[3] = count;
+
+    if(op == REG_MULTI_READ) {
+        count = buf[1]; // List of registers instead of a range
+        if(len != 2 + count || 3 + count > REG_MAX_LEN) status = REG_BAD_LEN;
+        for(uint8_t i = 0; i < count && status == REG_OK; i++) {
+            if(buf[2 + i] >= regs.count) status = REG_BAD_REG;
+        }
+        if(status == REG_OK) memcpy(reg_buffer + 3, buf + 2, count);
+        reply_len = 3 + count;
+        for(uint8_t i = 0; i < count && status == REG_OK; i++) {
+            reply_len = reg_append(reply_len, buf[2 + i]);
+            if(reply_len == 0) status = REG_BAD_LEN;
+        }
+    }
+    else if(op == REG_SUBSCRIBE) {
+        status = reg_subscribe(buf, len);
+    }
+    else if(count == 0 || buf[1] + count > regs.count) {
+        status = REG_BAD_REG;
+    }
+    else if(op == REG_DESCRIBE) {
+        if(REG_HEADER_LEN + count > REG_MAX_LEN) status = REG_BAD_LEN;
+        for(uint8_t i = 0; i < count && status == REG_OK; i++)
+            reg_buffer[reply_len++] = regs.table[buf[1] + i].type;
+    }
+    else if(op == REG_READ) {
+        if(len != 3) status = REG_BAD_LEN;
+        for(uint8_t i = 0; i < count && status == REG_OK; i++) {
+            reply_len = reg_append(reply_len, buf[1] + i);
+            if(reply_len == 0) status = REG_BAD_LEN;
+        }
+    }
+    else { // REG_WRITE
+        status = reg_write(buf, len);
+    }
+
+    reg_buffer[1] = status;
+    if(status != REG_OK) reply_len = (op == REG_MULTI_READ) ? 3 : REG_HEADER_LEN;
+    if(op == REG_MULTI_READ && status != REG_OK) reg_buffer[2] = 0;
+
+    opl_send_reply(reg_buffer, reply_len);
+    return true;
+}
+
+/* Write the current values of the subscribed registers after the header */
+static void reg_fill(subscription_t *sub) {
+    uint8_t pos = REG_HEADER_LEN;
+    for(uint8_t reg = sub->buf[2]; reg < sub->buf[2] + sub->buf[3]; reg++) {
+        uint8_t size = REG_SIZE(regs.table[reg].type);
+        reg_put(sub->buf + pos, size, reg_load(reg));
+        pos += size;
+    }
+}
+
+/* Compare the registers with the values of the last publication */
+static bool reg_changed(subscription_t *sub) {
+    uint8_t pos = REG_HEADER_LEN;
+    for(uint8_t reg = sub->buf[2]; reg < sub->buf[2] + sub->buf[3]; reg++) {
+        uint8_t type = regs.table[reg].type;
+        uint32_t last = reg_get(sub->buf + pos, REG_SIZE(type));
+        uint32_t value = reg_load(reg);
+        bool greater = value > last; // REG_U32 doesn't fit in an int32_t
+        if(type & REG_SIGNED) {
+            last = (uint32_t)reg_signed(last, type);
+            value = (uint32_t)reg_signed(value, type);
+            greater = (int32_t)value > (int32_t)last;
+        }
+        uint32_t diff = greater ? value - last : last - value;
+        if(diff > sub->deadband) return true;
+        pos += REG_SIZE(type);
+    }
+    return false;
+}
+
+void opl_reg_update() {
+    uint32_t now = OPL_MILLIS();
+
+    for(uint8_t i = 0; i < MAX_SUBSCRIPTIONS; i++) {
+        subscription_t *sub = &subs[i];
+        if(sub->len == 0) continue;
+
+        if(request_queued(sub->buf)) {
+            reg_fill(sub); // Not sent yet, only the latest values go out
+            continue;
+        }
+
+        uint32_t elapsed = now - sub->sent_ms;
+        if(!sub->fresh && elapsed < sub->interval) continue;
+        if(sub->fresh || reg_changed(sub) ||
+           (sub->unacked && elapsed >= REG_RETRY_TIME)) {
+            reg_fill(sub);
+            if(push_request(MASTER_ADDR, sub->buf, sub->len, true)) {
+                sub->sent_ms = now;
+                sub->fresh = false;
+                sub->unacked = true;
+            }
+        }
+    }
+}
+/******************************************************************************/
+#endif /* SLAVE */
+
+#ifdef MASTER
+/* Master type cache **********************************************************/
+#define REG_REQUEST_LEN (3 + MAX_REGISTERS)
+
+static struct {
+    opl_handle_t handle; // Slave the types belong to, reset when it changes
+    uint8_t types[MAX_REGISTERS]; // 0 until described
+} reg_cache[MAX_SLAVES];
+
+/* The request queue keeps pointers, a buffer is reused only after MAX_REQUESTS
+ * other requests were pushed, when it was already sent */
+static uint8_t reg_requests[MAX_REQUESTS][REG_REQUEST_LEN];
+static uint8_t next_request = 0;
+
+static opl_reg_callback_t reg_callback = NULL;
+
+void opl_reg_set_callback(opl_reg_callback_t callback) {
+    reg_callback = callback;
+}
+
+/* Cached types of the slave, NULL if the handle is stale */
+static uint8_t *reg_types(opl_handle_t handle) {
+    uint8_t addr = map_handle_to_addr(handle);
+    if(addr == 0) return NULL;
+
+    uint8_t index = ADDR_TO_SLOT(addr);
+    if(reg_cache[index].handle != handle) {
+        reg_cache[index].handle = handle;
+        memset(reg_cache[index].types, 0, MAX_REGISTERS);
+    }
+    return reg_cache[index].types;
+}
+
+static bool reg_push(opl_handle_t handle, uint8_t len) {
+    if(!opl_push_request_handle(handle, reg_requests[next_request], len))
+        return false;
+    next_request = (next_request + 1) % MAX_REQUESTS;
+    return true;
+}
+
+static bool reg_push_range(opl_handle_t handle, uint8_t op, uint8_t start,
+                           uint8_t count) {
+    uint8_t *buf = reg_requests[next_request];
+    buf[0] = op;
+    buf[1] = start;
+    buf[2] = count;
+    return reg_push(handle, 3);
+}
+
+bool opl_reg_describe(opl_handle_t handle, uint8_t start, uint8_t count) {
+    if(count == 0 || start + count > MAX_REGISTERS) return false;
+    return reg_push_range(handle, REG_DESCRIBE, start, count);
+}
+
+/* Describe the registers without a cached type before reading them */
+static bool reg_check_types(opl_handle_t handle, uint8_t *regs, uint8_t start,
+                            uint8_t count) {
+    uint8_t *types = reg_types(handle);
+    if(types == NULL) return false;
+
+    uint8_t lo = 0xFF, hi = 0;
+    for(uint8_t i = 0; i < count; i++) {
+        uint8_t reg = (regs != NULL) ? regs[i] : start + i;
+        if(reg >= MAX_REGISTERS) return false;
+        if(types[reg] == 0) {
+            if(reg < lo) lo = reg;
+            if(reg > hi) hi = reg;
+        }
+    }
+    return lo == 0xFF || opl_reg_describe(handle, lo, hi - lo + 1);
+}
+
+bool opl_reg_read(opl_handle_t handle, uint8_t start, uint8_t count) {
+    if(count == 0 || !reg_check_types(handle, NULL, start, count)) return false;
+    return reg_push_range(handle, REG_READ, start, count);
+}
+
+bool opl_reg_read_list(opl_handle_t handle, uint8_t *regs, uint8_t count) {
+    if(count == 0 || 2 + count > REG_REQUEST_LEN) return false;
+    if(!reg_check_types(handle, regs, 0, count)) return false;
+
+    uint8_t *buf = reg_requests[next_request];
+    buf[0] = REG_MULTI_READ;
+    buf[1] = count;
+    memcpy(buf + 2, regs, count);
+    return reg_push(handle, 2 + count);
+}
+
+bool opl_reg_write(opl_handle_t handle, uint8_t start, uint8_t count,
+                   int32_t *values) {
+    uint8_t *types = reg_types(handle);
+    uint8_t *buf = reg_requests[next_request];
+    uint8_t len = 3;
+
+    if(types == NULL || count == 0 || start + count > MAX_REGISTERS)
+        return false;
+
+    for(uint8_t i = 0; i < count; i++) {
+        uint8_t size = REG_SIZE(types[start + i]);
+        if(size == 0 || len + size > REG_REQUEST_LEN) return false;
+        reg_put(buf + len, size, (uint32_t)values[i]);
+        len += size;
+    }
+
+    buf[0] = REG_WRITE;
+    buf[1] = start;
+    buf[2] = count;
+    return reg_push(handle, len);
+}
+
+bool opl_reg_subscribe(opl_handle_t handle, uint8_t start, uint8_t count,
+                       uint16_t deadband, uint16_t interval) {
+    if(count > 0 && !reg_check_types(handle, NULL, start, count)) return false;
+
+    uint8_t *buf = reg_requests[next_request];
+    buf[0] = REG_SUBSCRIBE;
+    buf[1] = start;
+    buf[2] = count;
+    reg_put(buf + 3, 2, deadband);
+    reg_put(buf + 5, 2, interval);
+    return reg_push(handle, 7);
+}
+
+static int32_t reg_value(uint8_t *buf, uint8_t type) {
+    return reg_signed(reg_get(buf, REG_SIZE(type)), type);
+}
+
+static void reg_report(opl_handle_t handle, uint8_t reg, uint8_t status,
+                       int32_t value) {
+    if(reg_callback != NULL) reg_callback(handle, reg, status, value);
+}
+
+bool opl_reg_parse_reply(uint8_t *buf, uint8_t len) {
+    if(len < 3 || buf[0] < REG_DESCRIBE || buf[0] > REG_PUBLISH)
+        return false;
+
+    if(buf[0] == REG_PUBLISH) {
+        uint8_t ack[REG_HEADER_LEN] = {0};
+        memcpy(ack, buf, (len < REG_HEADER_LEN) ? len : REG_HEADER_LEN);
+        opl_send_reply(ack, REG_HEADER_LEN);
+    }
+
+    opl_handle_t handle = map_addr_to_handle(get_frame_src());
+    uint8_t *types = reg_types(handle);
+    if(types == NULL) return true; // The slave left meanwhile
+
+    uint8_t op = buf[0], status = buf[1];
+    uint8_t start = buf[2], count = (len > 3) ? buf[3] : 0;
+    uint8_t *regs = NULL;
+    uint8_t pos = REG_HEADER_LEN;
+
+    if(op == REG_MULTI_READ) {
+        count = buf[2];
+        regs = buf + 3;
+        pos = 3 + count;
+    }
+
+    if(status != REG_OK || pos > len) {
+        reg_report(handle, start, (status != REG_OK) ? status : REG_BAD_LEN, 0);
+        return true;
+    }
+
+    for(uint8_t i = 0; i < count; i++) {
+        uint8_t reg = (regs != NULL) ? regs[i] : start + i;
+        if(reg >= MAX_REGISTERS) break;
+
+        if(op == REG_DESCRIBE) {
+            if(pos >= len) break;
+            types[reg] = buf[pos++];
+        }
+        else if(op == REG_WRITE || op == REG_SUBSCRIBE) {
+            reg_report(handle, reg, REG_OK, 0);
+        }
+        else if(types[reg] == 0 || pos + REG_SIZE(types[reg]) > len) {
+            reg_report(handle, reg, REG_NO_TYPE, 0);
+            if(op == REG_PUBLISH) opl_reg_describe(handle, start, count);
+            break; // The rest of the values can't be located
+        }
+        else {
+            reg_report(handle, reg, REG_OK, reg_value(buf + pos, types[reg]));
+            pos += REG_SIZE(types[reg]);
+        }
+    }
+
+    return true;
+}
+/******************************************************************************/
+#endif /* MASTER */
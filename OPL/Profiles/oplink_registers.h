@@ -0,0 +1,155 @@
+/*
+ * Filename:    oplink_registers.h
+ * Project:     OpenPAYGO Link
+ * Author:      Daniel Nedosseikine
+ * Company:     Solaris Offgrid
+ * Created on:  19/10/2026
+ * Description: Optional register map profile on top of the DATA frames.
+ */
+
+#ifndef OPLINK_REGISTERS_H
+#define OPLINK_REGISTERS_H 1
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "oplink_common.h"
+#include "oplink_com.h"
+#ifdef MASTER
+#include "slave_list.h"
+#endif /* MASTER */
+
+/*
+ * The slave exposes a table of typed registers, numbered from 0. The master
+ * reads and writes ranges of them, or a list of them, with a single request.
+ * Requests and replies are DATA frames starting with one of the REG_* opcodes,
+ * so these first bytes can't be used by the application payloads.
+ *
+ * Request                              Reply
+ * REG_DESCRIBE start count             REG_DESCRIBE status start count types
+ * REG_READ start count                 REG_READ status start count values
+ * REG_WRITE start count values         REG_WRITE status start count
+ * REG_MULTI_READ count regs            REG_MULTI_READ status count regs values
+ * REG_SUBSCRIBE start count            REG_SUBSCRIBE status start count
+ *               deadband interval
+ *
+ * A subscription makes the slave push REG_PUBLISH status start count values
+ * requests when a register of the range changed by more than the deadband, at
+ * most once per interval (ms). The master answers them with the 4 byte header.
+ * A REG_SUBSCRIBE with a count of 0 removes all the subscriptions.
+ *
+ * Values are sent in network (big) endianness with the size of their type.
+ */
+
+#ifndef MAX_REGISTERS // Can be overridden in oplink_adapters.h
+#define MAX_REGISTERS 16
+#endif
+
+#define REG_MAX_LEN (4 + 5 * MAX_REGISTERS) // Longest reply, REG_MULTI_READ
+
+#if REG_MAX_LEN > OPL_PAYLOAD_MAX_LEN
+#error "MAX_REGISTERS is too big"
+#endif
+
+#ifndef MAX_SUBSCRIPTIONS // Can be overridden in oplink_adapters.h
+#define MAX_SUBSCRIPTIONS 4
+#endif
+
+#define REG_PUBLISH_LEN (4 + MAX_REGISTERS) // Up to MAX_REGISTERS value bytes
+
+/* Register types, the low nibble is the size in bytes */
+#define REG_U8    0x01
+#define REG_U16   0x02
+#define REG_U32   0x04
+#define REG_I8    0x11
+#define REG_I16   0x12
+#define REG_I32   0x14
+#define REG_RO    0x80 // Read only flag
+#define REG_SIGNED 0x10 // Signed types flag
+#define REG_SIZE(_type) ((_type) & 0x0F)
+
+enum reg_ops {
+    REG_DESCRIBE   = 0xF0,
+    REG_READ       = 0xF1,
+    REG_WRITE      = 0xF2,
+    REG_MULTI_READ = 0xF3,
+    REG_SUBSCRIBE  = 0xF4,
+    REG_PUBLISH    = 0xF5
+};
+
+enum reg_status {
+    REG_OK         = 0,
+    REG_BAD_REG    = 1, // Register out of the table
+    REG_READ_ONLY  = 2,
+    REG_BAD_LEN    = 3,
+    REG_NO_TYPE    = 4, // Master side, the register was never described
+    REG_NO_ROOM    = 5  // No free subscription
+};
+
+#ifdef SLAVE
+typedef struct {
+    void *ptr;
+    uint8_t type;
+} opl_register_t;
+
+/* Called after the master wrote a register */
+typedef void (*opl_reg_write_callback_t)(uint8_t reg);
+
+/* Expose the table of count registers, the callback can be NULL */
+void opl_reg_init(const opl_register_t *table, uint8_t count,
+                  opl_reg_write_callback_t callback);
+
+/* Answer a register request read with opl_read(). Returns false if buf is not
+ * a register request, so the application can process it. */
+bool opl_reg_process(uint8_t *buf, uint8_t len);
+
+/* Publish the subscribed registers that changed, call it in the main loop. A
+ * publication still in the request queue is updated with the latest values
+ * instead of pushing a new one. */
+void opl_reg_update();
+#endif /* SLAVE */
+
+#ifdef MASTER
+/* Called for every register of a reply or a publication, value is only valid
+ * with REG_OK. The registers of REG_WRITE and REG_SUBSCRIBE replies are
+ * reported with the value 0. */
+typedef void (*opl_reg_callback_t)(opl_handle_t handle, uint8_t reg,
+                                   uint8_t status, int32_t value);
+
+void opl_reg_set_callback(opl_reg_callback_t callback);
+
+/* Ask the types of a range of registers, they are cached per slave. Reads of
+ * registers without a cached type send a REG_DESCRIBE first. */
+bool opl_reg_describe(opl_handle_t handle, uint8_t start, uint8_t count);
+
+/* Read a range of registers with one request */
+bool opl_reg_read(opl_handle_t handle, uint8_t start, uint8_t count);
+
+/* Read a list of registers with one request */
+bool opl_reg_read_list(opl_handle_t handle, uint8_t *regs, uint8_t count);
+
+/* Write a range of registers with one request. Their types must be cached,
+ * otherwise it returns false. */
+bool opl_reg_write(opl_handle_t handle, uint8_t start, uint8_t count,
+                   int32_t *values);
+
+/* Subscribe to a range of registers: the slave publishes them when one changes
+ * by more than deadband, at most every interval ms. Registers without a cached
+ * type are described first. A count of 0 removes all the subscriptions. */
+bool opl_reg_subscribe(opl_handle_t handle, uint8_t start, uint8_t count,
+                       uint16_t deadband, uint16_t interval);
+
+/* Process a reply or a publication read with opl_read(), publications are
+ * acknowledged. Returns false if buf is not a register reply, so the
+ * application can process it. */
+bool opl_reg_parse_reply(uint8_t *buf, uint8_t len);
+#endif /* MASTER */
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* OPLINK_REGISTERS_H */
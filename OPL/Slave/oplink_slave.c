@@ -16,10 +16,17 @@
 #include "oplink_com_private.h"
 #include "oplink_slave.h"
 
-#define PLUG_IN_MAX_COUNT 20 // 20 * 50 = 1000ms
-#define DISCONNECT_MAX_COUNT 10 // 10 * 50 = 500ms
-#define NO_CONFIG_MAX_COUNT 40 // 40 * 50 = 2000ms
-#define NO_PING_MAX_COUNT 1200 // 1200 * 50 = 60000ms = 60 seconds
+#define PLUG_IN_TIME 1000 // ms
+#define REJOIN_PLUG_IN_TIME 200 // ms, with a session to rejoin
+#define DISCONNECT_TIME 500 // ms
+#define NO_CONFIG_TIME 2000 // ms
+#define SIGNAL_RETRY_TIME 300 // ms without FIND, then a random wait
+#define DISCOVERY_HOLD_TIME 1000 // ms without SIGNAL after DISCOVER
+
+/* All the slave timers are deadlines in OPL_MILLIS() time, so they don't need
+ * opl_keep_alive() to run periodically and the MCU can sleep in between, see
+ * opl_next_deadline(). */
+#define DEADLINE_PASSED(_d) ((int32_t)(OPL_MILLIS() - (_d)) >= 0)
 
 typedef enum {
     Disconnected,
@@ -27,25 +34,38 @@ typedef enum {
     Signal_sent,
     Addr_set,
     UID_sent,
+    Rejoin_sent,
     Connected
 } bus_state_t;
 
 typedef struct {
     uint8_t nonce_buffer[5]; // 1 byte for the version + 4 bytes for a uint32_t
     bus_state_t bus_state;
-    bool received_ping;
     uint8_t mode;
     uint8_t uid[UID_SIZE + 1];
+    uint8_t session_addr; // Address to rejoin with after a disconnection
+    uint8_t token[TOKEN_SIZE]; // Issued by the master with FIND
 } opl_slave_t;
 
-opl_slave_t opl_slave = {{0}, Disconnected, false, 0, {0}};
+opl_slave_t opl_slave = {{0}, Disconnected, 0, {0}, 0, {0}};
+
+#ifdef OPL_AUTH
+static auth_session_t session; // Derived with every token
+#endif /* OPL_AUTH */
 
 static struct {
-    uint8_t plug_in;
-    uint8_t disconnect;
-    uint8_t no_config;
-    uint16_t no_ping;
-} counter;
+    bool pin_armed;
+    bool config_armed;
+    uint32_t pin; // Plug in or disconnection, depending on the bus state
+    uint16_t plug_in_early; // ms taken off the next plug in, see check_handshake
+    uint32_t no_config;
+    uint32_t signal_retry;
+    uint32_t discovery; // Don't signal while the master runs a discovery
+    uint32_t no_ping;
+} deadline;
+
+static uint32_t no_ping_time = NO_PING_TIME; // Set by the master
+static uint32_t last_loop = 0;
 
 static bool opl_bus_locked = false;
 
@@ -57,6 +77,10 @@ static uint8_t load_config() {
     if(seed == 0) return LOAD_SEED_ERROR;
     srand(seed);
 
+    // Next boot starts from another seed, the nonces must not repeat
+    if(++seed == 0) seed = 1;
+    OPL_SAVE_SEED(seed);
+
     memset(opl_slave.uid, 0, UID_SIZE + 1);
     if(opl_slave.mode < HAS_UID) return LOAD_SUCCESS; // No UID
 
@@ -69,11 +93,16 @@ static uint8_t load_config() {
 static void slave_set_default() {
     OPL_UART_DISABLE_RX();
     opl_node_set_addr(0x00); // Don't change with RX enabled
+    opl_node_set_groups(0);
 
-    *(uint32_t *)(opl_slave.nonce_buffer + 1) = (uint32_t)opl_hton32(rand());
+    // rand() may only give 15 bits, mix two draws for the 4 bytes
+    uint32_t nonce = opl_hton32(((uint32_t)rand() << 16) ^ (uint32_t)rand());
+    memcpy(opl_slave.nonce_buffer + 1, &nonce, TOKEN_SIZE); // Unaligned
     opl_slave.bus_state = Disconnected;
-    opl_slave.received_ping = false;
-    memset(&counter, 0, sizeof(counter));
+    memset(&deadline, 0, sizeof(deadline));
+    deadline.discovery = OPL_MILLIS();
+    no_ping_time = NO_PING_TIME;
+    set_request_budget(REQUEST_RATE, REQUEST_BURST);
 
     // Set UART to 9-N-1 mode @ 19200 baud with addr 0x00
     OPL_UART_INIT(DEFAULT_ADDR, uart_rx_callback); // This enables RX & TX
@@ -81,102 +110,260 @@ static void slave_set_default() {
     OPL_DELAY(1);
 }
 
+/* A slave unplugged while connected keeps its session, the master still has it
+ * in the list for a while. It rejoins with a single REJOIN on plug in. */
 static void check_bus_connection() {
-    if(OPL_READ_RX_PIN()) {
-        counter.disconnect = 0;
-        if(opl_slave.bus_state == Disconnected) {
-            if(++counter.plug_in == PLUG_IN_MAX_COUNT){
-                counter.plug_in = 0;
-                opl_slave.bus_state = Plugged_in;
-            }
-        }
+    // Plug in is timed while the pin is high, disconnection while it is low
+    bool timed = (opl_slave.bus_state == Disconnected) == !!OPL_READ_RX_PIN();
+
+    if(!timed) {
+        deadline.pin_armed = false;
     }
-    else{
-        counter.plug_in = 0;
+    else if(!deadline.pin_armed) {
+        deadline.pin_armed = true;
         if(opl_slave.bus_state != Disconnected) {
-            if(++counter.disconnect == DISCONNECT_MAX_COUNT) {
-                counter.disconnect = 0;
-                slave_set_default();
-            }
+            deadline.pin = OPL_MILLIS() + DISCONNECT_TIME;
+        }
+        else {
+            uint16_t plug_in_time = opl_slave.session_addr ?
+                                    REJOIN_PLUG_IN_TIME : PLUG_IN_TIME;
+            deadline.pin = OPL_MILLIS() + plug_in_time - deadline.plug_in_early;
+            deadline.plug_in_early = 0;
+        }
+    }
+    else if(DEADLINE_PASSED(deadline.pin)) {
+        deadline.pin_armed = false;
+        if(opl_slave.bus_state == Disconnected) {
+            opl_slave.bus_state = Plugged_in;
+        }
+        else {
+            if(opl_slave.bus_state != Connected)
+                opl_slave.session_addr = 0;
+            slave_set_default();
         }
     }
 }
 
+static void signal_sent(bus_state_t state) {
+    opl_slave.bus_state = state;
+    deadline.signal_retry = OPL_MILLIS() + SIGNAL_RETRY_TIME;
+    if(!deadline.config_armed) { // The timeout covers the retries
+        deadline.config_armed = true;
+        deadline.no_config = OPL_MILLIS() + NO_CONFIG_TIME;
+    }
+}
+
+/* REJOIN(1B), TOKEN(4B), sent from the address of the session */
+static void rejoin_bus() {
+    if(safe_to_send()) {
+        OPL_UART_DISABLE_RX();
+        opl_node_set_addr(opl_slave.session_addr); // Don't change with RX on
+        OPL_UART_ENABLE_RX();
+        if(opl_send_cmd(MASTER_ADDR, REJOIN, opl_slave.token, TOKEN_SIZE,
+           false, false))
+            signal_sent(Rejoin_sent);
+    }
+}
+
 static void join_bus() {
-    if(safe_to_send())
+    if(opl_slave.session_addr) rejoin_bus();
+    else if(DEADLINE_PASSED(deadline.discovery) && safe_to_send())
         if(opl_send_cmd(MASTER_ADDR, SIGNAL, opl_slave.nonce_buffer, 5,
            false, false))
-            opl_slave.bus_state = Signal_sent;
+            signal_sent(Signal_sent);
 }
 
+/* The handshake restarts after NO_CONFIG_TIME without progress. A SIGNAL
+ * without FIND probably collided with another one, so it is sent again with
+ * the same nonce after the random bus wait, the master ignores duplicates. */
 static void check_handshake() {
-    if(++counter.no_config == NO_CONFIG_MAX_COUNT) {
+    if(DEADLINE_PASSED(deadline.no_config)) {
+        opl_slave.session_addr = 0; // The master didn't answer the REJOIN
         slave_set_default();
+        // Don't signal again in step with the slaves that failed with us
+        deadline.plug_in_early = (uint16_t)(rand() % (PLUG_IN_TIME / 2));
+    }
+    else if((opl_slave.bus_state == Signal_sent ||
+             opl_slave.bus_state == Rejoin_sent) &&
+            DEADLINE_PASSED(deadline.signal_retry)) {
+        opl_slave.bus_state = Plugged_in;
     }
 }
 
 static void check_ping() {
-    if(opl_slave.received_ping) {
-        opl_slave.received_ping = false;
-        counter.no_ping = 0;
-    }
-    else if(++counter.no_ping == NO_PING_MAX_COUNT) {
+    if(DEADLINE_PASSED(deadline.no_ping)) {
+        opl_slave.session_addr = 0; // The master dropped us
         slave_set_default();
     }
 }
 
+/* Restart the handshake timeout, the master moved it one step forward */
+static void handshake_step(bus_state_t state) {
+    opl_slave.bus_state = state;
+    deadline.no_config = OPL_MILLIS() + NO_CONFIG_TIME;
+}
+
 void opl_init(){
     if(load_config() != LOAD_SUCCESS)
         while(1) { /* Not configured */ }
 
     OPL_LIN_INIT(); // Configure write enable pin
+    #ifdef OPL_AUTH
+    auth_init();
+    #endif /* OPL_AUTH */
+    #ifdef OPL_FEC
+    fec_init();
+    #endif /* OPL_FEC */
     opl_slave.nonce_buffer[0] = HSK_VER;
     request_queue_init();
     slave_set_default();
     OPL_LIN_DISABLE_TX();
 }
 
+/* Discovery key: the UID, or the nonce if the slave has no UID */
+static bool key_matches(uint8_t *prefix, uint8_t bits) {
+    uint8_t key[UID_SIZE] = {0};
+    uint8_t i;
+
+    if(opl_slave.mode < HAS_UID) memcpy(key, opl_slave.nonce_buffer + 1, 4);
+    else memcpy(key, opl_slave.uid, UID_SIZE);
+
+    for(i = 0; i < bits / 8; i++)
+        if(key[i] != prefix[i]) return false;
+
+    uint8_t mask = (uint8_t)(0xFF00 >> (bits % 8));
+    return (bits % 8 == 0) || ((key[i] ^ prefix[i]) & mask) == 0;
+}
+
 /* Route the OPLink internal commands */
 void route_command(uint8_t *buf, uint8_t len) {
     switch(buf[0]) { // Cmd byte
-        case FIND: // FIND(1B), NONCE(4B), ADDR(1B)
+        case FIND: // FIND(1B), NONCE(4B), ADDR(1B), TOKEN(4B, optional)
             if(opl_slave.bus_state == Signal_sent) {
                 // Check if the nonce matches
                 if(memcmp((opl_slave.nonce_buffer + 1), (buf + 1), 4) == 0){
+                    opl_slave.session_addr = buf[5];
+                    if(len >= 6 + TOKEN_SIZE)
+                        memcpy(opl_slave.token, buf + 6, TOKEN_SIZE);
+                    else // The nonce is the token
+                        memcpy(opl_slave.token, buf + 1, TOKEN_SIZE);
                     // Send reply before changing the address
                     opl_send_cmd(MASTER_ADDR, ACK, NULL, 0, false, true);
                     OPL_UART_DISABLE_RX();
                     opl_node_set_addr(buf[5]); // Don't change with RX enabled
+                    #ifdef OPL_AUTH
+                    // After the ACK, GET_UID is the first frame keyed with it
+                    auth_new_session(&session, opl_slave.nonce_buffer + 1,
+                                     opl_slave.token);
+                    #endif /* OPL_AUTH */
                     OPL_UART_ENABLE_RX();
-                    opl_slave.bus_state = Addr_set;
+                    handshake_step(Addr_set);
                 }
             }
             break;
         case GET_UID:
             if(opl_slave.bus_state == Addr_set)
-                opl_slave.bus_state = UID_sent;
+                handshake_step(UID_sent);
             opl_send_cmd(MASTER_ADDR, ACK, opl_slave.uid,
                          strlen(opl_slave.uid), false, true);
             break;
-        case PING:
+        case PING: // PING(1B), WINDOW(1B), RATE(1B), BURST(1B), GROUPS(1B)
+                   // BROADCAST COUNTER(4B) with OPL_AUTH
+            if(len > 1) {
+                no_ping_time = (uint32_t)buf[1] * 1000;
+                deadline.no_ping = OPL_MILLIS() + no_ping_time;
+            }
+            if(len > 3)
+                set_request_budget(buf[2], buf[3]);
+            if(len > 4)
+                opl_node_set_groups(buf[4]);
+            #ifdef OPL_AUTH
+            if(len > PING_ARGS)
+                auth_sync_broadcasts(((uint32_t)buf[5] << 24) |
+                                     ((uint32_t)buf[6] << 16) |
+                                     ((uint16_t)buf[7] << 8) | buf[8]);
+            #endif /* OPL_AUTH */
             if(opl_slave.bus_state == UID_sent)
                 opl_slave.bus_state = Connected;
             opl_send_cmd(MASTER_ADDR, ACK, NULL, 0, false, true);
-            opl_slave.received_ping = true;
             break;
-
+        case DISCOVER: // DISCOVER(1B), DEPTH(1B), PREFIX(DEPTH bits)
+            deadline.discovery = OPL_MILLIS() + DISCOVERY_HOLD_TIME;
+            // The master queries again only if our SIGNAL was lost
+            if(opl_slave.bus_state == Signal_sent)
+                opl_slave.bus_state = Plugged_in;
+            if(opl_slave.bus_state == Plugged_in && !opl_slave.session_addr &&
+               len >= 2 &&
+               buf[1] <= UID_SIZE * 8 && len >= 2 + (buf[1] + 7) / 8 &&
+               key_matches(buf + 2, buf[1])) {
+                opl_send_cmd(MASTER_ADDR, SIGNAL, opl_slave.nonce_buffer, 5,
+                             false, true);
+                deadline.config_armed = false; // A new timeout for this one
+                signal_sent(Signal_sent);
+            }
+            break;
+        case RESUME: // RESUME(1B), TOKEN(4B), NEW TOKEN(4B) with OPL_AUTH
+            if(len == RESUME_ARGS + 1 && opl_slave.bus_state >= UID_sent &&
+               memcmp(opl_slave.token, (buf + 1), TOKEN_SIZE) == 0){
+                #ifdef OPL_AUTH
+                // The master restarted its counters, the key derived from
+                // the old and the new token makes the old frames useless
+                memcpy(opl_slave.token, buf + 1 + TOKEN_SIZE, TOKEN_SIZE);
+                auth_new_session(&session, buf + 1, opl_slave.token);
+                #endif /* OPL_AUTH */
+                opl_slave.bus_state = Connected;
+                opl_send_cmd(MASTER_ADDR, ACK, NULL, 0, false, true);
+            }
+            else { // Unknown session, join again
+                opl_send_cmd(MASTER_ADDR, NACK, NULL, 0, false, true);
+                opl_slave.session_addr = 0;
+                slave_set_default();
+            }
+            break;
+        case ACK: // Reply to REJOIN
+            if(opl_slave.bus_state == Rejoin_sent)
+                opl_slave.bus_state = Connected;
+            break;
+        case NACK: // The master doesn't know the session anymore
+            if(opl_slave.bus_state == Rejoin_sent) {
+                opl_slave.session_addr = 0;
+                slave_set_default();
+                opl_slave.bus_state = Plugged_in; // Still plugged in
+            }
+            break;
     }
 }
 
+/* Called from opl_read() for every frame with a valid CRC. Only a frame from
+ * the master to our own address postpones the no ping deadline: broadcasts,
+ * multicasts and discovery reach the slaves the master dropped too, and those
+ * must time out and give their address back. */
+void link_activity(uint8_t src, uint8_t dest) {
+    if(src == MASTER_ADDR && opl_slave.session_addr != DEFAULT_ADDR &&
+       dest == opl_slave.session_addr)
+        deadline.no_ping = OPL_MILLIS() + no_ping_time;
+}
+
+#ifdef OPL_AUTH
+/* Called from the COM layer for every frame sent or received, also from the
+ * UART ISR. The session is the one of the address given by the master. */
+auth_session_t *get_session(uint8_t node) {
+    if(node == DEFAULT_ADDR || node != opl_slave.session_addr) return NULL;
+    return &session;
+}
+#endif /* OPL_AUTH */
+
 bool opl_push_request(uint8_t *data, uint8_t len) {
     return push_request(MASTER_ADDR, data, len, true);
 }
 
-void opl_keep_alive() {
-    static uint32_t old_millis = 0;
+bool opl_stage_reply(uint8_t key, uint8_t *buf, uint8_t len) {
+    return stage_reply(key, buf, len);
+}
 
-    if(OPL_MILLIS() - old_millis > LOOP_TIME) {
-        old_millis = OPL_MILLIS();
+void opl_keep_alive() {
+    if(OPL_MILLIS() - last_loop > LOOP_TIME) {
+        last_loop = OPL_MILLIS();
 
         check_bus_connection();
         update_node_state();
@@ -190,6 +377,8 @@ void opl_keep_alive() {
             case Addr_set:
                 // fallthrough
             case UID_sent:
+                // fallthrough
+            case Rejoin_sent:
                 check_handshake();
                 break;
             case Connected:
@@ -201,3 +390,51 @@ void opl_keep_alive() {
             dispatch_request();
     }
 }
+
+static uint32_t time_to(uint32_t target) {
+    int32_t ms = (int32_t)(target - OPL_MILLIS());
+    return ms > 0 ? (uint32_t)ms : 0;
+}
+
+uint32_t opl_next_deadline() {
+    uint32_t ms = OPL_NO_DEADLINE;
+
+    // Frames, replies, bus waits and requests are still timed in loops
+    if(!com_idle() || opl_slave.bus_state == Plugged_in)
+        ms = LOOP_TIME;
+
+    if(deadline.pin_armed && time_to(deadline.pin) < ms)
+        ms = time_to(deadline.pin);
+
+    switch(opl_slave.bus_state) {
+        case Signal_sent:
+            // fallthrough
+        case Rejoin_sent:
+            if(time_to(deadline.signal_retry) < ms)
+                ms = time_to(deadline.signal_retry);
+            // fallthrough
+        case Addr_set:
+            // fallthrough
+        case UID_sent:
+            if(time_to(deadline.no_config) < ms)
+                ms = time_to(deadline.no_config);
+            break;
+        case Connected:
+            if(time_to(deadline.no_ping) < ms)
+                ms = time_to(deadline.no_ping);
+            break;
+        default:
+            break;
+    }
+
+    // opl_keep_alive() runs at most once per LOOP_TIME
+    uint32_t next_loop = time_to(last_loop + LOOP_TIME + 1);
+    return ms > next_loop ? ms : next_loop;
+}
+
+#ifdef OPL_ENTER_LOW_POWER
+void opl_sleep() {
+    uint32_t ms = opl_next_deadline();
+    if(ms > 0) OPL_ENTER_LOW_POWER(ms);
+}
+#endif /* OPL_ENTER_LOW_POWER */
@@ -36,6 +36,28 @@ void opl_keep_alive();
  * soon as the device is idle and the bus is free. */
 bool opl_push_request(uint8_t *data, uint8_t len);
 
+/* Stage a reply for the requests whose first data byte is "key". They are
+ * answered with buf straight from the UART RX interrupt, without going through
+ * opl_parse(), so the reply doesn't wait for the main loop. buf is kept as a
+ * pointer: update it with interrupts disabled or stage a new buffer. A len of 0
+ * removes the staged reply. Returns false if there is no free slot or len is
+ * over STAGED_MAX_LEN. The interrupt sends the whole frame: 8 bytes, 4.6 ms at
+ * 19200 baud, for 4 bytes of payload, and 6 bytes more with OPL_AUTH. A timer
+ * behind OPL_MILLIS() that can't preempt the UART loses those ticks. */
+bool opl_stage_reply(uint8_t key, uint8_t *buf, uint8_t len);
+
+#define OPL_NO_DEADLINE 0xFFFFFFFF
+
+/* Returns the ms until opl_keep_alive() has something to do. Until then the MCU
+ * can sleep, as long as the UART and a change of the RX pin wake it up. Returns
+ * OPL_NO_DEADLINE if the slave is only waiting for the bus. */
+uint32_t opl_next_deadline();
+
+#ifdef OPL_ENTER_LOW_POWER
+/* Enter the low power mode of the adapters until the next deadline */
+void opl_sleep();
+#endif /* OPL_ENTER_LOW_POWER */
+
 #ifdef __cplusplus
 }
 #endif
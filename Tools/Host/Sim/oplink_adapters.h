@@ -0,0 +1,122 @@
+/*
+ * Filename:    oplink_adapters.h
+ * Project:     OpenPAYGO Link
+ * Author:      Daniel Nedosseikine
+ * Company:     Solaris Offgrid
+ * Created on:  19/10/2026
+ * Description: Adapter layer of the simulated nodes, see sim_uart.h.
+ */
+
+#ifndef OPL_ADAPTERS_H
+#define OPL_ADAPTERS_H 1
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include "oplink_common.h"
+#include "sim_uart.h"
+
+/* Endianness *****************************************************************/
+#ifndef LITTLE_ENDIAN
+#define LITTLE_ENDIAN
+#endif
+/******************************************************************************/
+
+/* Interrupts *****************************************************************/
+/* The host delivers the bytes between two application loops */
+#define OPL_ENABLE_INTERRUPTS()
+#define OPL_DISABLE_INTERRUPTS()
+/******************************************************************************/
+
+/* Delay **********************************************************************/
+#define OPL_DELAY(_ms)
+/******************************************************************************/
+
+/* Timer **********************************************************************/
+#define OPL_MILLIS()                        sim_millis()
+/******************************************************************************/
+
+/* LIN ************************************************************************/
+#define OPL_LIN_INIT()
+#define OPL_LIN_ENABLE_TX()
+#define OPL_LIN_DISABLE_TX()
+/******************************************************************************/
+
+/* UART ***********************************************************************/
+#define UART_ENABLE_RX()   sim_rx_enable(true)
+#define UART_DISABLE_RX()  sim_rx_enable(false)
+
+#define OPL_UART_INIT(_addr, _callback)     uart_init(_addr, _callback)
+#define OPL_UART_IS_ADDR()                  uart_is_addr()
+#define OPL_UART_IS_BUSY()                  uart_is_busy()
+#define OPL_UART_CLEAR_BUSY()               uart_clear_busy_flag()
+#define OPL_UART_SET_ADDR(_addr)            uart_set_addr(_addr)
+#define OPL_UART_MUTE()                     uart_mute()
+#define OPL_UART_FLUSH_RX()                 uart_flush_rx_buffer()
+#define OPL_UART_READ_BYTE()                uart_read_byte()
+#define OPL_UART_WRITE_BYTE(_byte)          uart_write(_byte)
+#define OPL_UART_WRITE_ADDR(_addr)          uart_write_addr(_addr)
+#define OPL_UART_WRITE_BREAK()              uart_write_break()
+#define OPL_UART_ENABLE_RX()                UART_ENABLE_RX()
+#define OPL_UART_DISABLE_RX()               UART_DISABLE_RX()
+#define OPL_READ_RX_PIN()                   sim_rx_pin()
+/******************************************************************************/
+
+/* Storage ********************************************************************/
+/* Test vector key of Speck32/64, the same on every node */
+#define OPL_LOAD_KEY(_key_ptr) \
+    memcpy(_key_ptr, "\x19\x18\x11\x10\x09\x08\x01\x00", KEY_SIZE)
+
+#ifdef SLAVE
+
+#define OPL_LOAD_MODE() \
+    (sim_node.scenario->no_uid ? NO_UID : HAS_UID)
+#define OPL_LOAD_SEED() sim_node.seed
+#define OPL_SAVE_SEED(_seed) (sim_node.seed = (_seed))
+#define OPL_LOAD_UID(_uid_ptr) memcpy(_uid_ptr, sim_node.uid, UID_SIZE)
+
+#endif /* SLAVE */
+
+#ifdef MASTER
+#ifdef SIM_PERSIST
+
+/* The store of the master is kept by the host across its resets */
+#define OPL_SAVE_SLAVE(_index, _ptr) \
+    memcpy(sim_node.store + (_index) * SLAVE_RECORD_SIZE, _ptr, \
+           SLAVE_RECORD_SIZE)
+#define OPL_LOAD_SLAVE(_index, _ptr) \
+    memcpy(_ptr, sim_node.store + (_index) * SLAVE_RECORD_SIZE, \
+           SLAVE_RECORD_SIZE)
+
+#define OPL_SAVE_COUNTER(_counter) \
+    memcpy(sim_node.store + SIM_COUNTER_ADDR, &(uint32_t){_counter}, 4)
+#define OPL_LOAD_COUNTER() sim_load_counter()
+
+uint32_t sim_load_counter();
+
+#endif /* SIM_PERSIST */
+#endif /* MASTER */
+/******************************************************************************/
+
+/* Low power ******************************************************************/
+#ifdef SLAVE
+#ifdef SIM_SLEEP
+
+/* The node skips its loop until the time is up or a byte is received */
+#define OPL_ENTER_LOW_POWER(_ms) sim_sleep(_ms)
+
+void sim_sleep(uint32_t ms);
+
+#endif /* SIM_SLEEP */
+#endif /* SLAVE */
+/******************************************************************************/
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* OPL_ADAPTERS_H */
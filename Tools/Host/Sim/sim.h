@@ -0,0 +1,105 @@
+/*
+ * Filename:    sim.h
+ * Project:     OpenPAYGO Link
+ * Author:      Daniel Nedosseikine
+ * Company:     Solaris Offgrid
+ * Created on:  19/10/2026
+ * Description: Interface between the host of the bus simulation and its nodes.
+ *              Every node is a copy of master.so or slave.so loaded with its
+ *              own globals, the host sets its sim_node_t before opl_init().
+ */
+
+#ifndef SIM_H
+#define SIM_H 1
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#define SIM_MAX_NODES 64 // Master included
+#define SIM_UID_SIZE 12 // UID_SIZE
+#define SIM_STORE_SIZE 2048 // EEPROM of the master, see SIM_PERSIST
+#define SIM_COUNTER_ADDR 2000 // Broadcast counter in the store
+#define SIM_DICT "INFO: battery voltage V current A temperature C load on off"
+#define SIM_MAX_SAMPLES 20000 // Latencies kept by the master, see adv
+
+/* Scenario, given on the command line of the host and read by the nodes */
+typedef struct {
+    uint32_t seed;
+    double ber; // Bit error rate of every byte on the bus
+    uint32_t secs; // Simulated time
+    uint16_t period; // ms between two requests of the master, 0 for none
+    uint8_t burst; // Requests pushed every period
+    uint16_t timeout; // Deadline of the requests in ms, 0 for none
+    bool timeout_mix; // Only every other slave gets the deadline
+    uint8_t no_reply; // Every no_reply-th request gets no reply, 0 for none
+    int8_t regs; // Register poll mode with SIM_REGS, -1 for plain requests
+    uint8_t adv; // Flooding slave 1 (1), master (2) or both (3)
+    uint16_t app_ms; // Slaves only run their loop every app_ms, 0 for always
+    bool no_uid; // Slaves start without UID
+    bool zip_dict; // Shared dictionary of OPL_ZIP
+    uint8_t mcast; // Multicast (1) or broadcast (2) every second from 20 s
+    float discover; // Time of a discovery in s, 0 for none
+    float reboot; // Time of a master reset in s, 0 for none
+    uint8_t drop; // Slave disconnected from drop_at to undrop_at, 0 for none
+    float drop_at, undrop_at;
+    uint8_t replay; // Replay the same (1) or a forward counter (2) frame
+    uint8_t replay_dest, replay_len; // DATA frame of the master to replay
+    bool trace; // Print the changes of the slave list
+    bool frames; // Print the commands on the bus
+} sim_scenario_t;
+
+/* Counters of a node, kept by the host across resets */
+typedef struct {
+    long rx, bad; // Frames read and failed
+    long buffered; // Bytes in the RX FIFO
+    long mcast; // Multicast and broadcast frames of the slave's groups
+    long awake_ms, asleep_ms; // Slave, with SIM_SLEEP
+    long values, value_errors; // Master, with SIM_REGS or SIM_ZIP
+    long match_ok, match_bad, match_null; // Master, opl_reply_request()
+    long expired, down, no_reply_ok, no_reply_bad; // Master callback
+    long push_fail, mcast_sent; // Master, requests of the scenario
+    long queue_sent, queue_expired; // Master, opl_read_queue_stats()
+    uint32_t queue_max_age, queue_total_age;
+    long flood_rx, flood_tx; // Master, with adv
+    uint32_t *lat_up, *lat_down; // Master, with adv, SIM_MAX_SAMPLES each
+    int n_up, n_down;
+} sim_stats_t;
+
+/* A node, exported by the node as sim_node */
+typedef struct {
+    int id; // 0 for the master
+    uint32_t phase; // Offset of its clock in ms
+    uint8_t uid[SIM_UID_SIZE];
+    uint32_t seed;
+    uint8_t *store; // SIM_STORE_SIZE bytes
+    sim_stats_t *stats;
+    const sim_scenario_t *scenario;
+    /* Frame layout of the build, set by the node */
+    uint8_t meta_copies; // FEC_META_COPIES
+    uint8_t auth_len; // AUTH_LEN, 0 without OPL_AUTH
+    uint8_t fec_len; // FEC_LEN
+    /* Host hooks */
+    void (*write)(int id, uint8_t byte, bool is_addr);
+    uint32_t (*millis)();
+    bool (*rx_pin)(int id);
+} sim_node_t;
+
+/* Functions of every node, looked up by the host */
+typedef void (*sim_isr_t)(uint8_t byte, bool is_addr); // Byte from the bus
+typedef void (*sim_loop_t)(); // Application loop
+
+/* Functions of the master */
+typedef uint8_t (*sim_slave_count_t)(); // Slaves in the list
+typedef void (*sim_request_t)(uint8_t index); // Requests to a slave
+typedef void (*sim_multicast_t)(); // Multicast of the scenario
+typedef void (*sim_finish_t)(); // Copy the queue statistics
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* SIM_H */
@@ -0,0 +1,605 @@
+/*
+ * Filename:    sim_host.c
+ * Project:     OpenPAYGO Link
+ * Author:      Daniel Nedosseikine
+ * Company:     Solaris Offgrid
+ * Created on:  19/10/2026
+ * Description: Host of the bus simulation. Loads a master and the slaves, each
+ *              a copy of master.so or slave.so, runs their loops every 100 us
+ *              of simulated time and delivers the bytes they write to the
+ *              others. A byte takes 573 us, bytes written by several nodes in
+ *              the same step collide and the bit errors follow the BER. The
+ *              scenario is given on the command line, see usage().
+ */
+
+#define _GNU_SOURCE
+#include <dlfcn.h>
+#include <getopt.h>
+#include <libgen.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "sim.h"
+#include "crc16.h"
+
+#define STEP_US 100
+#define BYTE_US 573 // 11 bits at 19200 baud
+#define MAX_PENDING 4096 // Bytes written in a step
+#define MAX_FRAME 160
+#define MAX_CMD 32
+#define EXT_ADDR_NIBBLE 0x0E
+#define MICRO_CMD 0xC0 // CMD and MICRO_FLAG bits of the meta byte
+#define REPLAY_START_US 30000000ULL
+#define REPLAY_PERIOD_US 2000000ULL
+#define MCAST_START_US 20000000ULL
+#define MCAST_PERIOD_US 1000000ULL
+
+/* Core commands counted in the report */
+enum {
+    SIGNAL = 0,
+    PING = 3,
+    RESUME = 5,
+    ACK = 6,
+    NACK = 15
+};
+
+typedef struct {
+    void *handle;
+    sim_node_t *node;
+    sim_isr_t isr;
+    sim_loop_t loop;
+    bool connected; // RX pin and bus, see --drop
+} node_t;
+
+/* Functions of the master */
+static struct {
+    void (*init)();
+    bool (*discover)();
+    sim_slave_count_t slave_count;
+    sim_request_t request;
+    sim_multicast_t multicast;
+    sim_finish_t finish;
+} master;
+
+static sim_scenario_t scenario = {
+    .seed = 1,
+    .period = 250,
+    .burst = 1,
+    .regs = -1,
+    .replay_dest = 1,
+    .replay_len = 9
+};
+
+static node_t nodes[SIM_MAX_NODES];
+static sim_stats_t stats[SIM_MAX_NODES];
+static uint8_t store[SIM_STORE_SIZE];
+static uint8_t n_nodes = 0;
+static char so_dir[PATH_MAX];
+static char tmp_dir[] = "/tmp/opl_sim.XXXXXX";
+static uint64_t now_us = 0;
+
+/* Bus */
+static struct {
+    int id;
+    uint8_t byte;
+    bool is_addr;
+} pending[MAX_PENDING];
+static uint16_t n_pending = 0;
+static long bytes = 0, frames = 0, collisions = 0;
+static long cmd_count[MAX_CMD];
+
+/* Reply latency, from the end of a request to the address byte of the reply */
+static uint64_t request_end = 0, latency_sum = 0, latency_max = 0;
+static long latency_n = 0;
+static bool request_open = false;
+
+/* Last DATA frame of the master that matches --replay-dest and --replay-len */
+static uint8_t capture[MAX_FRAME], saved[MAX_FRAME];
+static uint8_t capture_len = 0, saved_len = 0;
+
+static uint32_t host_millis() {
+    return (uint32_t)(now_us / 1000);
+}
+
+static bool host_rx_pin(int id) {
+    return nodes[id].connected;
+}
+
+/* Position of the meta byte (the first copy with OPL_FEC), after the address
+ * byte and the node id of the extended frames */
+static uint8_t meta_pos(bool ext) {
+    return (uint8_t)((ext ? 2 : 1) + nodes[0].node->meta_copies);
+}
+
+/* Counts the frames and the core commands on the bus, and times the replies
+ * of the "OpenPAYGO" requests */
+static void parse_byte(int id, uint8_t byte, bool is_addr) {
+    static uint8_t pos = 0, addr = 0, meta = 0;
+    static bool ext = false, cmd = false, request = false;
+
+    if(is_addr) {
+        if(id != 0 && request_open) {
+            uint64_t latency = now_us - request_end; 
+            latency_sum += latency;
+            latency_n++;
+            if(latency > latency_max) latency_max = latency;
+        }
+        request_open = false;
+        request = false;
+        pos = 0;
+        ext = (byte >> 4) == EXT_ADDR_NIBBLE;
+        addr = byte;
+        frames++;
+        return;
+    }
+
+    pos++;
+    meta = meta_pos(ext);
+    if(pos == meta) {
+        cmd = false;
+        if((byte & MICRO_CMD) == MICRO_CMD) {
+            cmd_count[byte & 0x0F]++;
+            if(scenario.frames)
+                printf("%8.1f n%d %02x micro cmd=%d\n", now_us / 1000.0, id,
+                       addr, byte & 0x0F);
+        } else {
+            cmd = byte >> 7;
+            request = id == 0 && byte == 9; // DATA, "OpenPAYGO"
+        }
+    } else if(pos == meta + 1 && cmd && byte < MAX_CMD) {
+        cmd_count[byte]++;
+        if(scenario.frames)
+            printf("%8.1f n%d %02x cmd=%d\n", now_us / 1000.0, id, addr, byte);
+    }
+    if(request && id == 0) { // Until its last byte, a reply starts with 0x55
+        request_open = true;
+        request_end = now_us + BYTE_US;
+    }
+}
+
+static void host_write(int id, uint8_t byte, bool is_addr) {
+    parse_byte(id, byte, is_addr);
+    now_us += BYTE_US;
+    bytes++;
+    if(!nodes[id].connected) return;
+    if(n_pending < MAX_PENDING) {
+        pending[n_pending].id = id;
+        pending[n_pending].byte = byte;
+        pending[n_pending].is_addr = is_addr;
+        n_pending++;
+    }
+}
+
+static void capture_byte(uint8_t byte, bool is_addr) {
+    sim_node_t *node = nodes[0].node;
+    uint8_t meta = meta_pos(false);
+
+    if(is_addr) capture_len = 0;
+    if(capture_len < MAX_FRAME) capture[capture_len++] = byte;
+    if(capture_len > meta && capture[meta] == scenario.replay_len &&
+       (capture[0] & 0x0F) == scenario.replay_dest &&
+       capture_len == meta + 1 + scenario.replay_len + node->auth_len + 2 +
+                      node->fec_len) {
+        memcpy(saved, capture, capture_len);
+        saved_len = capture_len;
+    }
+}
+
+/* Deliver the bytes written in this step, bytes of several nodes collide */
+static void flush_bus() {
+    int first = -1;
+    bool collision = false;
+
+    for(uint16_t j = 0; j < n_pending; j++) {
+        if(first < 0) first = pending[j].id;
+        else if(pending[j].id != first) collision = true;
+    }
+    if(collision) collisions++;
+
+    for(uint16_t j = 0; j < n_pending; j++) {
+        uint8_t byte = pending[j].byte;
+        if(collision) byte ^= (uint8_t)rand();
+        if(scenario.ber > 0) {
+            for(uint8_t k = 0; k < 8; k++)
+                if((double)rand() / RAND_MAX < scenario.ber) byte ^= 1 << k;
+        }
+        for(uint8_t i = 0; i < n_nodes; i++)
+            if(i != pending[j].id && nodes[i].connected)
+                nodes[i].isr(byte, pending[j].is_addr);
+        if(pending[j].id == 0 && !collision)
+            capture_byte(byte, pending[j].is_addr);
+    }
+    n_pending = 0;
+}
+
+/* Inject the saved frame again, straight into the slaves. Mode 2 moves the
+ * counter of an OPL_AUTH frame forward and fixes the CRC, so only the MAC can
+ * catch it (not with OPL_FEC, whose parity is left as is). */
+static void replay(uint8_t mode) {
+    uint8_t frame[MAX_FRAME];
+    uint8_t crc_pos = (uint8_t)(saved_len - 2 - nodes[0].node->fec_len);
+
+    if(saved_len < 4) return;
+    memcpy(frame, saved, saved_len);
+    if(mode == 2) {
+        uint16_t crc = CRC_INIT;
+        frame[crc_pos - 5] += 50; // Low byte of the counter, before the tag
+        for(uint8_t i = 0; i < crc_pos; i++) crc = update_crc16(crc, frame[i]);
+        frame[crc_pos] = (uint8_t)(crc >> 8);
+        frame[crc_pos + 1] = (uint8_t)crc;
+    }
+    for(uint8_t j = 0; j < saved_len; j++)
+        for(uint8_t i = 1; i < n_nodes; i++)
+            if(nodes[i].connected) nodes[i].isr(frame[j], j == 0);
+}
+
+static void *find(void *handle, const char *name) {
+    void *ptr = dlsym(handle, name);
+
+    if(ptr == NULL) {
+        fprintf(stderr, "Missing symbol %s\n", name);
+        exit(1);
+    }
+    return ptr;
+}
+
+/* Every node is a copy of the library, so that it gets its own globals */
+static void *load_copy(const char *name, const char *copy) {
+    char src[PATH_MAX + 16], dst[PATH_MAX + 16], data[4096];
+    FILE *in, *out;
+    size_t len;
+    void *handle;
+
+    snprintf(src, sizeof(src), "%s/%s", so_dir, name);
+    snprintf(dst, sizeof(dst), "%s/%s", tmp_dir, copy);
+    in = fopen(src, "rb");
+    out = fopen(dst, "wb");
+    if(in == NULL || out == NULL) {
+        fprintf(stderr, "Cannot copy %s to %s\n", src, dst);
+        exit(1);
+    }
+    while((len = fread(data, 1, sizeof(data), in)) > 0)
+        fwrite(data, 1, len, out);
+    fclose(in);
+    fclose(out);
+
+    handle = dlopen(dst, RTLD_NOW | RTLD_LOCAL);
+    unlink(dst); // Mapped until the end
+    if(handle == NULL) {
+        fprintf(stderr, "%s\n", dlerror());
+        exit(1);
+    }
+    return handle;
+}
+
+static node_t load(const char *name, const char *copy, int id,
+                   uint32_t phase) {
+    node_t node;
+
+    node.handle = load_copy(name, copy);
+    node.node = find(node.handle, "sim_node");
+    node.isr = (sim_isr_t)find(node.handle, "sim_isr");
+    node.loop = (sim_loop_t)find(node.handle, "sim_app_loop");
+    node.connected = true;
+
+    node.node->id = id;
+    node.node->phase = phase;
+    node.node->store = store;
+    node.node->stats = &stats[id];
+    node.node->scenario = &scenario;
+    node.node->write = host_write;
+    node.node->millis = host_millis;
+    node.node->rx_pin = host_rx_pin;
+    return node;
+}
+
+static void load_master(const char *copy, uint32_t phase) {
+    nodes[0] = load("master.so", copy, 0, phase);
+    master.init = find(nodes[0].handle, "opl_init");
+    master.discover = find(nodes[0].handle, "opl_discover");
+    master.slave_count = find(nodes[0].handle, "sim_slave_count");
+    master.request = find(nodes[0].handle, "sim_request");
+    master.multicast = find(nodes[0].handle, "sim_multicast");
+    master.finish = find(nodes[0].handle, "sim_finish");
+}
+
+/* Reset of the master, a new copy with the same store */
+static void reboot() {
+    static uint8_t count = 0;
+    char copy[16];
+
+    master.finish();
+    snprintf(copy, sizeof(copy), "m%u.so", count++);
+    load_master(copy, 0);
+    master.init();
+    printf("reboot t=%llu SIGNAL=%ld\n", (unsigned long long)now_us / 1000,
+           cmd_count[SIGNAL]);
+}
+
+static int compare_u32(const void *a, const void *b) {
+    uint32_t x = *(const uint32_t *)a, y = *(const uint32_t *)b;
+
+    return (x > y) - (x < y);
+}
+
+static void print_latencies(const char *label, uint32_t *samples, int n) {
+    qsort(samples, n, sizeof(uint32_t), compare_u32);
+    printf("%s good requests n=%d p50=%ums p99=%ums max=%ums\n", label, n,
+           n ? samples[n / 2] : 0, n ? samples[n * 99 / 100] : 0,
+           n ? samples[n - 1] : 0);
+}
+
+static void report(uint8_t n_slaves, int joined_at) {
+    sim_stats_t *m = &stats[0];
+
+    master.finish();
+    printf("queue sent=%ld expired=%ld (cb %ld) avg_age=%.1fms max_age=%ums\n",
+           m->queue_sent, m->queue_expired, m->expired,
+           m->queue_sent ? (double)m->queue_total_age / m->queue_sent : 0,
+           m->queue_max_age);
+    if(scenario.no_reply)
+        printf("matched ok=%ld bad=%ld null=%ld noreply_cb ok=%ld bad=%ld "
+               "down_cb=%ld\n", m->match_ok, m->match_bad, m->match_null,
+               m->no_reply_ok, m->no_reply_bad, m->down);
+    printf("push_fail=%ld mcast_sent=%ld collisions=%ld "
+           "reply_latency_avg_ms=%.2f max_ms=%.2f n=%ld\n", m->push_fail,
+           m->mcast_sent, collisions,
+           latency_n ? latency_sum / 1000.0 / latency_n : 0,
+           latency_max / 1000.0, latency_n);
+    printf("slaves=%u joined_at_ms=%d master_rx=%ld bytes=%ld\n", n_slaves,
+           joined_at, m->rx, bytes);
+    if(m->values || m->value_errors)
+        printf("values=%ld value_errors=%ld\n", m->values, m->value_errors);
+    printf("frames=%ld PING=%ld ACK=%ld SIGNAL=%ld RESUME=%ld NACK=%ld\n",
+           frames, cmd_count[PING], cmd_count[ACK], cmd_count[SIGNAL],
+           cmd_count[RESUME], cmd_count[NACK]);
+
+    for(uint8_t i = 1; i < n_nodes; i++) {
+        sim_stats_t *s = &stats[i];
+        long total = s->awake_ms + s->asleep_ms;
+        printf(" slave%u rx=%ld bad=%ld mcast=%ld buffered=%ld awake=%.1f%%\n",
+               i, s->rx, s->bad, s->mcast, s->buffered,
+               total ? 100.0 * s->awake_ms / total : 100.0);
+    }
+
+    if(scenario.adv) {
+        print_latencies("slave->master", m->lat_up, m->n_up);
+        print_latencies("master->slave", m->lat_down, m->n_down);
+        printf("flood rx=%ld (to master) tx=%ld (from master) PING=%ld\n",
+               m->flood_rx, m->flood_tx, cmd_count[PING]);
+    }
+}
+
+static void usage(const char *name) {
+    printf("Usage: %s [options] [slaves [seconds]]\n"
+           "Simulates a master and 3 slaves for 60 s by default, the master\n"
+           "sends \"OpenPAYGO\" to the slaves in turn.\n"
+           "  -s, --seed N          Seed of the simulation (1)\n"
+           "  -b, --ber X           Bit error rate on the bus (0)\n"
+           "  -p, --period MS       Time between two requests (250)\n"
+           "  -n, --no-traffic      No requests\n"
+           "  -B, --burst N         Requests per period (1)\n"
+           "  -T, --timeout MS      Deadline of the requests\n"
+           "      --timeout-mix     Deadline for every other slave only\n"
+           "  -R, --no-reply K      Every K-th request is left unanswered\n"
+           "  -g, --regs MODE       Register polls with SIM_REGS: 0 all, 1 "
+           "list,\n"
+           "                        2 one by one, 3 subscribe, 4 registers "
+           "0-4\n"
+           "  -a, --adv MODE        Flooding slave 1 (1), master (2), both "
+           "(3)\n"
+           "      --app-ms MS       Slaves run their loop every MS only\n"
+           "      --no-uid          Slaves start without UID\n"
+           "      --zip-dict        Shared dictionary of OPL_ZIP\n"
+           "  -m, --mcast MODE      Multicast (1) or broadcast (2) every s "
+           "from 20 s\n"
+           "  -d, --discover S      Discovery at S seconds\n"
+           "  -r, --reboot S        Master reset at S seconds\n"
+           "      --drop ID@S[-S]   Disconnect a slave, and reconnect it\n"
+           "      --replay MODE     Replay a master frame every 2 s from 30 s,"
+           "\n"
+           "                        the same (1) or a forward counter (2)\n"
+           "      --replay-dest A   Address of the replayed frame, 0 for "
+           "broadcasts (1)\n"
+           "      --replay-len N    Payload length of the replayed frame (9)\n"
+           "  -v, --trace           Print the changes of the slave list\n"
+           "  -f, --frames          Print the commands on the bus\n", name);
+}
+
+enum {
+    OPT_TIMEOUT_MIX = 256,
+    OPT_APP_MS,
+    OPT_NO_UID,
+    OPT_ZIP_DICT,
+    OPT_DROP,
+    OPT_REPLAY,
+    OPT_REPLAY_DEST,
+    OPT_REPLAY_LEN
+};
+
+static const struct option options[] = {
+    {"seed", required_argument, NULL, 's'},
+    {"ber", required_argument, NULL, 'b'},
+    {"period", required_argument, NULL, 'p'},
+    {"no-traffic", no_argument, NULL, 'n'},
+    {"burst", required_argument, NULL, 'B'},
+    {"timeout", required_argument, NULL, 'T'},
+    {"timeout-mix", no_argument, NULL, OPT_TIMEOUT_MIX},
+    {"no-reply", required_argument, NULL, 'R'},
+    {"regs", required_argument, NULL, 'g'},
+    {"adv", required_argument, NULL, 'a'},
+    {"app-ms", required_argument, NULL, OPT_APP_MS},
+    {"no-uid", no_argument, NULL, OPT_NO_UID},
+    {"zip-dict", no_argument, NULL, OPT_ZIP_DICT},
+    {"mcast", required_argument, NULL, 'm'},
+    {"discover", required_argument, NULL, 'd'},
+    {"reboot", required_argument, NULL, 'r'},
+    {"drop", required_argument, NULL, OPT_DROP},
+    {"replay", required_argument, NULL, OPT_REPLAY},
+    {"replay-dest", required_argument, NULL, OPT_REPLAY_DEST},
+    {"replay-len", required_argument, NULL, OPT_REPLAY_LEN},
+    {"trace", no_argument, NULL, 'v'},
+    {"frames", no_argument, NULL, 'f'},
+    {"help", no_argument, NULL, 'h'},
+    {NULL, 0, NULL, 0}
+};
+
+static void parse_options(int argc, char **argv, uint8_t *n_slaves) {
+    int opt;
+
+    while((opt = getopt_long(argc, argv, "s:b:p:nB:T:R:g:a:m:d:r:vfh",
+                             options, NULL)) != -1) {
+        switch(opt) {
+            case 's': scenario.seed = strtoul(optarg, NULL, 0); break;
+            case 'b': scenario.ber = atof(optarg); break;
+            case 'p': scenario.period = atoi(optarg); break;
+            case 'n': scenario.period = 0; break;
+            case 'B': scenario.burst = atoi(optarg); break;
+            case 'T': scenario.timeout = atoi(optarg); break;
+            case OPT_TIMEOUT_MIX: scenario.timeout_mix = true; break;
+            case 'R': scenario.no_reply = atoi(optarg); break;
+            case 'g': scenario.regs = atoi(optarg); break;
+            case 'a': scenario.adv = atoi(optarg); break;
+            case OPT_APP_MS: scenario.app_ms = atoi(optarg); break;
+            case OPT_NO_UID: scenario.no_uid = true; break;
+            case OPT_ZIP_DICT: scenario.zip_dict = true; break;
+            case 'm': scenario.mcast = atoi(optarg); break;
+            case 'd': scenario.discover = atof(optarg); break;
+            case 'r': scenario.reboot = atof(optarg); break;
+            case OPT_DROP:
+                if(sscanf(optarg, "%hhu@%f-%f", &scenario.drop,
+                          &scenario.drop_at, &scenario.undrop_at) < 2) {
+                    usage(argv[0]);
+                    exit(1);
+                }
+                break;
+            case OPT_REPLAY: scenario.replay = atoi(optarg); break;
+            case OPT_REPLAY_DEST: scenario.replay_dest = atoi(optarg); break;
+            case OPT_REPLAY_LEN: scenario.replay_len = atoi(optarg); break;
+            case 'v': scenario.trace = true; break;
+            case 'f': scenario.frames = true; break;
+            case 'h': usage(argv[0]); exit(0);
+            default: usage(argv[0]); exit(1);
+        }
+    }
+    *n_slaves = 3;
+    scenario.secs = 60;
+    if(optind < argc) *n_slaves = atoi(argv[optind++]);
+    if(optind < argc) scenario.secs = atoi(argv[optind++]);
+    if(*n_slaves >= SIM_MAX_NODES || scenario.drop >= SIM_MAX_NODES) {
+        fprintf(stderr, "Up to %d slaves\n", SIM_MAX_NODES - 1);
+        exit(1);
+    }
+}
+
+/* The libraries are next to the executable */
+static void find_libraries() {
+    char exe[PATH_MAX];
+    ssize_t len = readlink("/proc/self/exe", exe, sizeof(exe) - 1);
+
+    if(len < 0) {
+        perror("readlink");
+        exit(1);
+    }
+    exe[len] = '\0';
+    snprintf(so_dir, sizeof(so_dir), "%s", dirname(exe));
+    if(mkdtemp(tmp_dir) == NULL) {
+        perror("mkdtemp");
+        exit(1);
+    }
+}
+
+static bool due(float secs) {
+    return secs > 0 && now_us >= (uint64_t)(secs * 1000000);
+}
+
+int main(int argc, char **argv) {
+    uint8_t n_slaves, count = 0, last_count = 0xFF;
+    uint64_t last_request = 0, last_mcast = 0, last_replay = 0;
+    uint64_t reboot_us = 0;
+    bool dropped = false, undropped = false, rebooted = false;
+    bool discovered = false;
+    uint16_t next = 0;
+    int joined_at = -1;
+
+    parse_options(argc, argv, &n_slaves);
+    find_libraries();
+    srand(scenario.seed);
+
+    stats[0].lat_up = calloc(SIM_MAX_SAMPLES, sizeof(uint32_t));
+    stats[0].lat_down = calloc(SIM_MAX_SAMPLES, sizeof(uint32_t));
+    load_master("n0.so", rand() % 50);
+    n_nodes = 1;
+    for(uint8_t i = 1; i <= n_slaves; i++) {
+        char copy[16];
+        snprintf(copy, sizeof(copy), "n%u.so", i);
+        nodes[i] = load("slave.so", copy, i, rand() % 50);
+        snprintf((char *)nodes[i].node->uid, SIM_UID_SIZE, "UID%03u", i);
+        nodes[i].node->seed = 1000 + i * 7919;
+        n_nodes++;
+    }
+    for(uint8_t i = 0; i < n_nodes; i++)
+        ((void (*)())find(nodes[i].handle, "opl_init"))();
+
+    while(now_us < (uint64_t)scenario.secs * 1000000) {
+        if(scenario.drop && !dropped && due(scenario.drop_at)) {
+            dropped = true;
+            nodes[scenario.drop].connected = false;
+            printf("drop t=%llu\n", (unsigned long long)now_us / 1000);
+        }
+        if(scenario.drop && !undropped && due(scenario.undrop_at)) {
+            undropped = true;
+            nodes[scenario.drop].connected = true;
+            printf("undrop t=%llu\n", (unsigned long long)now_us / 1000);
+        }
+        if(!rebooted && due(scenario.reboot)) {
+            rebooted = true;
+            reboot();
+            last_count = 0xFF; // Print the slaves known after the reset
+        }
+        if(!discovered && due(scenario.discover)) {
+            discovered = true;
+            master.discover();
+        }
+        if(scenario.mcast && now_us > MCAST_START_US &&
+           now_us - last_mcast > MCAST_PERIOD_US) {
+            last_mcast = now_us;
+            master.multicast();
+        }
+
+        for(uint8_t i = 0; i < n_nodes; i++) nodes[i].loop();
+        flush_bus();
+        now_us += STEP_US;
+
+        if(scenario.period &&
+           now_us - last_request > scenario.period * 1000ULL) {
+            last_request = now_us;
+            count = master.slave_count();
+            if(count) master.request(next++ % count);
+        }
+
+        count = master.slave_count();
+        if(rebooted && !reboot_us) reboot_us = now_us;
+        if(scenario.replay && now_us > REPLAY_START_US &&
+           now_us - last_replay > REPLAY_PERIOD_US) {
+            last_replay = now_us;
+            replay(scenario.replay);
+        }
+        if(joined_at < 0 && count == n_slaves) joined_at = now_us / 1000;
+        if(count != last_count) {
+            if(reboot_us)
+                printf("after reboot +%llums n=%u\n",
+                       (unsigned long long)(now_us - reboot_us) / 1000, count);
+            else if(scenario.trace)
+                printf("t=%llu n=%u\n", (unsigned long long)now_us / 1000,
+                       count);
+            last_count = count;
+        }
+    }
+
+    report(master.slave_count(), joined_at);
+    rmdir(tmp_dir);
+    return 0;
+}
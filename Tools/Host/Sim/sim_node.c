@@ -0,0 +1,496 @@
+/*
+ * Filename:    sim_node.c
+ * Project:     OpenPAYGO Link
+ * Author:      Daniel Nedosseikine
+ * Company:     Solaris Offgrid
+ * Created on:  19/10/2026
+ * Description: Application of the simulated nodes, built with MASTER into
+ *              master.so and with SLAVE into slave.so. Slaves answer the
+ *              "OpenPAYGO" requests with "Link", the master pushes the requests
+ *              the host asks for. SIM_REGS runs the register profile instead,
+ *              SIM_ZIP makes the slaves push log lines, SIM_STAGE stages the
+ *              replies and SIM_SLEEP lets the slaves sleep.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "sim_uart.h"
+#include "oplink_common.h"
+#include "oplink_com.h"
+#ifdef MASTER
+#include "oplink_master.h"
+#include "slave_list.h"
+#endif /* MASTER */
+#ifdef SLAVE
+#include "oplink_slave.h"
+#endif /* SLAVE */
+#ifdef SIM_REGS
+#include "oplink_registers.h"
+#endif /* SIM_REGS */
+
+#ifdef OPL_AUTH
+#define SIM_AUTH_LEN AUTH_LEN
+#else
+#define SIM_AUTH_LEN 0
+#endif
+
+#define REQUEST "OpenPAYGO"
+#define REQUEST_LEN 9
+#define REPLY "Link"
+#define REPLY_LEN 4
+#define LOG_LEN 100 // Log lines of SIM_ZIP
+#define ADV_PERIOD 1000 // ms between the timed requests of adv
+
+sim_node_t sim_node = {
+    .meta_copies = FEC_META_COPIES,
+    .auth_len = SIM_AUTH_LEN,
+    .fec_len = FEC_LEN
+};
+
+static uint8_t buf[OPL_PAYLOAD_MAX_LEN];
+
+#ifndef SIM_REGS
+static void put32(uint8_t *ptr, uint32_t value) {
+    ptr[0] = (uint8_t)(value >> 24);
+    ptr[1] = (uint8_t)(value >> 16);
+    ptr[2] = (uint8_t)(value >> 8);
+    ptr[3] = (uint8_t)value;
+}
+#endif /* SIM_REGS */
+
+#ifdef SIM_ZIP
+static void set_dictionary() {
+    static bool done = false;
+
+    if(done) return;
+    done = true;
+#ifdef OPL_ZIP
+    if(sim_node.scenario->zip_dict)
+        opl_set_zip_dictionary((const uint8_t *)SIM_DICT,
+                               sizeof(SIM_DICT) - 1);
+#endif /* OPL_ZIP */
+}
+#endif /* SIM_ZIP */
+
+#ifdef SLAVE
+
+static uint32_t sleep_until, last_ms, app_last;
+static bool woken, last_pin;
+
+void sim_wake() {
+    woken = true;
+}
+
+#ifdef SIM_SLEEP
+void sim_sleep(uint32_t ms) {
+    sleep_until = sim_millis() + ms;
+    woken = false;
+}
+#endif /* SIM_SLEEP */
+
+#ifdef SIM_ZIP
+/* A log line every second, kept until the request is sent */
+static void push_log() {
+    static char lines[8][LOG_LEN];
+    static uint8_t index = 0;
+    static uint32_t last = 0;
+    char *line = lines[index];
+    int len;
+
+    if(sim_millis() - last < 1000) return;
+    len = snprintf(line, LOG_LEN, "INFO: battery voltage %d.%02dV current "
+                   "%d.%02dA temperature %dC load %s", 11 + rand() % 3,
+                   rand() % 100, rand() % 5, rand() % 100, 20 + rand() % 15,
+                   rand() % 2 ? "on" : "off");
+    if(opl_push_request((uint8_t *)line, (uint8_t)len)) {
+        index = (index + 1) % 8;
+        last = sim_millis();
+    }
+}
+#endif /* SIM_ZIP */
+
+#ifdef SIM_REGS
+/* 5 read only U16, 3 I32 and 2 U8 registers. Register 0 changes slowly and
+ * register 1 changes below the deadband of its subscription. */
+static uint16_t reg16[5];
+static int32_t reg32[3];
+static uint8_t reg8[2];
+
+static void init_registers() {
+    static opl_register_t table[10];
+
+    for(uint8_t i = 0; i < 5; i++) {
+        table[i].ptr = &reg16[i];
+        table[i].type = REG_U16 | REG_RO;
+        reg16[i] = 1000 * i + sim_node.id;
+    }
+    for(uint8_t i = 0; i < 3; i++) {
+        table[5 + i].ptr = &reg32[i];
+        table[5 + i].type = REG_I32;
+        reg32[i] = -100000L * i - sim_node.id;
+    }
+    for(uint8_t i = 0; i < 2; i++) {
+        table[8 + i].ptr = &reg8[i];
+        table[8 + i].type = REG_U8;
+        reg8[i] = i;
+    }
+    opl_reg_init(table, 10, NULL);
+}
+
+static void process(uint8_t len) {
+    if(opl_reg_process(buf, len)) return;
+    if(len == REQUEST_LEN && memcmp(buf, REQUEST, REQUEST_LEN) == 0)
+        opl_send_reply((uint8_t *)REPLY, REPLY_LEN);
+}
+#else
+/* Slave 1 floods the master with requests (adv & 1), the others push a
+ * timestamped request every ADV_PERIOD */
+static void push_adv(uint32_t now) {
+    static uint8_t flood[2] = {'F', 0};
+    static uint8_t timed[4][6];
+    static uint8_t index = 0;
+    static uint32_t last = 0;
+    uint8_t *ptr = timed[index];
+
+    if(sim_node.id == 1 && (sim_node.scenario->adv & 1)) {
+        flood[1] = (uint8_t)sim_node.id;
+        opl_push_request(flood, 2);
+    } else if(now - last >= ADV_PERIOD) {
+        ptr[0] = 'G';
+        ptr[1] = (uint8_t)sim_node.id;
+        put32(ptr + 2, sim_node.millis());
+        if(opl_push_request(ptr, 6)) {
+            index = (index + 1) % 4;
+            last = now;
+        }
+    }
+}
+
+/* Multicasts start with 'M' and the group, '*' for a broadcast */
+static void process(uint8_t len) {
+    if(buf[0] == 'M' && (buf[1] == '*' || buf[1] - '0' == sim_node.id % 2))
+        sim_node.stats->mcast++;
+    if(len == REQUEST_LEN && memcmp(buf, REQUEST, REQUEST_LEN) == 0)
+        opl_send_reply((uint8_t *)REPLY, REPLY_LEN);
+    else if(buf[0] == 'Q')
+        opl_send_reply(buf, len); // Echo of the timed requests of adv
+}
+#endif /* SIM_REGS */
+
+void sim_app_loop() {
+    uint32_t now = sim_millis();
+    uint8_t len;
+
+#ifdef SIM_ZIP
+    set_dictionary();
+    push_log();
+#endif /* SIM_ZIP */
+#ifdef SIM_STAGE
+    static bool staged = false;
+    if(!staged) staged = opl_stage_reply('O', (uint8_t *)REPLY, REPLY_LEN);
+#endif /* SIM_STAGE */
+
+    // Time asleep, only the received bytes and the RX pin wake the node up
+    if(now != last_ms) {
+        if((int32_t)(now - sleep_until) < 0 && !woken)
+            sim_node.stats->asleep_ms += now - last_ms;
+        else
+            sim_node.stats->awake_ms += now - last_ms;
+        last_ms = now;
+    }
+    if(sim_rx_pin() != last_pin) {
+        last_pin = sim_rx_pin();
+        woken = true;
+    }
+    if((int32_t)(now - sleep_until) < 0 && !woken) return;
+
+    // Busy with other work
+    if(sim_node.scenario->app_ms && now - app_last < sim_node.scenario->app_ms)
+        return;
+    app_last = now;
+
+#ifdef SIM_REGS
+    static bool registers = false;
+    if(!registers) {
+        init_registers();
+        registers = true;
+    }
+    reg16[0] = 1000 + sim_millis() / 5000;
+    reg16[1] = 2000 + rand() % 7;
+    opl_reg_update();
+#else
+    if(sim_node.scenario->adv) push_adv(now);
+#endif /* SIM_REGS */
+
+    if((len = opl_parse()) > 0) {
+        if(opl_read(buf, len)) {
+            sim_node.stats->rx++;
+            process(len);
+        } else {
+            sim_node.stats->bad++;
+        }
+    }
+
+    opl_keep_alive();
+#ifdef OPL_ENTER_LOW_POWER
+    opl_sleep();
+#endif /* OPL_ENTER_LOW_POWER */
+}
+
+#endif /* SLAVE */
+
+#ifdef MASTER
+
+static opl_slave_list_t list;
+
+void sim_wake() {
+}
+
+#ifdef SIM_PERSIST
+uint32_t sim_load_counter() {
+    uint32_t counter;
+
+    memcpy(&counter, sim_node.store + SIM_COUNTER_ADDR, 4);
+    return counter;
+}
+#endif /* SIM_PERSIST */
+
+uint8_t sim_slave_count() {
+    get_slave_list(&list);
+    return list.n_slaves;
+}
+
+/* Requests dropped or left unanswered, the silent requests of no_reply must
+ * be the only ones reported without a reply */
+static void request_dropped(opl_handle_t handle, uint8_t *data,
+                            uint8_t status) {
+    (void)handle;
+    if(status == OPL_REQUEST_EXPIRED) sim_node.stats->expired++;
+    if(status == OPL_REQUEST_SLAVE_DOWN) sim_node.stats->down++;
+    if(status == OPL_REQUEST_NO_REPLY) {
+        if(data[0] == 'S') sim_node.stats->no_reply_ok++;
+        else sim_node.stats->no_reply_bad++;
+    }
+}
+
+#ifdef SIM_REGS
+/* Only the ranges are checked, the values depend on the slave */
+static void register_read(opl_handle_t handle, uint8_t reg, uint8_t status,
+                          int32_t value) {
+    (void)handle;
+    if(status != REG_OK) {
+        sim_node.stats->value_errors++;
+        return;
+    }
+    sim_node.stats->values++;
+    if(reg > 1 && reg < 5 && (value < 0 || value % 1000 > 64))
+        sim_node.stats->value_errors++;
+    if(reg >= 5 && reg < 8 && value > 0) sim_node.stats->value_errors++;
+    if(reg >= 8 && value != reg - 8) sim_node.stats->value_errors++;
+}
+
+/* Mode 0 reads all the registers, 1 a list, 2 one at a time, 3 subscribes to
+ * registers 0 to 4 and 4 reads them */
+static bool poll_registers(uint8_t *uid, int8_t mode) {
+    static opl_handle_t subscribed[SIM_MAX_NODES];
+    static uint8_t next = 0;
+    uint8_t regs[4] = {1, 6, 9, 3};
+    opl_handle_t handle = get_slave_handle(uid);
+    uint8_t addr = handle & 0xFF;
+
+    opl_reg_set_callback(register_read);
+    switch(mode) {
+        case 0:
+            return opl_reg_read(handle, 0, 10);
+        case 1:
+            return opl_reg_read_list(handle, regs, 4);
+        case 3:
+            if(subscribed[addr] == handle) return true;
+            if(opl_reg_subscribe(handle, 0, 1, 0, 1000) &&
+               opl_reg_subscribe(handle, 1, 4, 10, 1000))
+                subscribed[addr] = handle;
+            return true;
+        case 4:
+            return opl_reg_read(handle, 0, 5);
+        default:
+            return opl_reg_read(handle, next++ % 10, 1);
+    }
+}
+#endif /* SIM_REGS */
+
+void sim_request(uint8_t index) {
+    const sim_scenario_t *scenario = sim_node.scenario;
+    static uint8_t ring[64][REQUEST_LEN + 1]; // Kept until they are sent
+    static uint32_t ring_index = 0;
+    uint8_t *uid = list.uids[index];
+
+    if(!uid[0]) return;
+#ifdef SIM_REGS
+    if(scenario->regs >= 0) {
+        poll_registers(uid, scenario->regs);
+        return;
+    }
+#endif /* SIM_REGS */
+    for(uint8_t i = 0; i < scenario->burst; i++) {
+        bool ok;
+        if(scenario->timeout) {
+            uint16_t timeout = scenario->timeout;
+            if(scenario->timeout_mix && index % 2) timeout = 0;
+            ok = opl_push_request_timeout(get_slave_handle(uid),
+                                          (uint8_t *)REQUEST, REQUEST_LEN,
+                                          timeout);
+        } else if(scenario->no_reply) {
+            uint8_t *ptr = ring[ring_index++ % 64];
+            memcpy(ptr, (ring_index % scenario->no_reply) ? REQUEST :
+                   "Silent123", REQUEST_LEN);
+            ok = opl_push_request(uid, ptr, REQUEST_LEN);
+        } else {
+            ok = opl_push_request(uid, (uint8_t *)REQUEST, REQUEST_LEN);
+        }
+        if(!ok) sim_node.stats->push_fail++;
+    }
+}
+
+/* Mode 1 puts the even slaves in group 0 and the odd ones in group 1 on the
+ * first call, then multicasts to group 0. Mode 2 broadcasts. */
+void sim_multicast() {
+    static uint8_t payload[10] = "M0payload";
+    static bool grouped = false;
+    bool ok;
+
+    if(sim_node.scenario->mcast == 1 && !grouped) {
+        grouped = true;
+        get_slave_list(&list);
+        for(uint8_t i = 0; i < list.n_slaves; i++) {
+            int id = atoi((char *)list.uids[i] + 3); // "UID%03d"
+            opl_set_groups(get_slave_handle(list.uids[i]),
+                           (uint8_t)(1 << (id % 2)));
+        }
+        return;
+    }
+    if(sim_node.scenario->mcast == 1) {
+        ok = opl_push_multicast(0, payload, sizeof(payload));
+    } else {
+        payload[1] = '*';
+        ok = opl_push_broadcast(payload, sizeof(payload));
+    }
+    if(ok) sim_node.stats->mcast_sent++;
+}
+
+void sim_finish() {
+    opl_queue_stats_t queue;
+
+    opl_read_queue_stats(&queue);
+    sim_node.stats->queue_sent += queue.sent;
+    sim_node.stats->queue_expired += queue.expired;
+    sim_node.stats->queue_total_age += queue.total_age;
+    if(queue.max_age > sim_node.stats->queue_max_age)
+        sim_node.stats->queue_max_age = queue.max_age;
+}
+
+#ifndef SIM_REGS
+static uint32_t get32(uint8_t *ptr) {
+    return ((uint32_t)ptr[0] << 24) | ((uint32_t)ptr[1] << 16) |
+           ((uint32_t)ptr[2] << 8) | ptr[3];
+}
+
+/* Slave 1 is flooded with requests (adv & 2), the others get a timestamped
+ * request every ADV_PERIOD that they echo */
+static void push_adv(uint32_t now) {
+    static uint8_t timed[MAX_SLAVES][4][6];
+    static uint8_t index[MAX_SLAVES];
+    static uint32_t last[MAX_SLAVES];
+    static uint8_t flood[6] = {'Q', 1};
+
+    if(!(sim_node.scenario->adv & 2)) return;
+    get_slave_list(&list);
+    for(uint8_t i = 0; i < list.n_slaves; i++) {
+        uint8_t *ptr = timed[i][index[i]];
+        if(memcmp(list.uids[i], "UID001", 6) == 0) {
+            put32(flood + 2, 0);
+            if(opl_push_request(list.uids[i], flood, 6))
+                sim_node.stats->flood_tx++;
+            continue;
+        }
+        if(now - last[i] < ADV_PERIOD) continue;
+        ptr[0] = 'Q';
+        ptr[1] = 0;
+        put32(ptr + 2, sim_node.millis());
+        if(opl_push_request(list.uids[i], ptr, 6)) {
+            index[i] = (index[i] + 1) % 4;
+            last[i] = now;
+        }
+    }
+}
+
+static void process(uint8_t len) {
+    sim_stats_t *stats = sim_node.stats;
+
+    if(sim_node.scenario->adv) {
+        if(buf[0] == 'G' && stats->n_up < SIM_MAX_SAMPLES) {
+            stats->lat_up[stats->n_up++] = sim_node.millis() - get32(buf + 2);
+            opl_send_reply((uint8_t *)"ok", 2);
+        } else if(buf[0] == 'F') {
+            stats->flood_rx++;
+            opl_send_reply((uint8_t *)"ok", 2);
+        } else if(buf[0] == 'Q' && get32(buf + 2) &&
+                  stats->n_down < SIM_MAX_SAMPLES) {
+            stats->lat_down[stats->n_down++] =
+                sim_node.millis() - get32(buf + 2);
+        }
+        return;
+    }
+#ifdef SIM_ZIP
+    if(len > 20) {
+        if(memcmp(buf, "INFO: battery voltage 1", 23) == 0 &&
+           (memcmp(buf + len - 7, "load on", 7) == 0 ||
+            memcmp(buf + len - 8, "load off", 8) == 0))
+            stats->values++;
+        else
+            stats->value_errors++;
+        opl_send_reply((uint8_t *)"ok", 2);
+    }
+#else
+    if(len == REPLY_LEN && memcmp(buf, REPLY, REPLY_LEN) == 0) {
+        uint8_t *request = opl_reply_request();
+        if(request == NULL) stats->match_null++;
+        else if(memcmp(request, REQUEST, REQUEST_LEN) == 0) stats->match_ok++;
+        else stats->match_bad++;
+    }
+#endif /* SIM_ZIP */
+}
+#endif /* SIM_REGS */
+
+void sim_app_loop() {
+    static bool started = false;
+    uint8_t len;
+
+    if(!started) {
+        opl_set_request_callback(request_dropped);
+        started = true;
+    }
+#ifdef SIM_ZIP
+    set_dictionary();
+#endif /* SIM_ZIP */
+#ifndef SIM_REGS
+    if(sim_node.scenario->adv) push_adv(sim_millis());
+#endif /* SIM_REGS */
+
+    if((len = opl_parse()) > 0) {
+        if(opl_read(buf, len)) {
+            sim_node.stats->rx++;
+#ifdef SIM_REGS
+            opl_reg_parse_reply(buf, len);
+#else
+            process(len);
+#endif /* SIM_REGS */
+        } else {
+            sim_node.stats->bad++;
+        }
+    }
+
+    opl_keep_alive();
+}
+
+#endif /* MASTER */
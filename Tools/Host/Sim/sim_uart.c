@@ -0,0 +1,122 @@
+/*
+ * Filename:    sim_uart.c
+ * Project:     OpenPAYGO Link
+ * Author:      Daniel Nedosseikine
+ * Company:     Solaris Offgrid
+ * Created on:  19/10/2026
+ * Description: UART driver of the simulated nodes, see sim_uart.h. Like the
+ *              9-bit UART of the STM8S003 in mute mode, only the address byte
+ *              of the node or its default address unmutes it.
+ */
+
+#include "sim_uart.h"
+
+static struct {
+    bool busy;
+    bool mute;
+    bool is_addr;
+    bool rx_enabled;
+    uint8_t default_addr;
+    uint8_t addr;
+} uart;
+
+static struct {
+    uint8_t data[UART_BUFFER_SIZE];
+    uint8_t first;
+    uint8_t last;
+    void (*callback)(uint8_t);
+} rx;
+
+uint32_t sim_millis() {
+    return sim_node.millis() + sim_node.phase;
+}
+
+bool sim_rx_pin() {
+    return sim_node.rx_pin(sim_node.id);
+}
+
+void sim_rx_enable(bool enable) {
+    uart.rx_enabled = enable;
+}
+
+void uart_init(uint8_t default_addr, void(*rx_callback)(uint8_t)) {
+    uart.mute = true;
+    uart.default_addr = default_addr;
+    uart.addr = default_addr;
+    uart.busy = false;
+    uart.rx_enabled = true;
+    rx.first = rx.last;
+    rx.callback = rx_callback;
+}
+
+void uart_set_addr(uint8_t addr) {
+    if(addr <= 0x0F) uart.addr = addr;
+}
+
+void uart_mute() {
+    uart.mute = true;
+}
+
+/* Any byte on the bus sets the busy flag, even with the receiver disabled */
+void sim_isr(uint8_t byte, bool is_addr) {
+    uint8_t next = (rx.last + 1) % UART_BUFFER_SIZE;
+
+    uart.busy = true;
+    if(!uart.rx_enabled) return;
+
+    uart.is_addr = is_addr;
+    if(is_addr) {
+        uint8_t addr = byte & 0x0F;
+        if(addr == uart.addr || addr == uart.default_addr) {
+            uart.mute = false;
+            rx.first = rx.last;
+        } else {
+            uart.mute = true;
+        }
+    }
+
+    if(!uart.mute && next != rx.first) {
+        sim_node.stats->buffered++;
+        sim_wake();
+        rx.data[rx.last] = byte;
+        rx.last = next;
+        if(rx.callback) rx.callback(byte);
+    }
+}
+
+bool uart_is_addr() {
+    return uart.is_addr;
+}
+
+bool uart_is_busy() {
+    return uart.busy;
+}
+
+void uart_clear_busy_flag() {
+    uart.busy = false;
+}
+
+uint8_t uart_read_byte() {
+    uint8_t byte = 0;
+
+    if(rx.last != rx.first) {
+        byte = rx.data[rx.first];
+        rx.first = (rx.first + 1) % UART_BUFFER_SIZE;
+    }
+    return byte;
+}
+
+void uart_write(uint8_t data) {
+    sim_node.write(sim_node.id, data, false);
+}
+
+void uart_write_addr(uint8_t addr) {
+    sim_node.write(sim_node.id, addr, true);
+}
+
+void uart_write_break() {
+}
+
+void uart_flush_rx_buffer() {
+    rx.first = rx.last;
+}
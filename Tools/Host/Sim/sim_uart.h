@@ -0,0 +1,63 @@
+/*
+ * Filename:    sim_uart.h
+ * Project:     OpenPAYGO Link
+ * Author:      Daniel Nedosseikine
+ * Company:     Solaris Offgrid
+ * Created on:  19/10/2026
+ * Description: UART driver of the simulated nodes, with the functions of the
+ *              STM8S003 driver. The host delivers the bytes of the bus with
+ *              sim_isr() and every byte written goes to the host.
+ */
+
+#ifndef SIM_UART_H
+#define SIM_UART_H 1
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "sim.h"
+
+#define UART_BUFFER_SIZE    128
+
+extern sim_node_t sim_node;
+
+uint32_t sim_millis(); // Clock of the node
+
+bool sim_rx_pin(); // Idle level of the RX pin, low while disconnected
+
+void sim_rx_enable(bool enable);
+
+void sim_wake(); // Called on every byte received
+
+void uart_init(uint8_t default_addr, void(*rx_callback)(uint8_t));
+
+void uart_set_addr(uint8_t addr); // Max length is 4 bits
+
+void uart_mute();
+
+void sim_isr(uint8_t byte, bool is_addr);
+
+bool uart_is_addr();
+
+bool uart_is_busy();
+
+void uart_clear_busy_flag();
+
+uint8_t uart_read_byte();
+
+void uart_write(uint8_t data);
+
+void uart_write_addr(uint8_t addr);
+
+void uart_write_break();
+
+void uart_flush_rx_buffer();
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* SIM_UART_H */
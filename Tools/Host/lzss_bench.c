@@ -0,0 +1,192 @@
+/*
+ * Filename:    lzss_bench.c
+ * Project:     OpenPAYGO Link
+ * Author:      Daniel Nedosseikine
+ * Company:     Solaris Offgrid
+ * Created on:  19/10/2026
+ * Description: Host benchmark of the LZSS compression of OPL_ZIP. Compresses
+ *              every frame of the corpora like send_data() does, checks that
+ *              it decodes back, and gives the ratio and the cycles per byte.
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "lzss.h"
+#ifdef __x86_64__
+#include <x86intrin.h>
+#endif /* __x86_64__ */
+
+#define MAX_FRAMES 64
+#define MAX_LEN 120 // OPL_PAYLOAD_MAX_LEN
+#define MAX_DICT 128 // ZIP_MAX_DICT
+#define ZIP_HEADER_LEN 2
+#define ZIP_MIN_LEN 8
+#define REPEAT 2000 // Passes over the corpus for the timings
+
+typedef struct {
+    const char *name;
+    const char *file; // One frame per line, in hex if the name ends with .hex
+    const char *dict; // NULL for none
+} corpus_t;
+
+static const corpus_t corpora[] = {
+    {"telemetry JSON", "telemetry.txt", NULL},
+    {"telemetry JSON", "telemetry.txt", "telemetry.dict"},
+    {"log text", "log.txt", NULL},
+    {"log text", "log.txt", "log.dict"},
+    {"register publish", "registers.hex", NULL}
+};
+
+static uint8_t frames[MAX_FRAMES][MAX_LEN];
+static uint8_t lens[MAX_FRAMES];
+static uint8_t zipped[MAX_FRAMES][MAX_LEN];
+static uint8_t zip_lens[MAX_FRAMES];
+static uint8_t dict[MAX_DICT];
+static uint8_t dict_len;
+
+/* Cycles on x86, ns elsewhere */
+static uint64_t ticks() {
+#ifdef __x86_64__
+    return __rdtsc();
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+#endif /* __x86_64__ */
+}
+
+static FILE *open_file(const char *dir, const char *name) {
+    char path[512];
+    FILE *file;
+
+    snprintf(path, sizeof(path), "%s/%s", dir, name);
+    file = fopen(path, "r");
+    if(file == NULL) {
+        perror(path);
+        exit(1);
+    }
+    return file;
+}
+
+static uint8_t load_frames(const char *dir, const char *name) {
+    bool hex = strstr(name, ".hex") != NULL;
+    FILE *file = open_file(dir, name);
+    char line[2 * MAX_LEN + 2];
+    uint8_t count = 0;
+
+    while(count < MAX_FRAMES && fgets(line, sizeof(line), file) != NULL) {
+        size_t len = strcspn(line, "\r\n");
+        if(len == 0) continue;
+        if(hex) {
+            len /= 2;
+            for(size_t i = 0; i < len; i++) {
+                unsigned int byte;
+                sscanf(line + 2 * i, "%2x", &byte);
+                frames[count][i] = (uint8_t)byte;
+            }
+        } else {
+            memcpy(frames[count], line, len);
+        }
+        lens[count++] = (uint8_t)len;
+    }
+    fclose(file);
+    return count;
+}
+
+static void load_dict(const char *dir, const char *name) {
+    FILE *file;
+
+    dict_len = 0;
+    if(name == NULL) return;
+    file = open_file(dir, name);
+    dict_len = (uint8_t)fread(dict, 1, MAX_DICT, file);
+    fclose(file);
+}
+
+/* Like send_data(): only if it saves a byte, header included */
+static uint8_t compress(uint8_t index) {
+    if(lens[index] < ZIP_MIN_LEN) return 0;
+    return lzss_compress(frames[index], lens[index], zipped[index],
+                         lens[index] - ZIP_HEADER_LEN - 1,
+                         dict_len ? dict : NULL, dict_len);
+}
+
+static bool decodes(uint8_t index) {
+    uint8_t out[MAX_LEN];
+    lzss_decoder_t dec;
+
+    lzss_decoder_init(&dec, out, lens[index], dict_len ? dict : NULL,
+                      dict_len);
+    for(uint8_t i = 0; i < zip_lens[index]; i++)
+        if(!lzss_decode(&dec, zipped[index][i])) return false;
+    return lzss_done(&dec) && memcmp(out, frames[index], lens[index]) == 0;
+}
+
+static bool run(const char *dir, const corpus_t *corpus) {
+    uint8_t count = load_frames(dir, corpus->file);
+    uint32_t plain = 0, sent = 0, zipped_bytes = 0;
+    uint64_t start, compress_ticks, decode_ticks;
+    uint8_t errors = 0;
+
+    load_dict(dir, corpus->dict);
+    for(uint8_t i = 0; i < count; i++) {
+        zip_lens[i] = compress(i);
+        plain += lens[i];
+        if(zip_lens[i] == 0) {
+            sent += lens[i];
+            continue;
+        }
+        sent += zip_lens[i] + ZIP_HEADER_LEN;
+        zipped_bytes += lens[i];
+        if(!decodes(i)) errors++;
+    }
+
+    start = ticks();
+    for(uint16_t r = 0; r < REPEAT; r++)
+        for(uint8_t i = 0; i < count; i++) compress(i);
+    compress_ticks = ticks() - start;
+
+    start = ticks();
+    for(uint16_t r = 0; r < REPEAT; r++) {
+        for(uint8_t i = 0; i < count; i++) {
+            uint8_t out[MAX_LEN];
+            lzss_decoder_t dec;
+            if(zip_lens[i] == 0) continue;
+            lzss_decoder_init(&dec, out, lens[i], dict_len ? dict : NULL,
+                              dict_len);
+            for(uint8_t j = 0; j < zip_lens[i]; j++)
+                lzss_decode(&dec, zipped[i][j]);
+        }
+    }
+    decode_ticks = ticks() - start;
+
+    printf("  %-18s %-4s %5.2f  %8.0f  ", corpus->name,
+           corpus->dict ? "yes" : "no", (double)plain / sent,
+           (double)compress_ticks / REPEAT / plain);
+    if(zipped_bytes) // Of the frames sent compressed
+        printf("%10.0f  %u\n", (double)decode_ticks / REPEAT / zipped_bytes,
+               errors);
+    else
+        printf("%10s  %u\n", "-", errors);
+    return errors == 0;
+}
+
+int main(int argc, char **argv) {
+    const char *dir = argc > 1 ? argv[1] : "Corpora";
+    bool ok = true;
+
+#ifdef __x86_64__
+    printf("Ratio with the zip header, x86 cycles per byte\n");
+#else
+    printf("Ratio with the zip header, ns per byte\n");
+#endif /* __x86_64__ */
+    printf("  %-18s %-4s %5s  %8s  %10s  %s\n", "corpus", "dict", "ratio",
+           "compress", "decompress", "errors");
+    for(uint8_t i = 0; i < sizeof(corpora) / sizeof(corpora[0]); i++)
+        if(!run(dir, &corpora[i])) ok = false;
+    return ok ? 0 : 1;
+}
@@ -0,0 +1,135 @@
+/*
+ * Filename:    mac_rounds.c
+ * Project:     OpenPAYGO Link
+ * Author:      Daniel Nedosseikine
+ * Company:     Solaris Offgrid
+ * Created on:  19/10/2026
+ * Description: Host harness of the frame MAC (OPL_AUTH). Checks Speck32/64
+ *              against its test vector and the MAC against a plain CBC-MAC,
+ *              and counts the Speck rounds run per byte and per frame to check
+ *              the cycle budget of the UART ISR.
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include "speck.h"
+#include "frame_mac.h"
+
+/* Cost of a round in compiled C on the STM8, hand-counted from the instruction
+ * set (about 35 cycles) with a margin for the compiler */
+#define CYCLES_PER_ROUND 100
+#define F_CPU 2000000UL
+#define BYTE_TIME_US 573 // 11 bits at 19200 baud
+#define MAX_MAC_LEN 128 // Header, payload and ZIP lengths of the longest frame
+
+/* Linked with -Wl,--wrap=speck_rounds, every call of frame_mac is counted */
+void __real_speck_rounds(const uint16_t *round_keys, uint16_t *x, uint16_t *y,
+                         uint8_t first, uint8_t last);
+
+static uint32_t rounds = 0;
+
+void __wrap_speck_rounds(const uint16_t *round_keys, uint16_t *x, uint16_t *y,
+                         uint8_t first, uint8_t last) {
+    rounds += last - first;
+    __real_speck_rounds(round_keys, x, y, first, last);
+}
+
+/* Test vector of ePrint 2013/404, appendix C */
+static bool speck_vector_ok() {
+    const uint8_t key[SPECK_KEY_SIZE] = {0x19, 0x18, 0x11, 0x10,
+                                         0x09, 0x08, 0x01, 0x00};
+    uint16_t round_keys[SPECK_ROUNDS];
+    uint16_t x = 0x6574, y = 0x694C;
+
+    speck_expand_key(key, round_keys);
+    speck_encrypt(round_keys, &x, &y);
+    return x == 0xA868 && y == 0x42F2;
+}
+
+/* CBC-MAC with whole block encryptions, zero padding, then the counter */
+static void reference_mac(const uint16_t *round_keys, const uint8_t *buf,
+                          uint8_t len, uint32_t counter, uint8_t *tag) {
+    uint16_t x = 0, y = 0;
+
+    for(uint8_t i = 0; i < len; i += 4) {
+        uint8_t block[4] = {0, 0, 0, 0};
+        memcpy(block, buf + i, (len - i < 4) ? len - i : 4);
+        x ^= ((uint16_t)block[0] << 8) | block[1];
+        y ^= ((uint16_t)block[2] << 8) | block[3];
+        speck_encrypt(round_keys, &x, &y);
+    }
+    x ^= (uint16_t)(counter >> 16);
+    y ^= (uint16_t)counter;
+    speck_encrypt(round_keys, &x, &y);
+
+    tag[0] = (uint8_t)(x >> 8);
+    tag[1] = (uint8_t)x;
+    tag[2] = (uint8_t)(y >> 8);
+    tag[3] = (uint8_t)y;
+}
+
+static double rounds_to_ms(uint32_t count) {
+    return (double)count * CYCLES_PER_ROUND * 1000.0 / F_CPU;
+}
+
+int main() {
+    const uint8_t key[SPECK_KEY_SIZE] = {1, 2, 3, 4, 5, 6, 7, 8};
+    uint16_t round_keys[SPECK_ROUNDS];
+    uint32_t max_byte = 0, max_final = 0;
+    uint16_t mismatches = 0;
+    bool ok = true;
+
+    if(!speck_vector_ok()) {
+        printf("Speck32/64 test vector FAILED\n");
+        return 1;
+    }
+    speck_expand_key(key, round_keys);
+
+    printf("  len  per byte  final  total\n");
+    for(uint16_t len = 1; len <= MAX_MAC_LEN; len++) {
+        uint8_t buf[MAX_MAC_LEN];
+        uint8_t tag[MAC_TAG_LEN], ref[MAC_TAG_LEN];
+        uint32_t counter = 0x12345678UL + len;
+        uint32_t byte_max = 0, total = 0;
+        frame_mac_t mac;
+
+        for(uint16_t i = 0; i < len; i++) buf[i] = (uint8_t)(i * 37 + len);
+
+        rounds = 0;
+        frame_mac_init(&mac, round_keys);
+        for(uint16_t i = 0; i < len; i++) { // One call per UART interrupt
+            uint32_t before = rounds;
+            frame_mac_update(&mac, buf[i]);
+            if(rounds - before > byte_max) byte_max = rounds - before;
+        }
+        total = rounds;
+        frame_mac_final(&mac, counter, tag); // Main loop
+        total = rounds - total;
+
+        reference_mac(round_keys, buf, (uint8_t)len, counter, ref);
+        if(memcmp(tag, ref, MAC_TAG_LEN) != 0) mismatches++;
+
+        if(byte_max > max_byte) max_byte = byte_max;
+        if(total > max_final) max_final = total;
+        if(len <= 8 || len % 16 == 0)
+            printf("  %3u  %8lu  %5lu  %5lu\n", len, (unsigned long)byte_max,
+                   (unsigned long)total, (unsigned long)rounds);
+    }
+
+    printf("MAC mismatches: %u\n", mismatches);
+    printf("ISR, worst byte: %lu rounds, %.2f ms of %.2f ms byte time\n",
+           (unsigned long)max_byte, rounds_to_ms(max_byte),
+           BYTE_TIME_US / 1000.0);
+    printf("Main loop, worst frame end: %lu rounds, %.2f ms\n",
+           (unsigned long)max_final, rounds_to_ms(max_final));
+
+    if(mismatches != 0) ok = false;
+    if(max_byte > MAC_ROUNDS_PER_BYTE ||
+       rounds_to_ms(max_byte) * 1000.0 >= BYTE_TIME_US) {
+        printf("Over the ISR budget\n");
+        ok = false;
+    }
+    return ok ? 0 : 1;
+}
@@ -0,0 +1,111 @@
+/*
+ * Filename:    rs_check.c
+ * Project:     OpenPAYGO Link
+ * Author:      Daniel Nedosseikine
+ * Company:     Solaris Offgrid
+ * Created on:  19/10/2026
+ * Description: Host test of the Reed-Solomon codec of OPL_FEC. Encodes random
+ *              codewords byte by byte, corrupts random bytes and checks that
+ *              every codeword within the capacity of the code is corrected.
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include "rs.h"
+
+#define CODEWORDS 200000 // Per parity length
+#define MAX_N 128 // Longest frame
+
+typedef struct {
+    long corrected; // Within the capacity, must be all of them
+    long failed;
+    long detected; // Over the capacity, RS_FAILED
+    long miscorrected; // Over the capacity, left to the CRC
+} counts_t;
+
+/* Random codeword of parity_len parity bytes, n bytes in total */
+static uint8_t encode(uint8_t *word, uint8_t parity_len) {
+    uint8_t n = parity_len + 1 + rand() % (MAX_N - parity_len);
+    uint8_t parity[RS_MAX_PARITY] = {0};
+
+    for(uint8_t i = 0; i < n - parity_len; i++) {
+        word[i] = (uint8_t)rand();
+        rs_encode(parity, parity_len, word[i]);
+    }
+    memcpy(word + n - parity_len, parity, parity_len);
+    return n;
+}
+
+/* Up to one error over the capacity, some hit the same byte */
+static uint8_t corrupt(uint8_t *word, uint8_t n, uint8_t parity_len) {
+    uint8_t errors = rand() % (parity_len / 2 + 2);
+
+    for(uint8_t e = 0; e < errors; e++) word[rand() % n] ^= 1 + rand() % 255;
+    return errors;
+}
+
+static void check(uint8_t parity_len, counts_t *counts) {
+    uint8_t word[MAX_N], received[MAX_N];
+    uint8_t syndromes[RS_MAX_PARITY], pos[RS_MAX_PARITY], val[RS_MAX_PARITY];
+    uint8_t n, corrupted, found;
+    bool good;
+
+    rs_init(parity_len);
+    for(long k = 0; k < CODEWORDS; k++) {
+        n = encode(word, parity_len);
+        memcpy(received, word, n);
+        corrupt(received, n, parity_len);
+
+        corrupted = 0;
+        for(uint8_t i = 0; i < n; i++) corrupted += received[i] != word[i];
+
+        memset(syndromes, 0, sizeof(syndromes));
+        for(uint8_t i = 0; i < n; i++)
+            rs_syndromes(syndromes, parity_len, received[i]);
+        found = rs_correct(syndromes, parity_len, n, pos, val);
+        if(found != RS_FAILED)
+            for(uint8_t i = 0; i < found; i++) received[pos[i]] ^= val[i];
+        good = memcmp(word, received, n) == 0;
+
+        if(corrupted <= parity_len / 2) {
+            if(good) {
+                counts->corrected++;
+            } else {
+                if(counts->failed < 5)
+                    printf("FAILED parity %u, n %u, %u bytes corrupted\n",
+                           parity_len, n, corrupted);
+                counts->failed++;
+            }
+        } else if(found == RS_FAILED) {
+            counts->detected++;
+        } else if(!good) {
+            counts->miscorrected++;
+        }
+    }
+}
+
+int main() {
+    counts_t total = {0};
+
+    srand(1);
+    printf("  parity  corrected  failed  detected  miscorrected\n");
+    for(uint8_t parity_len = 2; parity_len <= RS_MAX_PARITY; parity_len += 2) {
+        counts_t counts = {0};
+        check(parity_len, &counts);
+        printf("  %6u  %9ld  %6ld  %8ld  %12ld\n", parity_len,
+               counts.corrected, counts.failed, counts.detected,
+               counts.miscorrected);
+        total.corrected += counts.corrected;
+        total.failed += counts.failed;
+        total.detected += counts.detected;
+        total.miscorrected += counts.miscorrected;
+    }
+    printf("Within the capacity: %ld corrected, %ld failed\n",
+           total.corrected, total.failed);
+    printf("Over the capacity: %ld detected, %ld miscorrected\n",
+           total.detected, total.miscorrected);
+    return total.failed == 0 ? 0 : 1;
+}